@@ -14,9 +14,18 @@
 --	                      direction the player is moving in a straight line
 --	* runStartX, runStartY  (integers, optional)
 --	                    - (player only) From where running started
+--	* travelPath (table, optional) - (player only) if not nil, the path
+--	                      being followed by travel or auto-explore, a flat
+--	                      list {x, y, ...} (see Actor:startTravel())
+--	* travelStep (int)  - (player only) the next tile of travelPath
+--	* travelExplore (bool) - (player only) true if auto-exploring
+--	* travelHp, travelMessages (int) - (player only) hp and UI.messageCount
+--	                      when travel last checked for interruptions
 --	* sightMap (2D bool table) - a map showing the tiles visible to the actor.
 --	                      Computed at the start of a turn, stale after acting!
 --	* sightMapStale (bool) - True if sightMap may be out of date.
+--	* sightEpoch (int) - the epoch of the map (see layers:epoch()) when
+--	                      sightMap was computed
 --	* aiState (any?)    - (nonplayer only) Indicates current state of AI
 --	* sightRange (int)  - Number of tiles the actor can see
 --	* inventory (table) - Mapping from inventory slot (letter) to Items
@@ -24,7 +33,20 @@
 --	*	alive (boolean)   - true if the actor can act
 --	* actionPoints (int) - the number of action points the actor currently has
 --	* agility (int) - the number of action points the actor is awarded with each turn
---	* activeEffects (table) - contains the currently active effects
+--	* activeEffects (table) - maps the keys of the currently active effects
+--	                      (see Actor.effects) to {name, timeToLive, timer}
+--	* plannedMove (table, optional) - (nonplayer only) this turn's move as
+--	                      planned by Game:planCrowdMoves()
+--	* lastMoveX, lastMoveY (int, optional) - (nonplayer only) the direction
+--	                      of the last move the AI chose, repeated by the cheap AI
+--	* costProfile (string) - name of the cost profile (see tile.lua) used to
+--	                      find paths for the actor
+--	* desires (table, optional) - (nonplayer only) for each AI state in
+--	                      which the actor moves ("chase", "flee"), the
+--	                      weights of the maps it combines to decide where to
+--	                      go (see Game:getDesireMap())
+--	* smells (bool, optional) - (nonplayer only) whether the actor notices
+--	                      the player's scent (see Map.layers)
 --
 --  Also, Actor has the following enums:
 --	* InventorySlots    - List of inventory slots (e.g. "a")
@@ -43,7 +65,8 @@ local Tile = require "lua/tile"
 local Util = require "lua/util"
 local Itemdefs = require "lua/itemdefs"
 
-local _nextId = 0
+--	Ids start from 1; 0 means no actor in Map.layers' occupancy layer
+local _nextId = 1
 
 --	Actor:new() - creates a new Actor object, initializing its members with
 --	default data; returns the created Actor object
@@ -77,9 +100,119 @@ function Actor:new()
 	return a
 end
 
---	Actor:addEffect() - adds an effect to the player; does not return anything
-function Actor:addEffect(name, effect, timeToLive)
-	self.activeEffects[name] = { effect = effect, timeToLive = timeToLive }
+--	Actor.effects - the kinds of effects which actors can be under. Effects
+--	are data, and are run by a timer on Game.effectWheel which goes off every
+--	`period` turns, so actors without effects cost nothing. Each has:
+--	*	name (string) - shown on the status line
+--	*	duration (int) - how many turns the effect lasts
+--	*	period (int, optional) - how often the effect happens; by default only
+--		once it runs out
+--	*	damage (int, optional) - damage taken each period, with deathReason
+--		and hurtMessage (shown to the player)
+--	*	skills (table, optional) - skills which the effect sets while active
+--		(see Actor:updateSkills())
+Actor.effects = {
+	burning = {
+		name = "{{RED}}Burning",
+		duration = 5,
+		period = 1,
+		damage = 1,
+		deathReason = "burned to death",
+		hurtMessage = "{{RED}}You take damage from burning.",
+		--	burning makes you unable to effectively use your weapons
+		skills = { melee = 0, handguns = 0, shotguns = 0 },
+	},
+}
+
+--	Actor.effectsById - lists Actor.effects, giving each an id (carried by
+--	its timers)
+Actor.effectsById = {}
+for key, effect in pairs(Actor.effects) do
+	table.insert(Actor.effectsById, effect)
+	effect.key = key
+	effect.id = #Actor.effectsById
+end
+
+--	Actor:addEffect() - puts the actor under the effect with the given key
+--	(see Actor.effects); if it's already under it, the effect starts over;
+--	does not return anything
+function Actor:addEffect(key)
+	local effect = Actor.effects[key]
+	local active = self.activeEffects[key]
+	if active then
+		active.timeToLive = effect.duration
+		return
+	end
+
+	self.activeEffects[key] = {
+		name = effect.name,
+		timeToLive = effect.duration,
+		timer = Game.effectWheel:schedule(effect.period or effect.duration,
+			self._id, effect.id),
+	}
+	self:updateSkills()
+end
+
+--	Actor:removeEffect() - ends the effect with the given key early, if the
+--	actor is under it; does not return anything
+function Actor:removeEffect(key)
+	local active = self.activeEffects[key]
+	if active then
+		Game.effectWheel:cancel(active.timer)
+		self.activeEffects[key] = nil
+		self:updateSkills()
+	end
+end
+
+--	Actor:runEffect() - called when the timer with the given handle of one of
+--	the actor's effects goes off (see Game:updateEffects()): the effect
+--	happens, and either runs out or its timer is set again; does not return
+--	anything
+function Actor:runEffect(effect, timer)
+	local active = self.activeEffects[effect.key]
+	if not active or active.timer ~= timer then
+		return
+	end
+
+	local period = effect.period or effect.duration
+	active.timeToLive = active.timeToLive - period
+	if effect.damage then
+		self:takeDamage(nil, effect.damage, effect.deathReason)
+		if self == Game.player and effect.hurtMessage then
+			UI:message(effect.hurtMessage)
+		end
+		if not self.alive then
+			return
+		end
+	end
+
+	if active.timeToLive <= 0 then
+		self.activeEffects[effect.key] = nil
+		self:updateSkills()
+		if self == Game.player then
+			UI:message("You are no longer " .. effect.name .. "{{normal}}.")
+		end
+	else
+		active.timer = Game.effectWheel:schedule(
+			math.min(period, active.timeToLive), self._id, effect.id)
+	end
+end
+
+--	Actor:updateSkills() - sets the actor's skills to its base skills, as
+--	changed by its active effects; must be called when either changes. Does
+--	nothing for actors without skills; does not return anything
+function Actor:updateSkills()
+	if not self.baseSkills then
+		return
+	end
+	for skill, value in pairs(self.baseSkills) do
+		self.skills[skill] = value
+	end
+	for key in pairs(self.activeEffects) do
+		for skill, value in pairs(Actor.effects[key].skills or {}) do
+			self.skills[skill] = value
+		end
+	end
 end
 
 --	Actor:initInventory() - fills an actor's inventory depending on its
@@ -134,7 +267,9 @@ end
 function Actor:setMap(map)
 	Log:write(self, " has been placed on ", map, ".")
 
+	self:setOccupancy(false)
 	self.map = map
+	self:setOccupancy(true)
 
 	self.sightMapStale = true
 
@@ -144,13 +279,37 @@ function Actor:setMap(map)
 	end
 end
 
+--	Actor:setOccupancy() - records whether the actor is on its tile in the
+--	map's occupancy layer (see Map:isOccupied()); does not return anything
+function Actor:setOccupancy(occupied)
+	if not self.map or not self.map:isInBounds(self.x, self.y) then
+		return
+	end
+	if occupied and self.alive then
+		self.map.layers:setOccupant(self.x, self.y, self._id)
+	elseif self.map.layers:occupant(self.x, self.y) == self._id then
+		self.map.layers:setOccupant(self.x, self.y, 0)
+	end
+end
+
+--	Actor:swapPlaces() - swaps the positions of two actors on the same map;
+--	does not return anything
+function Actor:swapPlaces(other)
+	local x, y = self.x, self.y
+	Log:write(self, " swaps places with ", other, ".")
+	self:setPosition(other.x, other.y)
+	other:setPosition(x, y)
+end
+
 --	Actor:setPosition() - sets the (x, y) position of the given Actor object;
 --	does not return anything
 function Actor:setPosition(x, y)
 	Log:write(self, " has been placed at (" .. x .. ", " .. y .. ").")
 
+	self:setOccupancy(false)
 	self.x = x
 	self.y = y
+	self:setOccupancy(true)
 
 	self.sightMapStale = true
 
@@ -230,13 +389,11 @@ end
 --	also checks for death; does not return anything
 function Actor:takeDamage(attacker, quantity, reason)
 	self.hp = self.hp - quantity
+	if self.hp <= 0 and self ~= Game.player then
+		--	described along with the attacks (see Game:showCombatLog())
+		Game.combatLog:death(self.map.num, self._id, self.x, self.y)
+	end
 	if self:dead(reason) then
-		if self:visible() then
-			UI:message("{{red}}The " .. self.name .. " dies!")
-		else
-			UI:message("{{red}}You hear a thud.")
-		end
-
 		--	award experience points to the player unless they killed themselves
 		if attacker == Game.player and self ~= Game.player then
 			--	TODO: fixed number of experience points for now
@@ -405,6 +562,7 @@ end
 --	does not return anything
 function Actor:die(reason)
 	Log:write(self, " has died.")
+	self:setOccupancy(false)
 	self.alive = false
 
 	--	drop a corpse; the player character doesn't drop a corpse
@@ -461,60 +619,45 @@ end
 --	Actor:updateSight() - calculates the given actor's sight map;
 --	does not return anything
 function Actor:updateSight()
-	local function traceRay(xOffset, yOffset, maxLength)
-		--	the center of a tile is at (+0.5, +0.5)
-		local currentX, currentY = self.x + 0.5, self.y + 0.5
-		local x, y = math.floor(currentX), math.floor(currentY)
-		local currentLength = 0
-
-		--	loop while advancing the ray's path
-		repeat
-			self.sightMap[x][y] = true
+	--	the player's sight map may have been computed while waiting for input
+	if self == Game.player and Game:takeSpeculation() then
+		return
+	end
 
-			--	update the map memory for the player character
-			if self == Game.player then
-				self.map.memory[x][y] = self.map.tile[x][y].face
-			end
+	self:setSightMap(clib.sightMap(self.map.layers, self.x, self.y, self.sightRange))
+	Log:write("Sight map calculated for ", self)
+end
 
-			--	the point of origin and opaque obstacles are always visible
-			if currentLength > 0 and self.map:isOpaque(x, y) then
-				break
-			end
+--	Actor:setSightMap() - installs a freshly computed sight map (a 2D grid of
+--	booleans) for the actor's current position, updating the player's memory
+--	of the map; does not return anything
+function Actor:setSightMap(sightMap)
+	self.sightMap = sightMap
+	self.sightMapStale = false
+	self.sightEpoch = self.map.layers:epoch()
 
-			currentX = currentX + xOffset
-			currentY = currentY + yOffset
-			x = math.floor(currentX)
-			y = math.floor(currentY)
-			currentLength = currentLength + 1
-		until currentLength > maxLength or not self.map:isInBounds(x, y)
+	if self ~= Game.player then
+		return
 	end
 
-	--	clear the previously calculated sight map
-	for i = 1, Global.mapWidth do
-		for j = 1, Global.mapHeight do
-			self.sightMap[i][j] = false
+	--	update the map memory for the player character; nothing further than
+	--	sightRange tiles away can be visible
+	local range = self.sightRange + 1
+	for i = math.max(1, self.x - range), math.min(Global.mapWidth, self.x + range) do
+		for j = math.max(1, self.y - range), math.min(Global.mapHeight, self.y + range) do
+			if sightMap[i][j] then
+				self.map.memory[i][j] = self.map.tile[i][j].face
+			end
 		end
 	end
 
-	--	raytrace around the player
-	for i = 1, 360 do
-		local xOffset = math.cos(i * math.pi / 180)
-		local yOffset = math.sin(i * math.pi / 180)
-		traceRay(xOffset, yOffset, self.sightRange)
-	end
-
 	--	Update the player's memory of item positions
-	if self == Game.player then
-		for i = 1, #(Game.itemList) do
-			local item = Game.itemList[i]
-			if item.map == self.map and self.sightMap[item.x][item.y] then
-				self.map.memory[item.x][item.y] = item.face
-			end
+	for i = 1, #(Game.itemList) do
+		local item = Game.itemList[i]
+		if item.map == self.map and sightMap[item.x][item.y] then
+			self.map.memory[item.x][item.y] = item.face
 		end
 	end
-
-	self.sightMapStale = false
-	Log:write("Sight map calculated for ", self)
 end
 
 
@@ -573,7 +716,7 @@ function Actor:move(x, y)
 			UI:message("{{yellow}}You find a hidden door!")
 		end
 
-		self.map.tile[x][y] = Tile.closedDoor
+		self.map:setTile(x, y, Tile.closedDoor)
 		return 0
 	end
 
@@ -595,49 +738,38 @@ function Actor:move(x, y)
 	return Global.actionCost.move
 end
 
+--	Actor.attackVerbs - the attack verbs of weapons (Weapon.attack) used so
+--	far, numbered for the combat log (see Game:showCombatLog())
+Actor.attackVerbs = {}
+local attackVerbIds = {}
+
+local function attackVerbId(verb)
+	if not attackVerbIds[verb] then
+		table.insert(Actor.attackVerbs, verb)
+		attackVerbIds[verb] = #Actor.attackVerbs
+	end
+	return attackVerbIds[verb]
+end
+
 --	Actor:doAttack() - Apply a melee or ranged attack to a target, returns a
---	bool to say	whether the attack hit.
+--	bool to say	whether the attack hit. The attack is rolled and recorded by
+--	Game.combatLog, and only described if the player can see it, once the
+--	screen is next drawn (see Game:showCombatLog()).
 --	 ranged:  true if a ranged attack.
+--	 hit:     (optional) whether the attack hit, if already decided (e.g. by
+--	          clib.traceVolley()); otherwise rolled against weapon.accuracy
 --	(Note: in future we'll likely have to separate out ranged and melee
 --	attacks again, and just share code for the message)
-function Actor:doAttack(defender, weapon, ranged)
-	--	calculate whether attack hit
-	local hit = (math.random() <= weapon.accuracy)
-
-	local damage = math.random(weapon.minDamage, weapon.maxDamage)
-
-	--	Report attack to player
-
-	local extrainfo = ""
-	if hit and Global.debugInfo then
-		extrainfo = " {" .. damage .. " damage}"
-	end
-
-	local attackVerb = weapon.attack
-	if hit == false then
-		if self == Game.player then
-			attackVerb = "miss"
-		else
-			attackVerb = "misses"
-		end
+function Actor:doAttack(defender, weapon, ranged, hit)
+	local accuracy = weapon.accuracy
+	if hit ~= nil then
+		accuracy = hit and 1 or 0
 	end
 
-	local defenderName
-	if defender == Game.player then
-		defenderName = "you"
-	elseif defender:visible() then
-		defenderName = "the " .. defender.name
-	else
-		defenderName = "an unseen foe"
-	end
-
-	if self == Game.player then
-		UI:message("You " .. attackVerb .. " " .. defenderName .. "!" .. extrainfo)
-	elseif self:visible() then
-		UI:message("The " .. self.name .. " " .. attackVerb .. " " .. defenderName .. "." .. extrainfo)
-	elseif defender:visible() and ranged then
-		UI:message("A shot misses " .. defenderName)
-	end
+	local damage
+	hit, damage = Game.combatLog:attack(self.map.num, self._id, self.x, self.y,
+		defender._id, defender.x, defender.y, attackVerbId(weapon.attack),
+		accuracy, weapon.minDamage, weapon.maxDamage, ranged)
 
 	--	Do effects
 	if hit then
@@ -666,14 +798,55 @@ function Actor:meleeAttack(defender)
 end
 
 --	Actor:rangedAttack() - called when the actor's projectile intercepts
---	another actor; returns true if the projectile hit (whether or not it caused
---	damage), false if it flies past.
-function Actor:rangedAttack(defender, weapon)
-	return (self:doAttack(defender, weapon, true))
+--	another actor, with whether it hit (see clib.traceVolley()); returns true
+--	if the projectile hit (whether or not it caused damage), false if it flies
+--	past.
+function Actor:rangedAttack(defender, weapon, hit)
+	return (self:doAttack(defender, weapon, true, hit))
 end
 
---	Actor:fireWeapon() - actor fires their weapon in some direction. Animates
---	the weapon firing and calls self:rangedAttack() on all targets.
+--	Actor:animateVolley() - shows the projectiles of a volley flying along
+--	their paths (as returned by clib.traceVolley()) all at once, one tile per
+--	animation frame; does not return anything
+function Actor:animateVolley(paths, face)
+	local bullets, flying, longest = {}, {}, 0
+	for i, path in ipairs(paths) do
+		flying[i] = true
+		bullets[i] = Particle.new()
+		Game:addParticle(bullets[i])
+		bullets[i]:setMap(self.map)
+		bullets[i]:setFace(face)
+		bullets[i]:setColor(curses.red)
+		longest = math.max(longest, #path / 2)
+	end
+
+	for step = 1, longest do
+		local nexttick = clib.time() + Global.animationFrameLength
+		for i, path in ipairs(paths) do
+			if path[step * 2] then
+				bullets[i]:setPosition(path[step * 2 - 1], path[step * 2])
+			elseif flying[i] then
+				--	this one has stopped
+				Game:removeParticle(bullets[i])
+				flying[i] = false
+			end
+		end
+		UI:drawScreen()
+		curses.refresh()
+		clib.sleep(nexttick - clib.time())
+	end
+
+	for i = 1, #bullets do
+		if flying[i] then
+			Game:removeParticle(bullets[i])
+		end
+	end
+end
+
+--	Actor:fireWeapon() - actor fires their weapon in some direction. The whole
+--	volley (all the pellets of a shotgun) is traced at once by
+--	clib.traceVolley(), then animated, then self:rangedAttack() is called on
+--	all targets in the order they were reached.
 --	Returns the number of action points consumed.
 function Actor:fireWeapon(direction)
 	local weapon = self.equipment.rangedWeapon
@@ -712,61 +885,118 @@ function Actor:fireWeapon(direction)
 		ul = '\\', dr = '\\', ur = '/', dl = '/'
 	}
 
-	local bullet = Particle.new()
-	Game:addParticle(bullet)
-	bullet:setMap(self.map)
-	bullet:setFace(bulletIcons[direction])
-	bullet:setColor(curses.red)
-
-	local x, y = self.x, self.y
 	local diffx, diffy = Util.xyFromDirection(direction)
-	local nexttick
-	local hit = false --	Have hit something
-
-	for i = 1, weapon.range do
-		--	Aniamtion timing
-		nexttick = clib.time() + Global.animationFrameLength
-
-		x = x + diffx
-		y = y + diffy
-		bullet:setPosition(x, y)
-
-		--	Check for collisions
-		local actorHere = self.map:isOccupied(x, y)
-		if actorHere then
-			if self:rangedAttack(actorHere, weapon) then
-				--bullet:setFace('%')
-				hit = true
+	local paths, events = clib.traceVolley(self.map.layers, "projectile",
+		self.x, self.y, {{
+			dx = diffx, dy = diffy, range = weapon.range,
+			accuracy = weapon.accuracy, pellets = weapon.pellets,
+			spread = weapon.spread, penetration = weapon.penetration,
+		}}, math.random(0, 0x7fffffff))
+
+	if Global.animations then
+		self:animateVolley(paths, bulletIcons[direction])
+	end
+
+	--	events are {projectile, step, x, y, id, hit, ...}
+	for i = 1, #events, 6 do
+		local x, y, id = events[i + 2], events[i + 3], events[i + 4]
+		if id ~= 0 then
+			--	an earlier pellet may have killed it
+			local actorHere = Game.actorsById[id]
+			if actorHere and actorHere.alive then
+				self:rangedAttack(actorHere, weapon, events[i + 5] == 1)
 			end
-		end
-
-		--	shooting a locked door has a chance of breaking the lock
-		if self.map.tile[x][y].locked then
+		elseif self.map.tile[x][y].locked then
+			--	shooting a locked door has a chance of breaking the lock
 			if math.random() < 0.1 then
-				self.map.tile[x][y] = Tile.closedDoor
+				self.map:setTile(x, y, Tile.closedDoor)
 				UI:message("You break the lock!")
 			else
 				UI:message("You hit the lock, but it resists.")
 			end
 		end
+	end
 
-		if self.map:isSolid(x, y) then
-			--bullet:setFace('%')
-			hit = true
-		end
+	return Global.actionCost.rangedAttack
+end
+
+--	Actor:throwExplosive() - throws an explosive item (see
+--	Itemdefs.FragGrenade) in some direction: it flies like a projectile (see
+--	clib.traceVolley()) until it reaches its range, an actor or something
+--	solid, and goes off where it lands; does not return anything
+function Actor:throwExplosive(direction, item)
+	local diffx, diffy = Util.xyFromDirection(direction)
+	local paths, events = clib.traceVolley(self.map.layers, "projectile",
+		self.x, self.y, {{dx = diffx, dy = diffy, range = item.range}},
+		math.random(0, 0x7fffffff))
 
-		--	Display
+	--	it bounces off solid tiles, landing in front of them
+	local path = paths[1]
+	local landing = #path / 2
+	if #events > 0 and events[#events - 1] == 0 then
+		landing = landing - 1
+	end
+	local x, y = self.x, self.y
+	if landing > 0 then
+		x, y = path[landing * 2 - 1], path[landing * 2]
+	end
+
+	if Global.animations then
+		self:animateVolley(paths, "*")
+	end
+	self:blast(x, y, item.blastRadius, item.damage, "blown up by " .. self.name)
+end
+
+--	Actor:blast() - sets off an explosion caused by the actor at x, y, found
+--	by clib.areaOfEffect(): walls shelter what's behind them. Each actor
+--	caught takes up to 'damage', less the further it is from the centre, and
+--	waiting enemies up to Global.blastAlertRange steps away are alerted;
+--	does not return anything
+function Actor:blast(x, y, radius, damage, reason)
+	local tiles, caught = clib.areaOfEffect(self.map.layers, "projectile", x, y, radius)
+	if self.map == Game.player.map and Game.player.sightMap[x][y] then
+		UI:message("{{YELLOW}}There is an explosion!")
+	else
+		UI:message("You hear an explosion.")
+	end
+
+	if Global.animations then
+		local flames = {}
+		for i = 1, #tiles, 3 do
+			local flame = Particle.new()
+			Game:addParticle(flame)
+			flame:setMap(self.map)
+			flame:setFace("*")
+			flame:setColor(curses.YELLOW)
+			flame:setPosition(tiles[i], tiles[i + 1])
+			table.insert(flames, flame)
+		end
 		UI:drawScreen()
 		curses.refresh()
-		if Global.animations then
-			clib.sleep(nexttick - clib.time())
+		clib.sleep(Global.animationFrameLength * 5)
+		for _, flame in ipairs(flames) do
+			Game:removeParticle(flame)
 		end
+	end
 
-		if hit then break end
+	for id, falloff in pairs(caught) do
+		local actor = Game.actorsById[id]
+		if actor and actor.alive then
+			actor:takeDamage(self, math.max(1, math.floor(damage * falloff + 0.5)), reason)
+		end
 	end
-	Game:removeParticle(bullet)
 
-	return Global.actionCost.rangedAttack
+	--	waiting enemies within walking reach come to see what happened; the
+	--	search is bounded, so it only covers the tiles in reach
+	local reached = clib.dijkstraMaps(self.map.layers, {{x = x, y = y,
+		maxcost = Global.blastAlertRange, profile = "walker", sparse = true}})[1]
+	for _, tile in ipairs(reached) do
+		local actor = self.map:isOccupied(tile[1], tile[2])
+		if actor and actor ~= Game.player and actor.alive and actor.aiState == "wait" then
+			Log:write(actor, " was alerted by an explosion at (", x, ", ", y, ").")
+			actor.aiState = "chase"
+		end
+	end
 end
 
 --	Actor:canFireWeapon() - A unified function to check whether the player or
@@ -915,50 +1145,110 @@ function Actor:straightMovement()
 	return 0
 end
 
+--	Actor:startTravel() - (player only) starts following the way to the tile
+--	x, y or, if x, y aren't given, auto-exploring: going to the nearest
+--	unexplored part of the map, again and again. Ways only cross the tiles the
+--	player remembers (see clib.explorePath()), and are followed by
+--	Actor:travelMovement() without redrawing the screen until something
+--	interrupts them. Returns true if there is somewhere to go
+function Actor:startTravel(x, y)
+	local path = clib.explorePath(self.map.layers, self.map.memory,
+		self.costProfile, self.x, self.y, x, y)
+	if not path then
+		return false
+	end
+	self.travelPath, self.travelStep = path, 1
+	self.travelExplore = not x
+	self.travelHp, self.travelMessages = self.hp, UI.messageCount
+	return true
+end
+
+--	Actor:travelMovement() - takes the next step of travel or auto-explore,
+--	unless it's interrupted by another actor coming into view, the player
+--	being hurt, or a message (e.g. items on the tile stepped onto); returns
+--	the number of action points spent
+function Actor:travelMovement()
+	local id = clib.travelInterrupted(self.map.layers, self.sightMap, self._id)
+	if id then
+		UI:message("The " .. Game.actorsById[id].name .. " is in view.")
+		self.travelPath = nil
+		return 0
+	end
+	if self.hp < self.travelHp or UI.messageCount ~= self.travelMessages then
+		self.travelPath = nil
+		return 0
+	end
+
+	--	the frontier moves with every step, so auto-explore finds the way to it
+	--	again each time (it's only one Dijkstra map)
+	if self.travelExplore then
+		local path = clib.explorePath(self.map.layers, self.map.memory,
+			self.costProfile, self.x, self.y)
+		if not path then
+			UI:message("There's nothing left to explore.")
+			self.travelPath = nil
+			return 0
+		end
+		self.travelPath, self.travelStep = path, 1
+	end
+
+	--	Stop once there, or if something moved the player off the way
+	local x = self.travelPath[self.travelStep * 2 - 1]
+	local y = self.travelPath[self.travelStep * 2]
+	if not x or Util.dist(self.x, self.y, x, y) ~= 1 or self.map:isOccupied(x, y) then
+		self.travelPath = nil
+		return 0
+	end
+
+	local messages = UI.messageCount
+	local moved = self:move(x, y)
+	if moved == 0 then
+		self.travelPath = nil
+		return 0
+	end
+	if self.x == x and self.y == y then
+		self.travelStep = self.travelStep + 1
+		--	a message caused by stepping onto the tile stops travel
+		if UI.messageCount ~= messages then
+			self.travelPath = nil
+		end
+	end
+	--	(opening a door on the way doesn't)
+	self.travelMessages = UI.messageCount
+	return moved
+end
+
 --	Actor:act() - makes the given Actor object spend its turn; if the actor
 --	is player-controlled, it requests input from the player and acts according
 --	to the command(s) given; if the actor is not player-controlled, it
 --	dispatches the reasoning to the AI functions; returns true or false,
 --	depending on whether or not the turn was spent
 function Actor:act()
-	--	Update field of view at beginning of turn (assuming actors on other maps
-	--	don't act)
-	if self.map == Game.player.map and self.sightMapStale then
+	--	Update field of view at beginning of turn; other actors only need it to
+	--	notice the player, so do it in aiAct() when needed
+	if self == Game.player and self.sightMapStale then
 		self:updateSight()
 	end
 
-	--	TODO: non-player actors have no skills, making effects unable to work
-	if self == Game.player then
-		--	update skills to match base skills, before applying effects
-		self.skills.melee = self.baseSkills.melee
-		self.skills.handguns = self.baseSkills.handguns
-		self.skills.shotguns = self.baseSkills.shotguns
-		self.skills.lockpick = self.baseSkills.lockpick
-		self.skills.stealth = self.baseSkills.stealth
-
-		--	update active effects, removing them if their time-to-live has run out
-		for name, eff in pairs(self.activeEffects) do
-			eff.effect(self)
-			eff.timeToLive = eff.timeToLive - 1
-			if eff.timeToLive <= 0 then
-				self.activeEffects[name] = nil
-				UI:message("You are no longer " .. name .. "{{normal}}.")
-			end
-		end
-	end
-
 	if self == Game.player then
 		--	the actor is player controlled, so first inform the player of the
 		--	current state of the game, even if running (redrawing the screen for
-		--	each step is slow but useful to the player)
-		UI:drawScreen()
-		curses.refresh()
+		--	each step is slow but useful to the player); travel is only shown
+		--	once it stops
+		if not self.travelPath then
+			UI:drawScreen()
+			curses.refresh()
+		end
 
-		if self.runDir then
+		if self.travelPath then
+			--	The player is travelling or auto-exploring
+			return (self:travelMovement())
+		elseif self.runDir then
 			--	The player is moving in a straight line
 			return (self:straightMovement())
 		else
-			--	otherwise request for input
+			--	otherwise request for input, making use of the time spent waiting
+			Game:speculatePlayerMoves()
 			local k = curses.getch()
 			Log:write("Read character: " .. k)
 
@@ -1080,6 +1370,14 @@ function Actor:handleKey(key)
 		return 0	-- no time taken.
 	end
 
+	--	auto-explore
+	if key == "x" then
+		if not self:startTravel() then
+			UI:message("There's nothing left to explore.")
+		end
+		return 0	-- no time taken.
+	end
+
 	--	fire
 	if key == "f" then
 		return (self:playerFires())
@@ -1231,10 +1529,8 @@ function Actor:openDoor(x, y)
 		UI:message("You open the door.")
 	end
 
-	self.map.tile[x][y] = Tile.openDoor
-
 	--	the field of view may change
-	self.map:markChanged()
+	self.map:setTile(x, y, Tile.openDoor)
 	self.sightMapStale = true
 
 	--	the action has been completed successfully
@@ -1261,10 +1557,8 @@ function Actor:closeDoor(x, y)
 		UI:message("You close the door.")
 	end
 
-	self.map.tile[x][y] = Tile.closedDoor
-
 	--	the field of view may change
-	self.map:markChanged()
+	self.map:setTile(x, y, Tile.closedDoor)
 	self.sightMapStale = true
 
 	--	the action has been completed successfully
@@ -1301,7 +1595,7 @@ function Actor:unlockDoor(x, y)
 			UI:message("{{green}}You open the locked door using your {{GREEN}}" ..
 				self.map.tile[x][y].locked .. "{{pop}} keycard.")
 		end
-		self.map.tile[x][y] = Tile.openDoor
+		self.map:setTile(x, y, Tile.openDoor)
 		return Global.actionCost.unlockDoor
 	else
 		if self == Game.player then
@@ -1342,7 +1636,7 @@ function Actor:pickDoor(x, y)
 	local pickChance = self.skills.lockpick / 10
 
 	if math.random() < pickChance then
-		self.map.tile[x][y] = Tile.closedDoor
+		self.map:setTile(x, y, Tile.closedDoor)
 		if self == Game.player then
 			UI:message("{{green}}You successfully pick the lock!")
 		end
@@ -1351,6 +1645,9 @@ function Actor:pickDoor(x, y)
 		if self == Game.player then
 			UI:message("You fail to pick the lock.")
 		end
+		--	fumbling with the lock is noisy, less so for the stealthy
+		Game:makeNoise(self.map, x, y,
+			Global.noiseVolume.pickDoor - self.skills.stealth, self)
 		return Global.actionCost.pickDoor
 	end
 end
@@ -1358,6 +1655,16 @@ end
 
 -------------------------------------- AI -------------------------------------
 
+--	Actor:hearNoise() - called when the actor hears a noise made with
+--	Game:makeNoise(); 'loudness' is how much of its volume is left where the
+--	actor is. Waiting enemies go to investigate. Returns nothing.
+function Actor:hearNoise(noise, loudness)
+	if self ~= Game.player and self.aiState == "wait" then
+		Log:write(self, " heard a noise at (", noise.x, ", ", noise.y, ").")
+		self.aiState = "chase"
+	end
+end
+
 --	Actor:aiAct() - AI player takes a turn. Returns action points spent.
 function Actor:aiAct()
 	--	Wait if not on the player's map
@@ -1365,35 +1672,121 @@ function Actor:aiAct()
 		return Global.actionCost.wait
 	end
 
+	--	Far away actors, or all once this turn's time is up, act cheaply
+	if		Util.dist(self.x, self.y, Game.player.x, Game.player.y) > Global.aiDetailRange
+		or	Game:aiOverBudget() then
+		return (self:aiActCheap())
+	end
+
 	if self.aiState == "wait" then
 		--	Activate when it sees the player;
 		--	the 'stealth' skill decides whether the player makes him/herself visible
+		if self.sightMapStale then
+			self:updateSight()
+		end
 		if		self.sightMap[Game.player.x][Game.player.y]
 			and (Game.player.skills.stealth / 10) < math.random() then
 			self.aiState = "chase"
+		elseif	self.smells
+			and	self.map.layers:scent(self.x, self.y) >= Global.scent.threshold then
+			--	picked up the player's trail
+			self.aiState = "chase"
 		else
 			return Global.actionCost.wait
 		end
 	end
 
+	local distmap = self:aiGoalMap()
+	if distmap then
+		--	Move towards or away from the player, planning the moves of all
+		--	actors together once per turn
+		if Game.crowdPlanTurn ~= Game.turnCount then
+			Game:planCrowdMoves()
+		end
+		return (self:aiApproachGoals(distmap))
+	end
+
+	--	Wait
+	return Global.actionCost.wait
+end
+
+--	Actor:aiGoalMap() - returns the Dijkstra map which the actor's AI is
+--	currently following (towards lower values), or nil if it isn't moving
+function Actor:aiGoalMap()
+	if self.aiState ~= "chase" and self.aiState ~= "flee" then
+		return nil
+	end
+
 	--	Temporary for testing fleeing
 	if self.hp < self.maxHp then
 		self.aiState = "flee"
 	end
 
-	if self.aiState == "chase" then
-		--	Move towards player
-		local distmap = Game:getPlayerDistMap()
-		return (self:aiApproachGoals(distmap))
+	return Game:getDesireMap(self.costProfile, self.desires[self.aiState])
+end
+
+--	Actor:aiFollowPlan() - carries out the move planned for the actor by
+--	Game:planCrowdMoves(); returns action points spent, or nil if the plan
+--	can no longer be followed
+function Actor:aiFollowPlan(plan)
+	if plan.stay then
+		return Global.actionCost.wait
 	end
 
-	if self.aiState == "flee" then
-		--	Move away from player
-		local distmap = Game:getFleeMap()
-		return (self:aiApproachGoals(distmap))
+	local other = plan.swapWith
+	if other then
+		--	the other actor might have moved already, following its own plan
+		if		other.alive and other.map == self.map
+			and	other.x == plan.x and other.y == plan.y then
+			self:swapPlaces(other)
+			--	that was the other actor's move for this turn too
+			if other.plannedMove then
+				other.plannedMove.fromX, other.plannedMove.fromY = other.x, other.y
+				other.plannedMove.stay = true
+			end
+			return Global.actionCost.move
+		end
+		return nil
+	end
+
+	--	the tile may not have been vacated yet, if its occupant hasn't acted
+	local occupant = self.map:isOccupied(plan.x, plan.y)
+	if occupant and occupant ~= Game.player then
+		return nil
+	end
+	return (self:move(plan.x, plan.y))
+end
+
+--	Actor:aiActCheap() - a cheap substitute for aiAct(), used when the actor is
+--	far from the player or the turn's AI time budget has run out: attacks the
+--	player if chasing and adjacent, otherwise repeats the last move, or takes
+--	a random step, or waits. Returns action points spent.
+function Actor:aiActCheap()
+	Game.aiCheapActs = Game.aiCheapActs + 1
+
+	if self.aiState ~= "chase" and self.aiState ~= "flee" then
+		return Global.actionCost.wait
+	end
+
+	local player = Game.player
+	if		self.aiState == "chase"
+		and	Util.dist(self.x, self.y, player.x, player.y) == 1 then
+		return (self:move(player.x, player.y))
+	end
+
+	if self.lastMoveX then
+		local x, y = self.x + self.lastMoveX, self.y + self.lastMoveY
+		if self:canMoveTo(x, y) then
+			return (self:move(x, y))
+		end
+	end
+
+	local xoff, yoff = Util.xyFromDirection(Util.intToDir[math.random(0, 7)])
+	if self:canMoveTo(self.x + xoff, self.y + yoff) then
+		self.lastMoveX, self.lastMoveY = xoff, yoff
+		return (self:move(self.x + xoff, self.y + yoff))
 	end
 
-	--	Wait
 	return Global.actionCost.wait
 end
 
@@ -1402,6 +1795,18 @@ end
 --	the player. Returns action points spent.
 function Actor:aiApproachGoals(distmap)
 	local debug = false
+
+	--	Follow the plan made together with the other actors, if it still applies
+	local plan = self.plannedMove
+	self.plannedMove = nil
+	if		plan and plan.turn == Game.turnCount and plan.distmap == distmap
+		and	plan.fromX == self.x and plan.fromY == self.y then
+		local cost = self:aiFollowPlan(plan)
+		if cost then
+			return cost
+		end
+	end
+
 	local currentDist = distmap[self.x][self.y]
 
 	if debug then Log:write(self, " chasing from ", self.x, ",", self.y, " currentDist=", currentDist) end
@@ -1409,28 +1814,18 @@ function Actor:aiApproachGoals(distmap)
 	--	list of {distance, x, y} tuples
 	local choices = {}
 
-	--	Consider all movement options (including melee attacks, and in future
-	--	opening doors)
+	--	Consider all movement options (including melee attacks, and opening
+	--	doors by bumping into them)
 	for dirnum = 0, 7 do
 		local dir = Util.intToDir[dirnum]
 		local xoff, yoff = Util.xyFromDirection(dir)
 		local x, y = self.x + xoff, self.y + yoff
 
-		--	enemies can open closed doors; this is a side effect of lua's conversion
-		--	of numbers to boolean values - the 'solid' attribute of a tile can be
-		--	either a boolean, or a number value; if it's a number, it represents the
-		--	cost of the movement on that tile;
-		--	TODO: don't know if it's the cleanest way to approach this
-
-		--	only 'humanoid' AI type can open doors
-		local canmove
-		if self.aiType == "humanoid" then
-			canmove = self:canMoveTo(x, y) or self.map.tile[x][y] == Tile.closedDoor
-		else
-			canmove = self:canMoveTo(x, y)
-		end
-
+		--	tiles which are impassable for this actor's cost profile (e.g. closed
+		--	doors for actors which can't open them) are never reached, so have
+		--	the distance distmap.maxcost
 		local dist = distmap[x][y]
+		local canmove = dist < distmap.maxcost and not self.map:isOccupied(x, y)
 
 		if debug then Log:write("  considering x,y=", x, ",", y, " canmove=", canmove, " dist=", dist) end
 
@@ -1459,6 +1854,7 @@ function Actor:aiApproachGoals(distmap)
 		local actor = self.map:isOccupied(x, y)
 		if debug then Log:write("  trying x,y=", x, ",", y, " actor=", actor) end
 		if not actor or actor == Game.player then
+			self.lastMoveX, self.lastMoveY = x - self.x, y - self.y
 			return (self:move(x, y))
 		end
 	end
@@ -28,6 +28,11 @@ Actordefs.BaseActor = defineActor(Actor, {
 	aiState = "wait",
 	agility = 10,
 	sightRange = 5,
+	costProfile = "walker",
+	desires = {
+		chase = { player = 1 },
+		flee = { flee = 1 },
+	},
 })
 
 ----------------------------------- Humanoids ---------------------------------
@@ -35,6 +40,12 @@ Actordefs.BaseActor = defineActor(Actor, {
 Actordefs.Humanoid = defineActor(Actordefs.BaseActor, {
 	category = "Humanoids",
 	face = "@",
+	costProfile = "humanoid",
+	--	smart enough to keep away from fires
+	desires = {
+		chase = { player = 1, fire = -0.5 },
+		flee = { flee = 1, fire = -0.5 },
+	},
 })
 
 Actordefs.Player = defineActor(Actordefs.Humanoid, {
@@ -105,6 +116,12 @@ Actordefs.SavageShaman = defineActor(Actordefs.Humanoid, {
 ------------------------------ Beasts -----------------------------------------
 Actordefs.Beast = defineActor(Actordefs.BaseActor, {
 	category = "Beast",
+	--	tracks the player by scent
+	smells = true,
+	desires = {
+		chase = { player = 1, scent = 0.2 },
+		flee = { flee = 1 },
+	},
 })
 
 Actordefs.Rat = defineActor(Actordefs.Beast, {
@@ -26,6 +26,7 @@ function Dungeon.defaultLootWeights(depth)
 		["Bullet"] = { 0.15, 1, 10 },
 		["EnergyCell"] = { 0.2, 1, 10 },
 		["SugarBombs"] = 0.3,
+		["FragGrenade"] = { 0.05, 1, 2 },
 		["RedKeycard"] = 0.04,
 		["GreenKeycard"] = 0.04,
 		["BlueKeycard"] = 0.04,
@@ -10,6 +10,7 @@
 --			and informing the user accordingly
 --	*	actorList (list) - a list of all living actors that have the ability
 --			to take their turns
+--	*	actorsById (table) - maps Actor._id to the actors in actorList
 --	*	particleList (list) - a list of all particles
 --	*	itemList (list) - a list of all items whether on the floor or owned by
 --			an actor
@@ -19,6 +20,19 @@
 --	* turnCount (integer) - the number of turns taken since the beginning of
 --			the game; a turn is a period of time in which _all_ actors take their
 --			turns
+--	* aiTimeUsed (number) - seconds spent so far this turn on non-player
+--			actors' actions, see Global.aiBudget
+--	* aiCheapActs (integer) - number of cheap AI actions this turn
+--	* aiOverruns (integer) - number of turns in which the AI went over budget
+--	* noises (list) - noises made this turn, see Game:makeNoise()
+--	* effectWheel (userdata) - timing wheel of the timers of the actors'
+--			effects, see Game:updateEffects()
+--	* combatLog (userdata) - rolls attacks and records them until they are
+--			described, see Game:showCombatLog()
+--	* playerDistMaps, fleeMaps, desireMaps (tables) - caches of Dijkstra maps
+--			which depend on where the player is, see Game:clearPlayerCaches();
+--			they are checked against changes to the map when used (see
+--			Map:isDistMapCurrent())
 --
 
 --	The singleton Game object
@@ -43,10 +57,19 @@ local Dungeon = require "lua/dungeon"
 function Game:init()
 	self.running = false
 	self.actorList = {}
+	self.actorsById = {}
 	self.particleList = {}
 	self.itemList = {}
 	self.mapList = {}
 	self.turnCount = 0
+	self.aiTimeUsed = 0
+	self.aiCheapActs = 0
+	self.aiOverruns = 0
+	self.playerDistMaps = {}
+	self.fleeMaps = {}
+	self.desireMaps = {}
+	self.noises = {}
+	self.effectWheel = clib.newTimingWheel()
 end
 
 --	Game:start() - starts the given Game object, creating the world of
@@ -56,6 +79,7 @@ function Game:start()
 	self.randomSeed = os.time()
 	math.randomseed(self.randomSeed)
 	Log:write("Random seed is " .. self.randomSeed)
+	self.combatLog = clib.newCombatLog(math.random(0, 0x7fffffff))
 
 	--	initialize the interface
 	UI:init()
@@ -83,6 +107,8 @@ function Game:start()
 		else
 			error("Unknown generator " .. layout.generator)
 		end
+		map:compileLayers()
+		map:connectRegions()
 
 		self:addMap(map)
 
@@ -198,6 +224,8 @@ function Game:loop()
 
 		--	mark the beginning of the turn
 		Log:write("Turn " .. self.turnCount .. " started.")
+		self.aiTimeUsed = 0
+		self.aiCheapActs = 0
 
 		--	loop through all the actors and make them take their turns
 		for i = 1, #(self.actorList) do
@@ -212,11 +240,15 @@ function Game:loop()
 
 			--	the act() method returns the number of action points spent to make
 			--	a specific action
+			local startTime = clib.time()
 			while currentActor.alive and currentActor.actionPoints >= 0 do
 				Log:write("Currently acting: " .. tostring(currentActor) ..
 					" actionpoints: " .. currentActor.actionPoints)
 				currentActor.actionPoints = currentActor.actionPoints - currentActor:act()
 			end
+			if currentActor ~= self.player then
+				self.aiTimeUsed = self.aiTimeUsed + clib.time() - startTime
+			end
 
 			--	The sightMap may be out of date as soon as the next actor acts;
 			--	Game.player.sightMapStale is set when this happens but other actors
@@ -232,16 +264,79 @@ function Game:loop()
 			end
 		end
 
+		self:propagateNoises()
+		self:updateScent()
+		self:updateHazards()
+		self:updateEffects()
+
+		--	report if the AI took longer than it should have
+		if self:aiOverBudget() then
+			self.aiOverruns = self.aiOverruns + 1
+			Log:write(string.format("Turn %d: AI took %.1fms, over its budget of " ..
+				"%dms; %d cheap actions. %d overruns so far.", self.turnCount,
+				self.aiTimeUsed * 1000, Global.aiBudget, self.aiCheapActs,
+				self.aiOverruns))
+		end
+
 		--	mark the end of the turn
 		Log:write("Turn " .. self.turnCount .. " ended.")
 	end
 end
 
+--	Game:aiOverBudget() - returns true if the non-player actors have used up
+--	this turn's time budget (Global.aiBudget)
+function Game:aiOverBudget()
+	return Global.aiBudget ~= nil and self.aiTimeUsed * 1000 > Global.aiBudget
+end
+
+--	Game:planCrowdMoves() - plans this turn's step for every actor on the
+--	player's map which is moving towards or away from the player, all at once
+--	(see clib.planMoves()), so that they queue, step aside and swap places
+--	rather than getting in each other's way. Each actor's plan is stored in
+--	its plannedMove, and carried out by Actor:aiApproachGoals() when it acts.
+--	Returns nothing.
+function Game:planCrowdMoves()
+	self.crowdPlanTurn = self.turnCount
+
+	local actors, movers = {}, {}
+	for _, actor in ipairs(self.actorList) do
+		if		actor.alive and actor ~= self.player and actor.map == self.player.map
+			and	Util.dist(actor.x, actor.y, self.player.x, self.player.y) <= Global.aiDetailRange then
+			local distmap = actor:aiGoalMap()
+			if distmap then
+				table.insert(actors, actor)
+				table.insert(movers, {x = actor.x, y = actor.y, distmap = distmap,
+					attack = actor.aiState == "chase" and self.player._id or nil})
+			end
+		end
+	end
+	if #movers == 0 then
+		return
+	end
+
+	local plans = clib.planMoves(self.player.map.layers, movers)
+	for i, actor in ipairs(actors) do
+		local plan = plans[i]
+		actor.plannedMove = {
+			turn = self.turnCount,
+			fromX = actor.x,
+			fromY = actor.y,
+			distmap = movers[i].distmap,
+			stay = not plan,
+			x = plan and plan[1],
+			y = plan and plan[2],
+			swapWith = plan and plan.swap and actors[plan.swap],
+		}
+	end
+end
+
 --	Game:terminate() - terminates the Game, and disposes of any resources
 --	that were initialized during the game and require deinitialization;
 --	does not return anything
 function Game:terminate()
 	Log:write("Terminating game instance...")
+	Log:write(string.format("Dijkstra maps: %d served from the cache, %d computed.",
+		clib.pathCacheStats()))
 	UI:terminate()
 	Log:terminate()
 	io.write("Bye! Please submit any bugs you may have encountered!\n")
@@ -251,6 +346,7 @@ end
 --	does not return anything
 function Game:addActor(actor)
 	table.insert(self.actorList, actor)
+	self.actorsById[actor._id] = actor
 	Log:write("Added ", actor, " to actorList.")
 end
 
@@ -261,6 +357,8 @@ function Game:removeActor(actor)
 	if not Util.seqRemove(self.actorList, actor) then
 		error("bad call Game:removeActor(" .. tostring(actor) .. ")")
 	end
+	self.actorsById[actor._id] = nil
+	actor:setOccupancy(false)
 	Log:write("Remove ", actor, " from actorList.")
 end
 
@@ -311,45 +409,488 @@ function Game:halt(reason)
 	self.running = false
 end
 
---	Game:clearPlayerCaches() - Should be called when then player moves or the
---	map changes. Returns nothing.
+--	Game:clearPlayerCaches() - Should be called when the player moves (changes
+--	to the map are handled by Map:markChanged()). Returns nothing.
 function Game:clearPlayerCaches()
-	self.playerDistMap = nil
-	self.fleeMap = nil
+	self.playerDistMaps = {}
+	self.fleeMaps = {}
+	self.desireMaps = {}
 	self.player.sightMapStale = true
 end
 
+--	Game:costProfilesInUse() - returns a list of the given cost profile and
+--	every other cost profile used by actors on the player's map
+function Game:costProfilesInUse(profile)
+	local profiles = {profile}
+	for _, actor in ipairs(self.actorList) do
+		if actor.map == self.player.map and actor ~= self.player and
+				not Util.tableFind(profiles, actor.costProfile) then
+			table.insert(profiles, actor.costProfile)
+		end
+	end
+	return profiles
+end
+
+--	playerMapRequests() - appends to a list of clib.dijkstraMaps() requests
+--	the requests for the player distance map and the flee map for each cost
+--	profile in a list, for the player standing at x, y; returns nothing
+local function playerMapRequests(requests, profiles, x, y)
+	for _, name in ipairs(profiles) do
+		table.insert(requests, {x = x, y = y, maxcost = 999, profile = name})
+		--	a flee map is the distance map rescaled by a negative factor, so that
+		--	tiles far from the player become goals, then searched again
+		table.insert(requests, {x = x, y = y, maxcost = 999, profile = name,
+			rescale = {-1.4, 100}})
+	end
+end
+
+--	installPlayerMaps() - caches the results of playerMapRequests()
+local function installPlayerMaps(maps, profiles)
+	local epoch = Game.player.map.layers:epoch()
+	for i, name in ipairs(profiles) do
+		local distMap, fleeMap = maps[2*i - 1], maps[2*i]
+		distMap.maxcost = 999
+		fleeMap.maxcost = 999
+		distMap.epoch, distMap.profile = epoch, name
+		fleeMap.epoch, fleeMap.profile = epoch, name
+		Game.playerDistMaps[name] = distMap
+		Game.fleeMaps[name] = fleeMap
+	end
+end
+
+--	Game:computePlayerMaps() - compute the player distance map and the flee
+--	map for the given cost profile and for every other cost profile used by
+--	actors on the player's map; they don't depend on each other, so are
+--	computed as one batch on the worker threads. Returns nothing.
+function Game:computePlayerMaps(profile)
+	local profiles = self:costProfilesInUse(profile)
+	local requests = {}
+	playerMapRequests(requests, profiles, self.player.x, self.player.y)
+	installPlayerMaps(clib.dijkstraMaps(self.player.map.layers, requests), profiles)
+end
+
+--	Game:speculatePlayerMoves() - called before waiting for the player to press
+--	a key: starts computing, on the worker threads, the maps which will be
+--	needed if the player moves onto each of the adjacent tiles (the player's
+--	sight map, and player distance and flee maps), so that they are ready by
+--	the time the key is pressed. Returns nothing.
+function Game:speculatePlayerMoves()
+	self:cancelSpeculation()
+
+	local player = self.player
+	local profiles = self:costProfilesInUse("walker")
+	local requests, moves = {}, {}
+	for dirnum = 0, 7 do
+		local xoff, yoff = Util.xyFromDirection(Util.intToDir[dirnum])
+		local x, y = player.x + xoff, player.y + yoff
+		if player:canMoveTo(x, y) then
+			table.insert(moves, {x = x, y = y, first = #requests + 1})
+			table.insert(requests, {sight = player.sightRange, x = x, y = y})
+			playerMapRequests(requests, profiles, x, y)
+		end
+	end
+
+	if #moves > 0 then
+		self.speculation = {
+			map = player.map,
+			moves = moves,
+			profiles = profiles,
+			epoch = player.map.layers:epoch(),
+			jobs = clib.startJobs(player.map.layers, requests),
+		}
+	end
+end
+
+--	Game:takeSpeculation() - if the player has moved onto a tile for which
+--	maps were computed by speculatePlayerMoves(), installs them (including the
+--	player's sight map) and returns true, otherwise returns false. Either way
+--	the rest are thrown away.
+function Game:takeSpeculation()
+	local spec = self.speculation
+	if not spec then
+		return false
+	end
+	self.speculation = nil
+
+	--	the maps are no good if the map changed while they were computed
+	if spec.map == self.player.map and spec.epoch == spec.map.layers:epoch() then
+		for _, move in ipairs(spec.moves) do
+			if move.x == self.player.x and move.y == self.player.y then
+				local wanted = {}
+				for i = move.first, move.first + 2 * #spec.profiles do
+					table.insert(wanted, i)
+				end
+				local results = {spec.jobs:take(table.unpack(wanted))}
+				self.player:setSightMap(table.remove(results, 1))
+				installPlayerMaps(results, spec.profiles)
+				Log:write("Used speculatively computed maps for ", self.player)
+				return true
+			end
+		end
+	end
+
+	spec.jobs:cancel()
+	return false
+end
+
+--	Game:cancelSpeculation() - throws away anything computed by
+--	speculatePlayerMoves(), e.g. because the map has changed. Returns nothing.
+function Game:cancelSpeculation()
+	if self.speculation then
+		self.speculation.jobs:cancel()
+		self.speculation = nil
+	end
+end
+
+--	dropStalePlayerMaps() - throws away the cached player distance map and
+--	flee map for a cost profile if either has been affected by changes to
+--	the player's map
+local function dropStalePlayerMaps(profile)
+	local map = Game.player.map
+	local distMap, fleeMap = Game.playerDistMaps[profile], Game.fleeMaps[profile]
+	if (distMap and not map:isDistMapCurrent(distMap)) or
+			(fleeMap and not map:isDistMapCurrent(fleeMap)) then
+		Game.playerDistMaps[profile] = nil
+		Game.fleeMaps[profile] = nil
+	end
+end
+
 --	Game:getPlayerDistMap() - return a cached 2D map of distances in tiles from
---	the player.
-function Game:getPlayerDistMap()
-	if not self.playerDistMap then
-		self.playerDistMap =
-			clib.dijkstraMap(Game.player.map.tile, 999, Game.player.x, Game.player.y)
-		self.playerDistMap.maxcost = 999
+--	the player, for the given cost profile (default "walker").
+function Game:getPlayerDistMap(profile)
+	profile = profile or "walker"
+	dropStalePlayerMaps(profile)
+	if not self.playerDistMaps[profile] then
+		self:takeSpeculation()
+	end
+	if not self.playerDistMaps[profile] then
+		self:computePlayerMaps(profile)
 	end
-	return self.playerDistMap
+	return self.playerDistMaps[profile]
 end
 
 --	Game:getFleeMap() - return a cached 2D map of distances which directs
---	actors how to flee from the player (does not work yet).
-function Game:getFleeMap()
-	if not self.fleeMap then
-		local dists = self:getPlayerDistMap()
-		local fleemap = {}
-		for i = 1, Global.mapWidth do
-			fleemap[i] = {}
-			for j = 1, Global.mapHeight do
-				local dist = dists[i][j]
-				if dist < 999 then
-					fleemap[i][j] = 100 - 1.4 * dist
+--	actors how to flee from the player, for the given cost profile (default
+--	"walker").
+function Game:getFleeMap(profile)
+	profile = profile or "walker"
+	dropStalePlayerMaps(profile)
+	if not self.fleeMaps[profile] then
+		self:takeSpeculation()
+	end
+	if not self.fleeMaps[profile] then
+		self:computePlayerMaps(profile)
+	end
+	return self.fleeMaps[profile]
+end
+
+--	Game:makeNoise() - makes a noise at x, y on a map, which will be heard at
+--	the end of the turn by the actors it reaches (see Actor:hearNoise()).
+--	'volume' is how many open tiles it carries across; doors and walls
+--	dampen it more (see the "sound" cost profile). 'source' is the actor
+--	making it, if any. Returns nothing.
+function Game:makeNoise(map, x, y, volume, source)
+	if volume > 0 then
+		table.insert(self.noises, {map = map, x = x, y = y, volume = volume,
+			source = source})
+	end
+end
+
+--	Game:propagateNoises() - lets the actors who are in earshot hear all the
+--	noises made this turn; all the noises on a map are spread as one batch.
+--	Returns nothing.
+function Game:propagateNoises()
+	if #self.noises == 0 then
+		return
+	end
+	local noises = self.noises
+	self.noises = {}
+
+	local byMap, maps = {}, {}
+	for _, noise in ipairs(noises) do
+		if not byMap[noise.map] then
+			byMap[noise.map] = {}
+			table.insert(maps, noise.map)
+		end
+		table.insert(byMap[noise.map], noise)
+	end
+
+	for _, map in ipairs(maps) do
+		local heard = clib.propagateNoise(map.layers, "sound", byMap[map])
+		for i, noise in ipairs(byMap[map]) do
+			for id, loudness in pairs(heard[i]) do
+				local actor = self.actorsById[id]
+				if actor and actor ~= noise.source then
+					actor:hearNoise(noise, loudness)
 				end
 			end
 		end
-		self.fleeMap = clib.dijkstraMap(Game.player.map.tile, 999, fleemap)
-		self.fleeMap.maxcost = 999
 	end
-	return self.fleeMap
 end
 
+--	Game:updateScent() - the player leaves scent where he/she is, then the
+--	scent on the player's map spreads and fades (see Global.scent); only
+--	walls and closed doors hold it back. Returns nothing.
+function Game:updateScent()
+	local layers = self.player.map.layers
+	layers:addScent(self.player.x, self.player.y, Global.scent.deposit)
+	layers:updateScent("walker", Global.scent.decay, Global.scent.rate)
+end
+
+--	Game:updateHazards() - fire spreads and burns out, and smoke clears, on
+--	every map (see Map:updateHazards()). Returns nothing.
+function Game:updateHazards()
+	for _, map in ipairs(self.mapList) do
+		map:updateHazards()
+	end
+end
+
+--	Game:updateEffects() - moves Game.effectWheel on by a turn, and runs the
+--	actors' effects whose timers went off (see Actor.effects). Returns
+--	nothing.
+function Game:updateEffects()
+	local fired = self.effectWheel:advance()
+	for i = 1, #fired, 3 do
+		local actor = self.actorsById[fired[i + 1]]
+		if actor and actor.alive then
+			actor:runEffect(Actor.effectsById[fired[i + 2]], fired[i])
+		end
+	end
+end
+
+--	hasFlag() - returns true if a set of flags (a sum of powers of two)
+--	includes the given one
+local function hasFlag(flags, flag)
+	return math.floor(flags / flag) % 2 == 1
+end
+
+--	Game:showCombatLog() - describes the attacks and deaths recorded in
+--	Game.combatLog which the player can see (or hear) as messages, and empties
+--	it; the rest are never put into words. Called when the screen is drawn
+--	and before any other message, so that messages stay in order. Does not
+--	return anything
+function Game:showCombatLog()
+	local player = self.player
+	if not self.combatLog or not player or not player.map or
+			self.combatLog:pending() == 0 then
+		return
+	end
+
+	--	events are {kind, attacker, defender, verb, damage, flags, ...}; kind 1
+	--	is an attack and 2 a death; flags are 1 hit, 2 ranged, 4 attacker seen,
+	--	8 defender seen
+	local events = self.combatLog:take(player.map.num, player.sightMap, player._id)
+	for i = 1, #events, 6 do
+		local attacker = self.actorsById[events[i + 1]]
+		local defender = self.actorsById[events[i + 2]]
+		local flags = events[i + 5]
+		local defenderName = defender and defender.name or "something"
+
+		if events[i] == 2 then
+			if hasFlag(flags, 8) then
+				UI:message("{{red}}The " .. defenderName .. " dies!")
+			else
+				UI:message("{{red}}You hear a thud.")
+			end
+		else
+			local hit = hasFlag(flags, 1)
+			local extrainfo = ""
+			if hit and Global.debugInfo then
+				extrainfo = " {" .. events[i + 4] .. " damage}"
+			end
+
+			if defender == player then
+				defenderName = "you"
+			elseif hasFlag(flags, 8) then
+				defenderName = "the " .. defenderName
+			else
+				defenderName = "an unseen foe"
+			end
+
+			local attackVerb = Actor.attackVerbs[events[i + 3]]
+			if attacker == player then
+				UI:message("You " .. (hit and attackVerb or "miss") .. " " ..
+					defenderName .. "!" .. extrainfo)
+			elseif hasFlag(flags, 4) then
+				UI:message("The " .. (attacker and attacker.name or "something") .. " " ..
+					(hit and attackVerb or "misses") .. " " .. defenderName .. "." .. extrainfo)
+			else
+				UI:message("A shot " .. (hit and "hits " or "misses ") .. defenderName .. ".")
+			end
+		end
+	end
+end
+
+--	Game.snapshotFields - the members of Game which make up the state of the
+--	game, saved by Game:snapshot()
+Game.snapshotFields = {"actorList", "actorsById", "itemList", "mapList", "player",
+	"turnCount", "noises", "effectWheel"}
+
+--	snapshotShared() - returns the set of values which Game:snapshot() keeps by
+--	reference rather than copying: the Game object and the modules, with the
+--	definitions, prototypes and metatables reachable from them. Worked out the
+--	first time it's needed
+local sharedValues = nil
+local function snapshotShared()
+	if sharedValues then
+		return sharedValues
+	end
+	sharedValues = {[Game] = true}
+	local function share(value)
+		if type(value) ~= "table" or sharedValues[value] then
+			return
+		end
+		sharedValues[value] = true
+		for k, v in pairs(value) do
+			share(k)
+			share(v)
+		end
+		share(getmetatable(value))
+	end
+	for name, module in pairs(package.loaded) do
+		if type(name) == "string" and name:match("^lua/") then
+			share(module)
+		end
+	end
+	return sharedValues
+end
+
+--	Game:snapshot() - returns a snapshot (see clib.snapshot()) of the state of
+--	the game: the members in Game.snapshotFields and the actors, items and maps
+--	they refer to, including the maps' native layers. It can be restored with
+--	Game:restoreSnapshot() any number of times, e.g. to play out what could
+--	happen next again and again from the same position
+function Game:snapshot()
+	local state = {}
+	for _, field in ipairs(self.snapshotFields) do
+		state[field] = self[field]
+	end
+	return clib.snapshot(state, snapshotShared())
+end
+
+--	Game:restoreSnapshot() - puts the game back into the state a snapshot from
+--	Game:snapshot() was taken in, with a new copy of everything in it. The
+--	caches of Dijkstra maps are emptied, and fighting not yet described is
+--	forgotten. Does not return anything
+function Game:restoreSnapshot(snapshot)
+	self:cancelSpeculation()
+	local state = snapshot:restore()
+	for _, field in ipairs(self.snapshotFields) do
+		self[field] = state[field]
+	end
+	self.playerDistMaps = {}
+	self.fleeMaps = {}
+	self.desireMaps = {}
+	self.combatLog = clib.newCombatLog(math.random(0, 0x7fffffff))
+end
+
+--	Game.desireSources - the Dijkstra maps which the AI can combine into a
+--	desire map (see Actor.desires); for each name, a function returning the
+--	map for a cost profile
+Game.desireSources = {
+	--	towards the player
+	player = function(profile) return Game:getPlayerDistMap(profile) end,
+	--	away from the player
+	flee = function(profile) return Game:getFleeMap(profile) end,
+	--	towards the strongest scent left by the player
+	scent = function(profile) return Game.player.map:getScentMap() end,
+	--	distance from fire, up to 5 tiles
+	fire = function(profile)
+		return Game.player.map:getTerrainMap(profile, "fire", 5)
+	end,
+}
+
+--	desireKey() - returns a string identifying a cost profile and a table of
+--	desires, for caching the desire map
+local desireKeys = setmetatable({}, {__mode = "k"})
+local function desireKey(profile, desires)
+	if not desireKeys[desires] then
+		local parts = {}
+		for name, weight in pairs(desires) do
+			table.insert(parts, name .. "=" .. weight)
+		end
+		table.sort(parts)
+		desireKeys[desires] = table.concat(parts, ",")
+	end
+	return profile .. " " .. desireKeys[desires]
+end
+
+--	desireRequest() - returns the clib.dijkstraMaps() request which combines
+--	the source maps of a table of desires, or nil if it's a single map with
+--	weight 1 which can be used as it is
+local function desireRequest(profile, desires)
+	local combine = {}
+	for name, weight in pairs(desires) do
+		local source = Game.desireSources[name]
+		if not source then
+			error("unknown desire '" .. name .. "'")
+		end
+		table.insert(combine, {source(profile), weight})
+	end
+	if #combine == 1 and combine[1][2] == 1 then
+		return nil, combine[1][1]
+	end
+	local sources = {}
+	for i, pair in ipairs(combine) do
+		sources[i] = pair[1]
+	end
+	return {combine = combine, maxcost = 999, profile = profile, sources = sources}
+end
+
+--	Game:getDesireMap() - return a cached "desire map": the Dijkstra map made
+--	by combining the maps in Game.desireSources with the weights given in
+--	'desires' (a table mapping source names to weights; negative weights
+--	repel), for the given cost profile. All the desire maps needed by actors
+--	on the player's map which aren't cached yet are computed as a batch.
+function Game:getDesireMap(profile, desires)
+	local map = self.player.map
+	local function cached(key)
+		local desireMap = self.desireMaps[key]
+		if desireMap and not map:isDistMapCurrent(desireMap) then
+			self.desireMaps[key] = nil
+		end
+		return self.desireMaps[key]
+	end
+
+	local key = desireKey(profile, desires)
+	if cached(key) then
+		return self.desireMaps[key]
+	end
+
+	local requests, keys = {}, {}
+	local function want(profile, desires)
+		local key = desireKey(profile, desires)
+		if cached(key) or keys[key] then
+			return
+		end
+		local request, desireMap = desireRequest(profile, desires)
+		if request then
+			table.insert(requests, request)
+			keys[key] = #requests
+		else
+			self.desireMaps[key] = desireMap
+		end
+	end
+
+	want(profile, desires)
+	for _, actor in ipairs(self.actorList) do
+		local actorDesires = actor.desires and actor.desires[actor.aiState]
+		if actor.map == map and actorDesires then
+			want(actor.costProfile, actorDesires)
+		end
+	end
+
+	if #requests > 0 then
+		local maps = clib.dijkstraMaps(map.layers, requests)
+		for key, i in pairs(keys) do
+			maps[i].maxcost = 999
+			maps[i].epoch = map.layers:epoch()
+			maps[i].profile = requests[i].profile
+			maps[i].sources = requests[i].sources
+			self.desireMaps[key] = maps[i]
+		end
+	end
+	return self.desireMaps[key]
+end
 
 return Game
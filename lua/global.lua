@@ -61,4 +61,41 @@ Global.actionCost = {
 	dropItem = 4,
 }
 
+--	Time budget in milliseconds for all the AI (non-player actors) in one
+--	turn. Actors which act after it has run out fall back to cheap behaviour
+--	(see Actor:aiActCheap()), and the overrun is logged. nil for no limit
+Global.aiBudget = 10
+
+--	Actors further than this many tiles from the player always use the cheap
+--	AI behaviour
+Global.aiDetailRange = 30
+
+--	Loudness of noises, as the number of open tiles they carry across (see
+--	Game:makeNoise())
+Global.noiseVolume = {
+	alarmTrap = 30,
+	pickDoor = 8,
+}
+
+--	Enemies waiting up to this many steps (walking) from an explosion are
+--	alerted by it (see Actor:blast())
+Global.blastAlertRange = 12
+
+--	The player's scent: how much is left behind each turn, the fraction of it
+--	which is left after each turn, the fraction which spreads to the
+--	neighbouring tiles each turn, and the least amount which can be smelled
+Global.scent = {
+	deposit = 100,
+	decay = 0.9,
+	rate = 0.25,
+	threshold = 1,
+}
+
+--	Fire which spreads (see Tile.flammability): how many turns it burns for,
+--	and how many turns its smoke, which can't be seen through, lingers after
+Global.fire = {
+	burnTime = 6,
+	smokeTime = 3,
+}
+
 return Global
@@ -46,6 +46,12 @@ Itemdefs.BaseItem = defineItem(Item, {
 --	* minDamage  (int) - min and max damage before modifiers, armour, etc.
 --	* maxDamage  (int) - ditto
 --	* range      (int) - 0 if melee, otherwise range in tiles
+--	* pellets    (int, optional) - (ranged only) how many projectiles each shot
+--	             fires, each doing damage; by default 1
+--	* spread     (number, optional) - (ranged only) the angle in radians over
+--	             which the pellets scatter; by default 0
+--	* penetration (int, optional) - (ranged only) how many actors a projectile
+--	             can hit and fly on past; by default 0
 
 Itemdefs.Weapon = defineItem(Itemdefs.BaseItem, {
 	category = "Weapons",
@@ -59,6 +65,9 @@ Itemdefs.Weapon = defineItem(Itemdefs.BaseItem, {
 			ret = ret .. "Range: " .. self.range
 		end
 		ret = ret .. "   Damage: " .. self.minDamage .. "-" .. self.maxDamage
+		if self.pellets then
+			ret = ret .. " x" .. self.pellets
+		end
 		if self.ammo then
 			ret = ret .. "\nAmmo: " .. self.ammo
 			if self.owner == Game.player then
@@ -173,6 +182,7 @@ Itemdefs.Phaser = defineItem(Itemdefs.Handgun, {
 	accuracy = 0.7,
 	ammo = "Energy Cell",
 	attack = "lasered",
+	penetration = 1,
 	requires = { ["handguns"] = 5 },
 })
 
@@ -185,9 +195,11 @@ Itemdefs.SingleShotgun = defineItem(Itemdefs.Shotgun, {
 	name = "Single shotgun",
 	info = "The weapon of choice of the close range kill afficionado.",
 	range = 4,
-	minDamage = 2,
-	maxDamage = 4,
+	minDamage = 1,
+	maxDamage = 2,
 	accuracy = 0.6,
+	pellets = 3,
+	spread = 0.3,
 	attack = "shot",
 	requires = { ["shotguns"] = 2 },
 })
@@ -196,9 +208,11 @@ Itemdefs.SawedOffShotgun = defineItem(Itemdefs.Shotgun, {
 	name = "Sawed-off shotgun",
 	info = "More portable, more deadly, less accurate than its cousin.",
 	range = 4,
-	minDamage = 2,
-	maxDamage = 5,
+	minDamage = 1,
+	maxDamage = 3,
 	accuracy = 0.5,
+	pellets = 4,
+	spread = 0.5,
 	attack = "shot",
 	requires = { ["shotguns"] = 2 },
 })
@@ -261,6 +275,27 @@ Itemdefs.SugarBombs = defineItem(Itemdefs.Consumable, {
 	end
 })
 
+--	Thrown explosives have these additional members:
+--	* range       (int) - how far they can be thrown
+--	* blastRadius (int) - the radius of the explosion
+--	* damage      (int) - damage at the centre of the explosion, less further out
+Itemdefs.FragGrenade = defineItem(Itemdefs.Consumable, {
+	name = "Frag grenade",
+	info = "Goes off where it lands, hurting everyone close by.",
+	color = curses.green,
+	range = 5,
+	blastRadius = 2,
+	damage = 6,
+	apply = function(self, actor)
+		local dir = UI:promptDirection("Throw in which direction?")
+		if not dir then
+			return false
+		end
+		actor:throwExplosive(dir, self)
+		return true
+	end
+})
+
 
 ----------------------------------- Corpses -----------------------------------
 
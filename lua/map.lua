@@ -8,7 +8,19 @@
 --			whose dimensions are defined in global.lua; all maps have the same
 --			dimensions
 --	*	memory (table) - contains a superficial memory of the terrain data;
---			the only thing that's memorised is the look of the terrain tile
+--			the only thing that's memorised is the look of the terrain tile;
+--			false on tiles which have never been seen
+--	*	layers (userdata) - native copy of the terrain (tile ids) and the cost
+--			layers computed from it for each cost profile (see tile.lua); must be
+--			kept in sync with tile, by using setTile(), or compileLayers() after
+--			writing to tile directly. Also records which actor is on each tile
+--			(see Actor:setOccupancy()), and the scent left by the player (see
+--			Game:updateScent())
+--	*	terrainMaps (table) - cache of Map:getTerrainMap() results
+--	*	smoke (table) - two-dimensional array, true where there's smoke from
+--			a fire, which can't be seen through (see Map:updateHazards())
+--	*	regions (table) - the regions of the map once generated, as returned by
+--			clib.findRegions() (see Map:connectRegions())
 --
 
 local Global = require "lua/global"
@@ -30,14 +42,19 @@ function Map.new(mapnum, name)
 	m.num = mapnum
 	m.tile = {}
 	m.memory = {}
+	m.smoke = {}
+	m.layers = clib.newMapLayers(Global.mapWidth, Global.mapHeight, Tile.void.id)
+	m.terrainMaps = {}
 
 	--	initialize the terrain data with `void` tiles
 	for i = 1, Global.mapWidth do
 		m.tile[i] = {}
 		m.memory[i] = {}
+		m.smoke[i] = {}
 		for j = 1, Global.mapHeight do
 			m.tile[i][j] = Tile.void
-			m.memory[i][j] = " "
+			m.memory[i][j] = false
+			m.smoke[i][j] = false
 		end
 	end
 
@@ -84,30 +101,24 @@ end
 --	Map:isOccupied() - returns the actor at the coordinates (x, y) of the given
 --	map (if any), or false if the specified tile is not occupied
 function Map:isOccupied(x, y)
-	for i = 1, #(Game.actorList) do
-		local actor = Game.actorList[i]
-		if actor.map == self and actor.x == x and actor.y == y and actor.alive then
-			return actor
-		end
-	end
-	return false
+	return Game.actorsById[self.layers:occupant(x, y)] or false
 end
 
 --	Map:neighbours() - returns an iterator over the coordinates of tiles which
 --	are adjacent to x,y. Use like:
 --		for x,y in map:neighbours(startx, starty) do ...
 function Map:neighbours(x, y)
-	local function iterator()
-		for i = x-1, x+1 do
-			for j = y-1, y+1 do
-				if	self:isInBounds(i, j) and
-						not (i == x and j == y) then
-					coroutine.yield(i, j)
-				end
+	local k = 0
+	return function()
+		while k < 9 do
+			local i, j = x - 1 + k % 3, y - 1 + math.floor(k / 3)
+			k = k + 1
+			if	self:isInBounds(i, j) and
+					not (i == x and j == y) then
+				return i, j
 			end
 		end
 	end
-	return coroutine.wrap(iterator)
 end
 
 --	Map:countNeighbours() - returns the number of a given type of neighbouring
@@ -155,28 +166,158 @@ function Map:itemsAtTile(x, y)
 	return ret
 end
 
---	Map:findRandomEmptySpace() - searches for a random empty space;
---	an empty space has a non-solid tile, and is occupied by no actor;
---	stairs are not empty spaces;
+--	Map:findRandomEmptySpace() - picks a random empty space, all being equally
+--	likely; an empty space has a non-solid tile, and is occupied by no actor;
+--	stairs are not empty spaces. Only tiles whose Tile.id is in the set 'ids'
+--	are considered, if given.
 --	returns a pair of coordinates (x, y) which comply with the restrictions
-function Map:findRandomEmptySpace()
-	local x, y
-	repeat
-		x = math.random(1, Global.mapWidth)
-		y = math.random(1, Global.mapHeight)
-	until not self:isSolid(x, y) and
-				not self:isOccupied(x, y) and
-				self.tile[x][y].role ~= "stairs"
-	
+function Map:findRandomEmptySpace(ids)
+	local x, y = self.layers:randomFreeTile(math.random(), ids)
+	if not x then
+		error("No empty space on " .. tostring(self))
+	end
 	return x, y
 end
 
---	Map:markChanged() - Must be called after the map has been changed (e.g. a
---	door opened) and therefore FoVs may be out of date.
+--	Map:setTile() - changes the tile at the given pair of coordinates (x, y),
+--	keeping the map's native layers up to date; does not return anything
+function Map:setTile(x, y, tile)
+	self.tile[x][y] = tile
+	self.layers:setTile(x, y, tile.id)
+	if Game.player then
+		self:markChanged()
+	end
+end
+
+--	Map:compileLayers() - rebuilds the map's native layers from scratch from
+--	the tile array; used after generating the map, which writes to the tile
+--	array directly; does not return anything
+function Map:compileLayers()
+	self.layers:loadTiles(self.tile)
+end
+
+--	Map:applyLayers() - the reverse of Map:compileLayers(): copies the tiles
+--	changed in the native layers by the grid kernels (clib.countNeighbours(),
+--	clib.dilate(), clib.erode(), clib.spreadTiles() and clib.floodFill(), see
+--	grid.c) to the tile array; does not return anything
+function Map:applyLayers()
+	self.layers:saveTiles(self.tile, Tile.byId)
+end
+
+--	Map:markChanged() - must be called after tiles of the map have changed
+--	(e.g. a door opened). Caches made from the map aren't thrown away: they
+--	remember the map's epoch (see layers:epoch()) and are checked against the
+--	changes made since when next used (see Map:isDistMapCurrent()); the
+--	player's sight is checked now. Does not return anything
 function Map:markChanged()
-	if self == Game.player.map then
-		Game:clearPlayerCaches()
+	local player = Game.player
+	if self ~= player.map or player.sightMapStale then
+		return
+	end
+	if self.layers:sightAffected(player.sightEpoch, player.sightMap) then
+		player.sightMapStale = true
+		return
+	end
+
+	--	what the player sees hasn't changed, only the look of some tiles
+	local changes = self.layers:changesSince(player.sightEpoch)
+	for i = 1, #changes, 2 do
+		local x, y = changes[i], changes[i + 1]
+		if player.sightMap[x][y] then
+			self.memory[x][y] = self.tile[x][y].face
+		end
+	end
+	player.sightEpoch = self.layers:epoch()
+end
+
+--	Map:isDistMapCurrent() - returns true if a Dijkstra map made from the map
+--	isn't affected by the changes made to the map since, and moves its epoch
+--	on; false if it must be recomputed. The map must have these fields:
+--	*	epoch, maxcost - the map's epoch when it was made, and its maxcost
+--	*	profile - the cost profile it was made for
+--	*	terrain (optional) - the terrain type it leads towards
+--	*	sources (optional) - the Dijkstra maps it was combined from, which
+--		must all be current too (those without an epoch aren't checked)
+--	*	turn (optional, also checked on the sources) - the turn (Game.turnCount)
+--		of a map which changes every turn whatever happens to the tiles, such
+--		as the scent map; it's only current during that turn
+function Map:isDistMapCurrent(map)
+	if map.turn and map.turn ~= Game.turnCount then
+		return false
+	end
+	for _, source in ipairs(map.sources or {}) do
+		if source.turn and source.turn ~= Game.turnCount then
+			return false
+		end
+	end
+	local epoch = self.layers:epoch()
+	if map.epoch == epoch then
+		return true
+	end
+	for _, source in ipairs(map.sources or {}) do
+		if source.epoch and not self:isDistMapCurrent(source) then
+			return false
+		end
+	end
+	if self.layers:distMapAffected(map.epoch, map, map.profile, map.terrain) then
+		return false
+	end
+	map.epoch = epoch
+	return true
+end
+
+--	Map:updateHazards() - advances the fire and smoke on the map by one turn
+--	(see hazards.c): fire spreads to flammable tiles (see Tile.flammability)
+--	and they burn out, leaving smoke behind for a while. Only the tiles which
+--	changed are copied back, and actors on tiles which caught fire start
+--	burning; does not return anything
+function Map:updateHazards()
+	local changes = self.layers:updateHazards(math.random(0, 0x7fffffff))
+	if #changes == 0 then
+		return
+	end
+
+	for i = 1, #changes, 4 do
+		local x, y, id = changes[i], changes[i + 1], changes[i + 2]
+		self.smoke[x][y] = changes[i + 3] == 1
+		if self.tile[x][y].id ~= id then
+			self.tile[x][y] = Tile.byId[id]
+			local actor = self:isOccupied(x, y)
+			if actor and id == Tile.fire.id then
+				Tile.fire["on-walk"](actor)
+			end
+		end
+	end
+	self:markChanged()
+end
+
+--	Map:getTerrainMap() - returns a cached Dijkstra map of the distance (up to
+--	maxcost) to the nearest tile of the given terrain type (see tile.lua),
+--	for the given cost profile
+function Map:getTerrainMap(profile, terrain, maxcost)
+	local key = profile .. " " .. terrain .. " " .. maxcost
+	local cached = self.terrainMaps[key]
+	if not cached or not self:isDistMapCurrent(cached) then
+		local map = clib.dijkstraMaps(self.layers,
+			{{terrain = terrain, maxcost = maxcost, profile = profile}})[1]
+		map.maxcost = maxcost
+		map.epoch = self.layers:epoch()
+		map.profile = profile
+		map.terrain = terrain
+		self.terrainMaps[key] = map
+	end
+	return self.terrainMaps[key]
+end
+
+--	Map:getScentMap() - returns the scent on the map this turn as a 2D grid
+--	which can be followed like a Dijkstra map; its .turn is the turn, so that
+--	desire maps made from it go stale (see Map:isDistMapCurrent())
+function Map:getScentMap()
+	if not self.scentMap or self.scentMap.turn ~= Game.turnCount then
+		self.scentMap = self.layers:scentMap(Global.scent.threshold, 999)
+		self.scentMap.turn = Game.turnCount
 	end
+	return self.scentMap
 end
 
 --------------------------------- Map generation -----------------------------
@@ -221,8 +362,8 @@ function Map:generateDummy()
 end
 
 --	Map:digRoom() - digs a rectangular room, filling it with a given floor-type
---	tile, and surrounding it with a given wall-type tile; does not return
---	anything
+--	tile, and surrounding it with a given wall-type tile; updates the native
+--	layers, so that Map:isAreaEmpty() sees the room; does not return anything
 function Map:digRoom(x, y, w, h, floorTile, wallTile)
 	for i = x, x+w-1 do
 		for j = y, y+h-1 do
@@ -232,71 +373,70 @@ function Map:digRoom(x, y, w, h, floorTile, wallTile)
 			end
 
 			if i == x or j == y or i == x+w-1 or j == y+h-1 then
-				self.tile[i][j] = wallTile
+				self:setTile(i, j, wallTile)
 			else
-				self.tile[i][j] = floorTile
+				self:setTile(i, j, floorTile)
 			end
 		end
 	end
 end
 
 --	Map:digLink() - digs a cooridor between two given points, filling it with
---	a given floor-type tile; does not return anything
+--	a given floor-type tile (see Map:digLinks()); does not return anything
 function Map:digLink(x1, y1, x2, y2, floorTile)
-	--	start from (x1, y1)
-	local x, y = x1, y1
-
-	--	directions in which to dig the corridor
-	local dx, dy
-	if x1 > x2 then dx = -1 else dx = 1 end
-	if y1 > y2 then dy = -1 else dy = 1 end
-
-	while x ~= x2 do
-		if not self:isInBounds(x, y) then
-			return
-		end
-
-		--	room floor tiles are not replaced
-		if self.tile[x][y] ~= Tile.roomFloor then
-			self.tile[x][y] = floorTile
-		end
-		x = x + dx
-	end
-
-	while y ~= y2 do
-		if not self:isInBounds(x, y) then
-			return
-		end
+	self:digLinks({{x1, y1, x2, y2}}, floorTile)
+end
 
-		--	room floor tiles are not replaced
-		if self.tile[x][y] ~= Tile.roomFloor then
-			self.tile[x][y] = floorTile
+--	Map:digLinks() - digs corridors between pairs of points, given as a list
+--	of {x1, y1, x2, y2}, filling them with a given floor-type tile; updates
+--	the native layers like Map:digRoom(). The corridors are routed together
+--	(see clib.routeCorridors()) along the cheapest way to dig: following
+--	corridors already dug, through empty space, through other open tiles
+--	such as the inside of rooms, and through walls, in that order of
+--	preference, and without turning needlessly; other tiles aren't dug
+--	through. Room floor tiles are not replaced. Does not return anything
+function Map:digLinks(links, floorTile)
+	local digCosts = {}
+	for id, tile in ipairs(Tile.byId) do
+		if tile == floorTile then
+			digCosts[id] = 1
+		elseif tile == Tile.void then
+			digCosts[id] = 2
+		elseif not tile.solid and not tile.role then
+			digCosts[id] = 4
+		elseif tile == Tile.wall then
+			digCosts[id] = 6
+		end
+	end
+
+	local corridors = clib.routeCorridors(self.layers, digCosts, links,
+		floorTile.id, 3)
+	for _, corridor in ipairs(corridors) do
+		for i = 1, #corridor, 2 do
+			local x, y = corridor[i], corridor[i + 1]
+			if self.tile[x][y] ~= Tile.roomFloor then
+				self:setTile(x, y, floorTile)
+			end
 		end
-		y = y + dy
-	end
-
-	--	also cover the destination point (x2, y2)
-	if self:isInBounds(x, y) then
-		self.tile[x][y] = floorTile
 	end
 end
 
 --	Map:isAreaEmpty() - checks if a given area is empty (ie. filled with
---	void tiles); returns a boolean value according to the result
+--	void tiles), using the native layers (see Map:digRoom()); returns a boolean
+--	value according to the result
 function Map:isAreaEmpty(x, y, w, h)
-	for i = x, x+w-1 do
-		for j = y, y+h-1 do
-			if not self:isInBounds(i, j) then
-				return false
-			end
+	return self.layers:isAreaBlank(x, y, w, h)
+end
 
-			if self.tile[i][j] ~= Tile.void then
-				return false
-			end
-		end
+--	Map:findEmptyArea() - picks a random empty area (see Map:isAreaEmpty()) of
+--	the given size, whose corner is at coordinates which are 1 modulo 'step'
+--	(if given), all such areas being equally likely; returns its coordinates,
+--	or nil if there is none
+function Map:findEmptyArea(w, h, step)
+	local place = self.layers:sampleBlankAreas(w, h, {math.random()}, step)[1]
+	if place then
+		return place.x, place.y
 	end
-
-	return true
 end
 
 --	Map:generateRoomsAndCorridors() - generates a rooms-and-corridors map
@@ -335,50 +475,67 @@ function Map:generateRoomsAndCorridors(nRooms, nLoops, nLockers)
 		self.tile[x][y] = door
 	end
 	
+	--	roomLink() - returns the link (see Map:digLinks()) between the centres
+	--	of two rooms
+	local function roomLink(sr, dr)
+		local sx = math.floor((sr.x * 2 + sr.w) / 2)
+		local sy = math.floor((sr.y * 2 + sr.h) / 2)
+		local dx = math.floor((dr.x * 2 + dr.w) / 2)
+		local dy = math.floor((dr.y * 2 + dr.h) / 2)
+
+		--	corridors' start- and end-points can only be at even coordinates
+		if sx % 2 == 1 then sx = sx + 1 end
+		if sy % 2 == 1 then sy = sy + 1 end
+		if dx % 2 == 1 then dx = dx + 1 end
+		if dy % 2 == 1 then dy = dy + 1 end
+		return {sx, sy, dx, dy}
+	end
+
 	--	create the rooms
+	local links = {}
 	for i = 1, nRooms do
 		local rx, ry, rw, rh
 		local attempts = 0
 		repeat
 			attempts = attempts + 1
-			rx = math.random(1, Global.mapWidth - 5)
-			ry = math.random(1, Global.mapHeight - 5)
 			rw = math.random(5, 8)
 			rh = math.random(5, 7)
 
-			--	rooms can only be placed at odd-valued coordinates
-			if rx % 2 == 0 then rx = rx + 1 end
-			if ry % 2 == 0 then ry = ry + 1 end
-
 			--	rooms' dimensions can only have odd values
 			if rw % 2 == 0 then rw = rw + 1 end
 			if rh % 2 == 0 then rh = rh + 1 end
-		until self:isInBounds(rx+rw, ry+rh) and
-					self:isAreaEmpty(rx, ry, rw, rh) or
-					attempts == 100
 
-		if attempts == 100 then break end
+			--	rooms can only be placed at odd-valued coordinates, and leave
+			--	a row and column free below and to the right of them
+			rx, ry = self:findEmptyArea(rw + 1, rh + 1, 2)
+		until rx or attempts == 100
+
+		if not rx then break end
 
 		self:digRoom(rx, ry, rw, rh, Tile.roomFloor, Tile.wall)
 		table.insert(rooms, {x = rx, y = ry, w = rw, h = rh})
 
 		--	link each room with the closest to it
 		if i > 1 then
-			local r = rooms[closestRoom(#rooms)]
-			local sx = math.floor((r.x * 2 + r.w) / 2)
-			local sy = math.floor((r.y * 2 + r.h) / 2)
-			local dx = math.floor((rx * 2 + rw) / 2)
-			local dy = math.floor((ry * 2 + rh) / 2)
-
-			--	corridors' start- and end-points can only be at even coordinates
-			if sx % 2 == 1 then sx = sx + 1 end
-			if sy % 2 == 1 then sy = sy + 1 end
-			if dx % 2 == 1 then dx = dx + 1 end
-			if dy % 2 == 1 then dy = dy + 1 end
-			self:digLink(sx, sy, dx, dy, Tile.floor)
+			table.insert(links, roomLink(rooms[closestRoom(#rooms)], rooms[#rooms]))
 		end
 	end
 
+	--	add redundant links to make loops
+	for i = 1, nLoops do
+		local sourceRoom, destinationRoom
+		repeat
+			sourceRoom = math.random(1, #rooms)
+			destinationRoom = math.random(1, #rooms)
+		until	sourceRoom ~= destinationRoom and
+					roomDistance(rooms[sourceRoom], rooms[destinationRoom]) < 20
+
+		table.insert(links, roomLink(rooms[sourceRoom], rooms[destinationRoom]))
+	end
+
+	--	dig all the corridors
+	self:digLinks(links, Tile.floor)
+
 	--	postprocess: add 'lockers' (little 1x1 rooms next to regular rooms,
 	--	which should hidden and/or locked)
 	for i = 1, nLockers do
@@ -419,38 +576,11 @@ function Map:generateRoomsAndCorridors(nRooms, nLoops, nLockers)
 		end
 	end
 
-	--	postprocess: dig redundant links to make loops
-	for i = 1, nLoops do
-		local sourceRoom, destinationRoom
-		repeat
-			sourceRoom = math.random(1, #rooms)
-			destinationRoom = math.random(1, #rooms)
-		until	sourceRoom ~= destinationRoom and
-					roomDistance(rooms[sourceRoom], rooms[destinationRoom]) < 20
-
-		local sr, dr = rooms[sourceRoom], rooms[destinationRoom]
-		local sx = math.floor((sr.x * 2 + sr.w) / 2)
-		local sy = math.floor((sr.y * 2 + sr.h) / 2)
-		local dx = math.floor((dr.x * 2 + dr.w) / 2)
-		local dy = math.floor((dr.y * 2 + dr.h) / 2)
-
-		--	corridors' start- and end-points can only be at even coordinates
-		if sx % 2 == 1 then sx = sx + 1 end
-		if sy % 2 == 1 then sy = sy + 1 end
-		if dx % 2 == 1 then dx = dx + 1 end
-		if dy % 2 == 1 then dy = dy + 1 end
-		self:digLink(sx, sy, dx, dy, Tile.floor)
-	end
-
 	--	postprocess: surround corridors with wall tiles
-	for i = 1, Global.mapWidth do
-		for j = 1, Global.mapHeight do
-			if	self.tile[i][j] == Tile.void and
-					self:countNeighbours(i, j, Tile.floor) >= 1 then
-				self.tile[i][j] = Tile.wall
-			end
-		end
-	end
+	self:compileLayers()
+	clib.dilate(self.layers, Tile.idSet(Tile.floor), Tile.idSet(Tile.void),
+		Tile.wall.id)
+	self:applyLayers()
 
 	--	postprocess: add doors between rooms and corridors
 	for i = 1, #rooms do
@@ -497,15 +627,6 @@ end
 function Map:generateCave(nRooms, nLoops, cavernization)
 	local rooms = {}
 
-	--	getTileCost() - calculates the cost of collapsing a tile (used in
-	--	calculating which tiles to collapse in order to make the walls
-	--	look more like cave walls)
-	local function getTileCost(x, y)
-		local cost = 2 * self:countNeighbours(x, y, Tile.roomFloor)
-		if self.tile[x][y] == Tile.roomFloor then cost = cost + 16 end
-		return cost
-	end
-
 	--	roomDistance() - calculates the distance between two rooms
 	local function roomDistance(indexA, indexB)
 		return math.sqrt(	(indexA.x - indexB.x) * (indexA.x - indexB.x) +
@@ -525,32 +646,37 @@ function Map:generateCave(nRooms, nLoops, cavernization)
 		return minIndex
 	end
 	
+	--	roomLink() - returns the link (see Map:digLinks()) between the centres
+	--	of two rooms
+	local function roomLink(sr, dr)
+		return {math.floor((sr.x * 2 + sr.w) / 2), math.floor((sr.y * 2 + sr.h) / 2),
+			math.floor((dr.x * 2 + dr.w) / 2), math.floor((dr.y * 2 + dr.h) / 2)}
+	end
+
 	--	create the rooms
+	local links = {}
 	for i = 1, nRooms do
 		local rx, ry, rw, rh
+		local attempts = 0
 		repeat
-			rx = math.random(1, Global.mapWidth - 5)
-			ry = math.random(1, Global.mapHeight - 5)
+			attempts = attempts + 1
 			rw = math.random(2, 6)
 			rh = math.random(2, 5)
-		until self:isInBounds(rx+rw, ry+rh) and
-					self:isAreaEmpty(rx, ry, rw, rh)
+			rx, ry = self:findEmptyArea(rw + 1, rh + 1)
+		until rx or attempts == 100
+
+		if not rx then break end
 
 		self:digRoom(rx, ry, rw, rh, Tile.floor, Tile.wall)
 		table.insert(rooms, {x = rx, y = ry, w = rw, h = rh})
 
 		--	link each room with the closest to it
 		if i > 1 then
-			local r = rooms[closestRoom(#rooms)]
-			local sx = math.floor((r.x * 2 + r.w) / 2)
-			local sy = math.floor((r.y * 2 + r.h) / 2)
-			local dx = math.floor((rx * 2 + rw) / 2)
-			local dy = math.floor((ry * 2 + rh) / 2)
-			self:digLink(sx, sy, dx, dy, Tile.roomFloor)
+			table.insert(links, roomLink(rooms[closestRoom(#rooms)], rooms[#rooms]))
 		end
 	end
 
-	--	postprocess: dig redundant links to make loops
+	--	add redundant links to make loops
 	for i = 1, nLoops do
 		local sourceRoom, destinationRoom
 		repeat
@@ -559,54 +685,102 @@ function Map:generateCave(nRooms, nLoops, cavernization)
 		until	sourceRoom ~= destinationRoom and
 					roomDistance(rooms[sourceRoom], rooms[destinationRoom]) < 20
 
-		local sr, dr = rooms[sourceRoom], rooms[destinationRoom]
-		local sx = math.floor((sr.x * 2 + sr.w) / 2)
-		local sy = math.floor((sr.y * 2 + sr.h) / 2)
-		local dx = math.floor((dr.x * 2 + dr.w) / 2)
-		local dy = math.floor((dr.y * 2 + dr.h) / 2)
-
-		self:digLink(sx, sy, dx, dy, Tile.roomFloor)
+		table.insert(links, roomLink(rooms[sourceRoom], rooms[destinationRoom]))
 	end
 
+	--	dig all the corridors
+	self:digLinks(links, Tile.roomFloor)
+
 	--	postprocess: 'cavernize' - walls neighbouring the cave may collapse,
-	--	creating a more natural curve
+	--	creating a more natural curve; a tile collapses when twice the number
+	--	of cave tiles around it is more than 'cavernization'
+	self:compileLayers()
+	local caveIds = Tile.idSet(Tile.roomFloor)
 	for k = 1, 10 do
-		for i = 1, Global.mapWidth do
-			for j = 1, Global.mapHeight do
-				if getTileCost(i, j) > cavernization then
-					self.tile[i][j] = Tile.roomFloor
+		if clib.dilate(self.layers, caveIds, nil, Tile.roomFloor.id,
+				math.floor(cavernization / 2) + 1) == 0 then
+			break
+		end
+	end
+
+	--	postprocess: surround corridors with wall tiles
+	clib.dilate(self.layers, caveIds, Tile.idSet(Tile.void), Tile.wall.id)
+	self:applyLayers()
+end
+
+--	Map:connectRegions() - makes sure every part of a generated map can be
+--	reached, by finding the regions which can't be walked between (for the
+--	'connectivity' cost profile, see tile.lua) and digging between them: out
+--	a wall between two regions where there is one, or else a corridor from
+--	the biggest region apart from the main one to the main one, until there
+--	is one region left; keeps the regions in self.regions; does not return
+--	anything
+function Map:connectRegions()
+	--	randomTileIn() - returns the coordinates of a random tile of a region
+	local function randomTileIn(region)
+		local tiles = {}
+		for x = 1, Global.mapWidth do
+			for y = 1, Global.mapHeight do
+				if self.regions.labels[x][y] == region then
+					table.insert(tiles, {x, y})
 				end
 			end
 		end
+		return table.unpack(tiles[math.random(1, #tiles)])
 	end
 
-	--	postprocess: surround corridors with wall tiles
-	for i = 1, Global.mapWidth do
-		for j = 1, Global.mapHeight do
-			if	self.tile[i][j] == Tile.void and
-					self:countNeighbours(i, j, Tile.roomFloor) >= 1 then
-				self.tile[i][j] = Tile.wall
+	for attempt = 1, 20 do
+		self.regions = clib.findRegions(self.layers, "connectivity")
+		if #self.regions.sizes <= 1 then
+			return
+		end
+
+		--	dig out one wall between each pair of neighbouring regions
+		local joined = {}
+		for _, bridge in ipairs(self.regions.bridges) do
+			local key = bridge.a .. " " .. bridge.b
+			if not joined[key] then
+				joined[key] = true
+				self:setTile(bridge.x, bridge.y, Tile.floor)
 			end
 		end
+
+		if not next(joined) then
+			local x1, y1 = randomTileIn(2)
+			local x2, y2 = randomTileIn(1)
+			self:digLink(x1, y1, x2, y2, Tile.floor)
+		end
+
+		--	surround what was dug with wall tiles
+		clib.dilate(self.layers, Tile.idSet(Tile.floor), Tile.idSet(Tile.void),
+			Tile.wall.id)
+		self:applyLayers()
 	end
+
+	Log:write("Could not connect all regions of ", self, "; ",
+		#self.regions.sizes, " regions are left")
 end
 
 --	Map:linkWith() - links together two maps through the use of stairs;
---	the algorithm searches for stair spawning positions which are availible
---	on both maps, so that taking stairs is a strictly vertical movement;
---	does not return anything
+--	stairs are put on a random tile which is an empty space in the main
+--	region on both maps, so that taking stairs is a strictly vertical
+--	movement; does not return anything
 function Map:linkWith(what)
-	local x, y
-	repeat
-		x, y = self:findRandomEmptySpace()
-	until	not what:isSolid(x, y) and
-				not what:isOccupied(x, y)
+	local x, y = self.layers:randomSharedFreeTile(math.random(),
+		self.regions and self.regions.labels, what.layers,
+		what.regions and what.regions.labels)
+	if not x then
+		error("No place for stairs between " .. tostring(self) .. " and " ..
+			tostring(what))
+	end
 
-	self.tile[x][y] = Util.copyTable(Tile.upStairs)
-	self.tile[x][y]["destination-map"] = what
+	local upStairs = Util.copyTable(Tile.upStairs)
+	upStairs["destination-map"] = what
+	self:setTile(x, y, upStairs)
 
-	what.tile[x][y] = Util.copyTable(Tile.downStairs)
-	what.tile[x][y]["destination-map"] = self
+	local downStairs = Util.copyTable(Tile.downStairs)
+	downStairs["destination-map"] = self
+	what:setTile(x, y, downStairs)
 
 	Log:write("Linked maps: ", self, " and ", what)
 end
@@ -616,81 +790,57 @@ end
 --	neighbouring tiles; spread tiles include broken computers and piles of
 --	electronics; does not return anything
 function Map:spawnMachinery(nMachinery, chanceToSpread)
+	self:compileLayers()
+	local doors = clib.countNeighbours(self.layers, Tile.idSetByRole("door"))
+	local walls = clib.countNeighbours(self.layers, Tile.idSet(Tile.wall))
+
 	for i = 1, nMachinery do
 		local x, y
 		repeat
 			x = math.random(1, Global.mapWidth)
 			y = math.random(1, Global.mapHeight)
 		until		self.tile[x][y] == Tile.roomFloor
-				and	self:countNeighboursByRole(x, y, "door") == 0
-				and	self:countNeighbours(x, y, Tile.wall) >= 3
+				and	doors[x][y] == 0
+				and	walls[x][y] >= 3
 
-		self.tile[x][y] = Tile.brokenMachinery
+		self:setTile(x, y, Tile.brokenMachinery)
 	end
 
-	for i = 1, Global.mapWidth do
-		for j = 1, Global.mapHeight do
-			if		self:countNeighbours(i, j, Tile.brokenMachinery) > 0
-				and	self.tile[i][j] == Tile.roomFloor
-				and	math.random() < chanceToSpread then
-				if math.random() < 0.2 then
-					self.tile[i][j] = Tile.brokenComputer
-				else
-					self.tile[i][j] = Tile.pileOfElectronics
-				end
-			end
-		end
-	end
+	clib.spreadTiles(self.layers, Tile.idSet(Tile.brokenMachinery),
+		Tile.idSet(Tile.roomFloor), chanceToSpread,
+		{[Tile.brokenComputer.id] = 0.2, [Tile.pileOfElectronics.id] = 0.8},
+		math.random(0, 0x7fffffff))
+	self:applyLayers()
 end
 
 --	Map:spawnPoolsOfWater() - spawns a given number of pools of water around
 --	the given map, with a given chance of the water to spread to the
 --	neighbouring tiles; does not return anything
 function Map:spawnPoolsOfWater(nPools, chanceToSpread)
-	for i = 1, nPools do
-		local x, y
-		repeat
-			x = math.random(1, Global.mapWidth)
-			y = math.random(1, Global.mapHeight)
-		until self.tile[x][y] == Tile.roomFloor
-
-		self.tile[x][y] = Tile.shallowWater
-	end
-
-	for i = 1, Global.mapWidth do
-		for j = 1, Global.mapHeight do
-			if	self:countNeighbours(i, j, Tile.shallowWater) > 0
-					and self.tile[i][j] == Tile.roomFloor
-					and math.random() < chanceToSpread then
-				self.tile[i][j] = Tile.shallowWater
-			end
-		end
-	end
+	self:spawnSpreadingTiles(Tile.shallowWater, nPools, chanceToSpread)
 end
 
 --	Map:spawnPatchesOfGrass() - spawns a given number of patches of grass
 --	around the given map, with a given chance of the grass to spread to the
 --	neighbouring tiles; does not return anything
 function Map:spawnPatchesOfGrass(nPatches, chanceToSpread)
-	for i = 1, nPatches do
-		local x, y
-		repeat
-			x = math.random(1, Global.mapWidth)
-			y = math.random(1, Global.mapHeight)
-		until self.tile[x][y] == Tile.roomFloor
+	self:spawnSpreadingTiles(Tile.grass, nPatches, chanceToSpread)
+end
 
-		self.tile[x][y] = Tile.grass
+--	Map:spawnSpreadingTiles() - places a given number of tiles on random room
+--	floor tiles, which then spread to neighbouring room floor tiles (and
+--	further) with a given chance; does not return anything
+function Map:spawnSpreadingTiles(tile, nSeeds, chanceToSpread)
+	self:compileLayers()
+	local roomFloorIds = Tile.idSet(Tile.roomFloor)
+	for i = 1, nSeeds do
+		local x, y = self:findRandomEmptySpace(roomFloorIds)
+		self:setTile(x, y, tile)
 	end
 
-	for i = 1, Global.mapWidth do
-		for j = 1, Global.mapHeight do
-			if	self:countNeighbours(i, j, Tile.grass) > 0
-					and self.tile[i][j] == Tile.roomFloor
-					and math.random() < chanceToSpread then
-				self.tile[i][j] = Tile.grass
-			end
-		end
-	end
+	clib.spreadTiles(self.layers, Tile.idSet(tile), roomFloorIds,
+		chanceToSpread, tile.id, math.random(0, 0x7fffffff))
+	self:applyLayers()
 end
 
 --	Map:spawnTraps() - spawns a given number of traps on the given map;
@@ -721,102 +871,34 @@ function Map:spawnFires(nFires)
 	end
 end
 
---	TODO: document, add parameters
-function Map:generateBSP()
-	local rooms = {}
-	local doors = {}
-
-	local function split(room, iter)
-		--	avoid splitting rooms that are too small
-		if iter > 4 or room.w < 6 or room.h < 6 then
-			return false
-		end
-
-		--	either split depending on the ratio, or on a chance to generate irregular rooms
-		if room.w > room.h or math.random() < 0.1 then
-			--	vertical split
-			local splitWhere = math.random(3, room.w - 3)
-			local newRoom = {
-				x = room.x + splitWhere - 1,
-				y = room.y,
-				w = room.w - splitWhere + 1,
-				h = room.h
-			}
-			room.w = splitWhere
-
-			table.insert(rooms, newRoom)
-			table.insert(doors, { x = room.x + splitWhere - 1, y = math.random(room.y + 1, room.y + room.h - 2) })
-			split(room, iter+1)
-			split(newRoom, iter+1)
-			return true
-		else
-			--	horizontal split
-			local splitWhere = math.random(3, room.h - 3)
-			local newRoom = {
-				x = room.x,
-				y = room.y + splitWhere - 1,
-				w = room.w,
-				h = room.h - splitWhere + 1
-			}
-			room.h = splitWhere
-
-			table.insert(rooms, newRoom)
-			table.insert(doors, { x = math.random(room.x + 1, room.x + room.w - 2), y = room.y + splitWhere - 1 })
-			split(room, iter+1)
-			split(newRoom, iter+1)
-			return true
-		end
-	end
-
-	local function makePlantRoom(room, roomType)
-		local roomTypes = { "watervine", "berry", "mushroom" }
-		if not roomType then roomType = roomTypes[math.random(1, #roomTypes)] end
-
-		for i = room.x + 2, room.x + room.w - 3 do
-			for j = room.y + 2, room.y + room.h - 3 do
-				if roomType == "watervine" then
-					if math.random() < 0.3 then
-						self.tile[i][j] = Tile.waterVine
-					else
-						self.tile[i][j] = Tile.grass
-					end
-				end
-
-				if roomType == "berry" then
-					if math.random() < 0.5 then
-						self.tile[i][j] = Tile.spaceBerry
-					else
-						self.tile[i][j] = Tile.grass
-					end
-				end
-
-				if roomType == "mushroom" then
-					if math.random() < 0.6 then
-						self.tile[i][j] = Tile.mushroom
-					else
-						self.tile[i][j] = Tile.dirt
-					end
-				end
-			end
-		end
-	end
-
-	table.insert(rooms, {
-		x = 1,
-		y = 1,
-		w = Global.mapWidth,
-		h = Global.mapHeight
-	})
-	split(rooms[1], 0)
-
-	for i = 1, #rooms do
-		self:digRoom(rooms[i].x, rooms[i].y, rooms[i].w, rooms[i].h, Tile.roomFloor, Tile.wall)
-		makePlantRoom(rooms[i])
-	end
-
-	for i = 1, #doors do
-		self.tile[doors[i].x][doors[i].y] = Tile.closedDoor
-	end
+--	Map.plantRoomPalettes - the ways rooms of BSP maps are planted: each maps
+--	tiles' ids to the relative chances of each tile
+Map.plantRoomPalettes = {
+	--	watervine
+	{[Tile.waterVine.id] = 0.3, [Tile.grass.id] = 0.7},
+	--	berry
+	{[Tile.spaceBerry.id] = 0.5, [Tile.grass.id] = 0.5},
+	--	mushroom
+	{[Tile.mushroom.id] = 0.6, [Tile.dirt.id] = 0.4},
+}
+
+--	Map:generateBSP() - generates a map by splitting it into rooms again and
+--	again (up to 'maxDepth' times, default 4), each room being planted from
+--	one of Map.plantRoomPalettes (see clib.generateBSP()); returns a flat list
+--	of the rooms {x, y, w, h, ...} and of the doors {x, y, ...}
+function Map:generateBSP(maxDepth)
+	local rooms, doors = clib.generateBSP(self.layers, {
+		floor = Tile.roomFloor.id,
+		wall = Tile.wall.id,
+		door = Tile.closedDoor.id,
+		maxDepth = maxDepth or 4,
+		minSize = 6,
+		--	chance to generate irregular rooms
+		irregularChance = 0.1,
+		palettes = Map.plantRoomPalettes,
+	}, math.random(0, 0x7fffffff))
+	self:applyLayers()
+	return rooms, doors
 end
 
 return Map
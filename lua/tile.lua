@@ -16,8 +16,17 @@
 --	* role (string, optional) - used to categorise different classes of tiles
 --	*	locked (string, optional) - if it exists, it denotes the name of the keycard
 --		which is used to unlock the door
+--	*	id (integer) - identifies the type of tile to the C code (see
+--		Map.layers); copies of a tile keep the id of the original
+--	*	terrainType (string) - the class of terrain, which decides how costly
+--		the tile is to cross for each cost profile
+--	*	flammability (number, optional) - the chance each turn of the tile
+--		catching fire from each burning neighbour (see Game:updateHazards())
+--	*	burnsTo (tile, optional) - what is left of a flammable tile after it
+--		has burnt; by default dirt
 --
 
+local Global = require "lua/global"
 local Game = require "lua/game"
 local UI = require "lua/ui"
 
@@ -28,7 +37,8 @@ Tile.void = {
 	["face"] = " ",
 	["color"] = curses.black,
 	["solid"] = true,
-	["opaque"] = false
+	["opaque"] = false,
+	["terrainType"] = "void"
 }
 
 Tile.floor = {
@@ -36,7 +46,8 @@ Tile.floor = {
 	["face"] = ".",
 	["color"] = curses.white,
 	["solid"] = false,
-	["opaque"] = false
+	["opaque"] = false,
+	["terrainType"] = "floor"
 }
 
 Tile.roomFloor = {
@@ -44,7 +55,8 @@ Tile.roomFloor = {
 	["face"] = ".",
 	["color"] = curses.white,
 	["solid"] = false,
-	["opaque"] = false
+	["opaque"] = false,
+	["terrainType"] = "floor"
 }
 
 Tile.wall = {
@@ -52,7 +64,8 @@ Tile.wall = {
 	["face"] = "#",
 	["color"] = curses.yellow,
 	["solid"] = true,
-	["opaque"] = true
+	["opaque"] = true,
+	["terrainType"] = "wall"
 }
 
 Tile.upStairs = {
@@ -62,6 +75,7 @@ Tile.upStairs = {
 	["solid"] = false,
 	["opaque"] = false,
 	["role"] = "stairs",
+	["terrainType"] = "floor"
 	--"destination-map" added to copy
 }
 
@@ -72,6 +86,7 @@ Tile.downStairs = {
 	["solid"] = false,
 	["opaque"] = false,
 	["role"] = "stairs",
+	["terrainType"] = "floor"
 	--"destination-map" added to copy
 }
 
@@ -85,7 +100,9 @@ Tile.grass = {
 		if actor == Game.player then
 			UI:message("{{cyan}}Your feet are tingled by the grass.")
 		end
-	end
+	end,
+	["flammability"] = 0.2,
+	["terrainType"] = "floor"
 }
 
 Tile.waterVine = {
@@ -98,7 +115,9 @@ Tile.waterVine = {
 		if actor == Game.player then
 			UI:message("{{cyan}}Your feet are mushing through the water vine.")
 		end
-	end
+	end,
+	["flammability"] = 0.05,
+	["terrainType"] = "floor"
 }
 
 Tile.mushroom = {
@@ -106,7 +125,9 @@ Tile.mushroom = {
 	["face"] = ":",
 	["color"] = curses.white,
 	["solid"] = false,
-	["opaque"] = false
+	["opaque"] = false,
+	["flammability"] = 0.1,
+	["terrainType"] = "floor"
 }
 
 Tile.dirt = {
@@ -114,7 +135,8 @@ Tile.dirt = {
 	["face"] = ".",
 	["color"] = curses.yellow,
 	["solid"] = false,
-	["opaque"] = false
+	["opaque"] = false,
+	["terrainType"] = "floor"
 }
 
 Tile.spaceBerry = {
@@ -122,7 +144,9 @@ Tile.spaceBerry = {
 	["face"] = "%",
 	["color"] = curses.magenta,
 	["solid"] = false,
-	["opaque"] = false
+	["opaque"] = false,
+	["flammability"] = 0.1,
+	["terrainType"] = "floor"
 }
 
 Tile.shallowWater = {
@@ -136,13 +160,14 @@ Tile.shallowWater = {
 			UI:message("{{cyan}}Your feet get cold from the water.")
 		end
 
-		if actor.activeEffects["{{RED}}Burning"] then
-			actor.activeEffects["{{RED}}Burning"] = nil
+		if actor.activeEffects.burning then
+			actor:removeEffect("burning")
 			if actor == Game.player then
 				UI:message("{{GREEN}}The water extinguishes your fire.")
 			end
 		end
-	end
+	end,
+	["terrainType"] = "water"
 }
 
 Tile.ceilingDrip = {
@@ -155,7 +180,8 @@ Tile.ceilingDrip = {
 		if actor == Game.player then
 			UI:message("{{cyan}}Something is dripping from the ceiling.")
 		end
-	end
+	end,
+	["terrainType"] = "floor"
 }
 
 Tile.openDoor = {
@@ -164,7 +190,8 @@ Tile.openDoor = {
 	["color"] = curses.white,
 	["solid"] = false,
 	["opaque"] = false,
-	["role"] = "door"
+	["role"] = "door",
+	["terrainType"] = "floor"
 }
 
 Tile.closedDoor = {
@@ -173,7 +200,8 @@ Tile.closedDoor = {
 	["color"] = curses.white,
 	["solid"] = 10,
 	["opaque"] = true,
-	["role"] = "door"
+	["role"] = "door",
+	["terrainType"] = "closedDoor"
 }
 
 Tile.hiddenDoor = {
@@ -182,7 +210,8 @@ Tile.hiddenDoor = {
 	["color"] = curses.yellow,
 	["solid"] = true,
 	["opaque"] = true,
-	["role"] = "door"
+	["role"] = "door",
+	["terrainType"] = "hiddenDoor"
 }
 
 Tile.lockedDoor = {
@@ -191,7 +220,8 @@ Tile.lockedDoor = {
 	["color"] = curses.red + curses.bold,
 	["solid"] = true,
 	["opaque"] = true,
-	["role"] = "door"
+	["role"] = "door",
+	["terrainType"] = "lockedDoor"
 	--"locked" added to copy
 }
 
@@ -200,7 +230,8 @@ Tile.brokenComputer = {
 	["face"] = "&",
 	["color"] = curses.cyan,
 	["solid"] = true,
-	["opaque"] = false
+	["opaque"] = false,
+	["terrainType"] = "obstacle"
 }
 
 Tile.pileOfElectronics = {
@@ -208,7 +239,8 @@ Tile.pileOfElectronics = {
 	["face"] = ";",
 	["color"] = curses.cyan,
 	["solid"] = false,
-	["opaque"] = false
+	["opaque"] = false,
+	["terrainType"] = "floor"
 }
 
 Tile.brokenMachinery = {
@@ -216,7 +248,8 @@ Tile.brokenMachinery = {
 	["face"] = "#",
 	["color"] = curses.cyan,
 	["solid"] = true,
-	["opaque"] = false
+	["opaque"] = false,
+	["terrainType"] = "obstacle"
 }
 
 Tile.alarmTrap = {
@@ -230,14 +263,11 @@ Tile.alarmTrap = {
 		if actor ~= Game.player then
 			return
 		end
-		--	alert all enemies (which are on the same map as the player) of the player's location
-		for _, enemy in pairs(Game.actorList) do
-			if enemy ~= Game.player and enemy.map == Game.player.map then
-				enemy.aiState = "chase"
-			end
-		end
+		--	alert all enemies within earshot of the player's location
+		Game:makeNoise(actor.map, actor.x, actor.y, Global.noiseVolume.alarmTrap, actor)
 		UI:message("{{RED}}You hear a loud alarming sound! You have triggered a trap!")
-	end
+	end,
+	["terrainType"] = "floor"
 }
 
 Tile.fire = {
@@ -250,20 +280,91 @@ Tile.fire = {
 		if actor == Game.player then
 			UI:message("{{RED}}AAARGH! It burns!")
 		end
-		actor:addEffect("{{RED}}Burning", function(a)
-			--	a burning actor takes 1 point of damage per turn
-			a:takeDamage(nil, 1, "burned to death")
-			if a == Game.player then
-				UI:message("{{RED}}You take damage from burning.")
-			end
+		actor:addEffect("burning")
+	end,
+	["terrainType"] = "fire"
+}
 
-			--	burning also makes you unable to effectively use your weapons
-			a.skills.melee = 0
-			a.skills.handguns = 0
-			a.skills.shotguns = 0
-		end, 5)
+--	Tile.byId - maps Tile.id to the tile prototype. The order of this list
+--	gives the ids, so only append to it
+Tile.byId = {
+	Tile.void, Tile.floor, Tile.roomFloor, Tile.wall, Tile.upStairs,
+	Tile.downStairs, Tile.grass, Tile.waterVine, Tile.mushroom, Tile.dirt,
+	Tile.spaceBerry, Tile.shallowWater, Tile.ceilingDrip, Tile.openDoor,
+	Tile.closedDoor, Tile.hiddenDoor, Tile.lockedDoor, Tile.brokenComputer,
+	Tile.pileOfElectronics, Tile.brokenMachinery, Tile.alarmTrap, Tile.fire,
+}
+
+for id, tile in ipairs(Tile.byId) do
+	tile.id = id
+	--	actors and items are placed randomly only on non-solid tiles other
+	--	than stairs (see Map:findRandomEmptySpace())
+	clib.defineTile(id, tile.terrainType, tile.opaque,
+		not tile.solid and tile.role ~= "stairs")
+end
+
+--	fire spreads to flammable tiles, which burn down to dirt by default
+local fuels, burnsTo = {}, {}
+for id, tile in ipairs(Tile.byId) do
+	if tile.flammability then
+		fuels[id] = tile.flammability
+		burnsTo[id] = (tile.burnsTo or Tile.dirt).id
 	end
+end
+clib.defineFire(Tile.fire.id, Global.fire.burnTime, Global.fire.smokeTime,
+	fuels, burnsTo)
+
+--	Tile.idSet() - returns the set {[Tile.id] = true} of the given tiles, as
+--	taken by the grid kernels (see Map:applyLayers())
+function Tile.idSet(...)
+	local set = {}
+	for _, tile in ipairs({...}) do
+		set[tile.id] = true
+	end
+	return set
+end
+
+--	Tile.idSetByRole() - returns the set {[Tile.id] = true} of the tiles which
+--	have the given role
+function Tile.idSetByRole(role)
+	local set = {}
+	for id, tile in ipairs(Tile.byId) do
+		if tile.role == role then
+			set[id] = true
+		end
+	end
+	return set
+end
+
+--	Tile.costProfiles - the ways actors can move around: for each cost profile,
+--	the cost of moving onto each terrainType; missing terrain types are
+--	impassable. Each Map keeps a native cost layer for each of these, which
+--	Dijkstra maps are computed from (Actor.costProfile says which to use)
+Tile.costProfiles = {
+	--	can't open doors
+	walker = { floor = 1, water = 1, fire = 5 },
+	--	opens closed doors by bumping into them
+	humanoid = { floor = 1, water = 1, fire = 5, closedDoor = 2 },
+	--	flies over water, fire and low obstacles
+	flyer = { floor = 1, water = 1, fire = 1, obstacle = 1 },
+	--	happiest in the water
+	swimmer = { floor = 2, water = 0.5, fire = 5 },
+	--	not for moving: how much sound is dampened crossing each terrain type
+	--	(see Game:makeNoise())
+	sound = { floor = 1, water = 1, fire = 1, obstacle = 1, closedDoor = 4,
+		lockedDoor = 4, wall = 8, hiddenDoor = 8 },
+	--	not for moving: which tiles projectiles fly over; they stop at the rest
+	--	(see Actor:fireWeapon())
+	projectile = { floor = 1, water = 1, fire = 1 },
+	--	not for moving: which tiles the player must be able to get between
+	--	(possibly with keys, or by finding hidden doors) on a generated map
+	--	(see Map:connectRegions())
+	connectivity = { floor = 1, water = 1, fire = 1, closedDoor = 1,
+		lockedDoor = 1, hiddenDoor = 1 },
 }
 
-return Tile
+for name, costs in pairs(Tile.costProfiles) do
+	clib.defineCostProfile(name, costs)
+end
 
+return Tile
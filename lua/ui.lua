@@ -6,6 +6,8 @@
 --	The UI object has the following members:
 --	*	width and height (integers) - size of the terminal window
 --	* messageList (table) - a list of in-game messages
+--	* messageCount (int) - how many messages have been logged, counting
+--		repeats (used to notice that something happened)
 --
 
 --	The singleton UI object
@@ -24,6 +26,7 @@ local Game = require "lua/game"
 function UI:init()
 	self.width, self.height = curses.init()
 	self.messageList = {}
+	self.messageCount = 0
 	Log:write("Initialized curses interface. curses.utf8=", curses.utf8)
 	Log:write("Curses w/h: " .. self.width .. "x" .. self.height)
 	Log:write("Screen w/h: " .. Global.screenWidth .. "x" .. Global.screenHeight)
@@ -38,6 +41,9 @@ end
 --	UI.drawScreen() - draws the main screen, which includes the map, HUD, and
 --	message bars; does not return anything
 function UI:drawScreen()
+	--	describe the fights the player has seen since the screen was last drawn
+	Game:showCombatLog()
+
 	--	the offsets from map coordinates to screen coordinates
 	local xOffset, yOffset = -1, 2
 
@@ -50,9 +56,15 @@ function UI:drawScreen()
 		for j = 1, Global.mapHeight do
 			--	draw only tiles visible by the player, or tiles and items in the player's memory
 			if Game.player.sightMap[i][j] then
-				curses.attr(map.tile[i][j].color)
-				curses.write(i + xOffset, j + yOffset, map.tile[i][j].face)
-			elseif map.memory[i][j] ~= " " then
+				--	smoke hides what's under it, except fire
+				if map.smoke[i][j] and map.tile[i][j].terrainType ~= "fire" then
+					curses.attr(curses.white)
+					curses.write(i + xOffset, j + yOffset, "*")
+				else
+					curses.attr(map.tile[i][j].color)
+					curses.write(i + xOffset, j + yOffset, map.tile[i][j].face)
+				end
+			elseif map.memory[i][j] then
 				curses.attr(curses.BLACK)
 				curses.write(i + xOffset, j + yOffset, map.memory[i][j])
 			else
@@ -149,9 +161,9 @@ function UI:drawScreen()
 
 	--	draw the active status effects
 	local effectLength = 20
-	for name, eff in pairs(Game.player.activeEffects) do
-		UI:colorWrite(effectLength, 23, name)
-		effectLength = effectLength + string.len(name) + 1
+	for _, eff in pairs(Game.player.activeEffects) do
+		UI:colorWrite(effectLength, 23, eff.name)
+		effectLength = effectLength + string.len(eff.name) + 1
 	end
 
 	--	position the cursor on the player, so it may be easily seen
@@ -256,7 +268,10 @@ end
 --	may see it in-game; handles repeating messages by counting the times
 --	a message was logged; does not return anything
 function UI:message(text)
+	--	fights are described in order with everything else
+	Game:showCombatLog()
 	Log:write("Message logged: " .. text)
+	self.messageCount = self.messageCount + 1
 	--	if there are no messages, there's no purpose in testing for repeats
 	if #self.messageList == 0 then
 		table.insert(self.messageList, {text = text, times = 1})
@@ -910,6 +925,8 @@ function UI:skillPointScreen()
 		end
 	end
 
+	Game.player:updateSkills()
+
 	--	restore visibility to the cursor
 	curses.cursor(1)
 end
@@ -933,6 +950,7 @@ function UI:examineScreen()
 		curses.attr(curses.WHITE)
 		curses.box(30, 10)
 		self:colorWrite(dialogX + 10, dialogY, "{{WHITE}} Examine ")
+		self:colorWrite(dialogX + 1, dialogY + 8, " {{cyan}}t{{pop}} travel here ")
 		self:colorWrite(dialogX + 1, dialogY + 9, " {{cyan}}Move keys{{pop}} move {{cyan}}TAB{{pop}} cycle ")
 
 		if Game.player.sightMap[cursorX][cursorY] then
@@ -1012,6 +1030,13 @@ function UI:examineScreen()
 			running = true
 		end
 
+		--	travel to the tile under the cursor (see Actor:startTravel())
+		if k == "t" and not (cursorX == Game.player.x and cursorY == Game.player.y) then
+			if not Game.player:startTravel(cursorX, cursorY) then
+				self:message("You don't know the way there.")
+			end
+		end
+
 		--	movement
 		local dir, xOff, yOff = UI:directionFromKey(k)
 		if dir and Game.player.map:isInBounds(cursorX + xOff, cursorY + yOff) then
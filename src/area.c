@@ -0,0 +1,107 @@
+/* -*- c-basic-offset: 8 -*- */
+/* This file contains area of effect queries, for explosions and other
+   effects with a radius: the tiles reached are found by a flood fill out
+   from the centre which only keeps tiles the centre has a line of sight to,
+   so that walls shelter what's behind them and an effect doesn't leak
+   around corners. The actors caught are then read off the occupancy
+   layer. */
+
+#include <stdlib.h>
+#include <math.h>
+#include "nush.h"
+
+
+/* Returns true if nothing between the centres of two tiles blocks
+   (the tiles themselves aren't checked), stepping along the line like
+   projectiles do (see projectiles.c) */
+static int clear_line(MapLayers *layers, const disttype *costs, int x1, int y1, int x2, int y2)
+{
+	int steps = abs(x2 - x1) > abs(y2 - y1) ? abs(x2 - x1) : abs(y2 - y1), i;
+	double dx, dy;
+	if (steps <= 1)
+		return 1;
+	dx = (double)(x2 - x1) / steps;
+	dy = (double)(y2 - y1) / steps;
+	for (i = 1; i < steps; i++)
+	{
+		int x = floor(x1 + 0.5 + dx * i), y = floor(y1 + 0.5 + dy * i);
+		if (costs[LAYERS_INDEX(layers, x, y)] >= IMPASSABLE_COST)
+			return 0;
+	}
+	return 1;
+}
+
+/* clib.areaOfEffect(layers, profile, x, y, radius) - finds what an effect
+   centred on x, y reaches: the tiles no further than 'radius' away (in a
+   straight line) which can be reached from x, y without crossing a tile
+   impassable in the cost profile 'profile', and which can be seen from x, y
+   past such tiles. Impassable tiles are reached, but the effect goes no
+   further. Each tile reached has a falloff, 1 at the centre falling to
+   1 / (radius + 1) at the edge, to scale the strength of the effect with.
+   Returns a flat list {x, y, falloff, ...} of the tiles, nearest first, and
+   a table mapping the Actor._id of each actor on one of them to its
+   falloff */
+int clib_areaofeffect(lua_State *L)
+{
+	MapLayers *layers = MapLayers_check(L, 1);
+	int profile = check_cost_profile(L, 2);
+	int x = luaL_checkinteger(L, 3);
+	int y = luaL_checkinteger(L, 4);
+	double radius = luaL_checknumber(L, 5);
+	if (x < 1 || x > layers->w || y < 1 || y > layers->h)
+		luaL_error(L, "position %d,%d is out of bounds", x, y);
+	if (radius < 0)
+		luaL_error(L, "negative radius");
+	disttype *costs = MapLayers_costs(layers, profile);
+
+	/* Breadth first, so tiles come out roughly nearest first */
+	int size = layers->w * layers->h, head = 0, tail = 0, num = 0, dx, dy;
+	int *queue = malloc(sizeof(int) * size);
+	unsigned char *seen = calloc(size, 1);
+	double max_sq = (radius + 0.5) * (radius + 0.5);
+	queue[tail++] = LAYERS_INDEX(layers, x, y);
+	seen[queue[0]] = 1;
+
+	lua_newtable(L);
+	lua_newtable(L);
+	while (head < tail)
+	{
+		int idx = queue[head++];
+		int tx = idx % layers->w + 1, ty = idx / layers->w + 1;
+		double falloff = 1 - sqrt((tx - x) * (tx - x) + (ty - y) * (ty - y)) / (radius + 1);
+
+		lua_pushinteger(L, tx);
+		lua_rawseti(L, -3, ++num);
+		lua_pushinteger(L, ty);
+		lua_rawseti(L, -3, ++num);
+		lua_pushnumber(L, falloff);
+		lua_rawseti(L, -3, ++num);
+		if (layers->occupants[idx])
+		{
+			lua_pushnumber(L, falloff);
+			lua_rawseti(L, -2, layers->occupants[idx]);
+		}
+
+		/* The effect stops at impassable tiles, except where it starts */
+		if (head > 1 && costs[idx] >= IMPASSABLE_COST)
+			continue;
+		for (dy = -1; dy <= 1; dy++)
+		{
+			for (dx = -1; dx <= 1; dx++)
+			{
+				int nx = tx + dx, ny = ty + dy;
+				if (nx < 1 || nx > layers->w || ny < 1 || ny > layers->h)
+					continue;
+				int n = LAYERS_INDEX(layers, nx, ny);
+				if (seen[n] || (nx - x) * (nx - x) + (ny - y) * (ny - y) > max_sq)
+					continue;
+				seen[n] = 1;
+				if (clear_line(layers, costs, x, y, nx, ny))
+					queue[tail++] = n;
+			}
+		}
+	}
+	free(seen);
+	free(queue);
+	return 2;
+}
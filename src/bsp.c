@@ -0,0 +1,227 @@
+/* -*- c-basic-offset: 8 -*- */
+/* This file contains the BSP map generator: the whole map is split again
+   and again into rooms which share walls, with a door in each split, and
+   the rooms are decorated from palettes of tiles. Tiles are written straight
+   into the tile ids of a MapLayers. */
+
+#include <stdlib.h>
+#include "nush.h"
+
+
+typedef struct {
+	int x, y, w, h;
+} Room;
+
+typedef struct {
+	RandomState random;
+	int max_depth, min_size;
+	double irregular_chance;
+	Room *rooms;
+	int num_rooms, max_rooms;
+	int *doors;     /* x, y of each door */
+	int num_doors;
+} BSP;
+
+static int add_room(BSP *bsp, Room room)
+{
+	if (bsp->num_rooms == bsp->max_rooms)
+	{
+		bsp->max_rooms *= 2;
+		bsp->rooms = realloc(bsp->rooms, sizeof(Room) * bsp->max_rooms);
+		bsp->doors = realloc(bsp->doors, sizeof(int) * 2 * bsp->max_rooms);
+	}
+	bsp->rooms[bsp->num_rooms] = room;
+	return bsp->num_rooms++;
+}
+
+static void add_door(BSP *bsp, int x, int y)
+{
+	bsp->doors[bsp->num_doors * 2] = x;
+	bsp->doors[bsp->num_doors * 2 + 1] = y;
+	bsp->num_doors++;
+}
+
+/* Splits a room in two, either across its longer side or (by chance)
+   across its shorter side, and then splits both halves further. The room
+   keeps the first half; the second is a new room. Rooms overlap by the
+   wall between them. */
+static void split(BSP *bsp, int room_idx, int depth)
+{
+	Room room = bsp->rooms[room_idx], half = room;
+	if (depth > bsp->max_depth || room.w < bsp->min_size || room.h < bsp->min_size)
+		return;
+
+	if (room.w > room.h || random_double(&bsp->random) < bsp->irregular_chance)
+	{
+		int at = random_int(&bsp->random, 3, room.w - 3);
+		half.x = room.x + at - 1;
+		half.w = room.w - at + 1;
+		room.w = at;
+		add_door(bsp, room.x + at - 1, random_int(&bsp->random, room.y + 1, room.y + room.h - 2));
+	}
+	else
+	{
+		int at = random_int(&bsp->random, 3, room.h - 3);
+		half.y = room.y + at - 1;
+		half.h = room.h - at + 1;
+		room.h = at;
+		add_door(bsp, random_int(&bsp->random, room.x + 1, room.x + room.w - 2), room.y + at - 1);
+	}
+	bsp->rooms[room_idx] = room;
+	int half_idx = add_room(bsp, half);
+	split(bsp, room_idx, depth + 1);
+	split(bsp, half_idx, depth + 1);
+}
+
+/* Pushes a flat list of integers */
+static void push_ints(lua_State *L, const int *ints, int num)
+{
+	int i;
+	lua_createtable(L, num, 0);
+	for (i = 0; i < num; i++)
+	{
+		lua_pushinteger(L, ints[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+}
+
+/* Returns an integer field of the options table at index 2 */
+static int int_option(lua_State *L, const char *name, int def)
+{
+	lua_getfield(L, 2, name);
+	int ret = lua_isnil(L, -1) ? def : lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	return ret;
+}
+
+/* Checks the first 'num' palettes of the list at a stack index, before
+   anything is allocated for them (which would leak if an error were
+   raised) */
+static void check_palettes(lua_State *L, int arg, int num)
+{
+	int ids[MAX_TILE_TYPES], i;
+	double weights[MAX_TILE_TYPES];
+	for (i = 0; i < num; i++)
+	{
+		lua_rawgeti(L, arg, i + 1);
+		check_tile_weights(L, lua_gettop(L), ids, weights);
+		lua_pop(L, 1);
+	}
+}
+
+/* clib.generateBSP(layers, options, seed) - generates a BSP map over the
+   whole of a map, replacing every tile. The options are:
+     floor, wall, door - the Tile.ids of rooms' floors, walls and doors
+     maxDepth - how many times rooms are split, at most (default 4)
+     minSize - rooms narrower than this aren't split (default 6, at least 6)
+     irregularChance - chance of splitting a room across its shorter side
+                       (default 0)
+     palettes - list of tables mapping Tile.ids to relative weights; each
+                room gets one at random, and its middle (leaving a tile of
+                floor inside the walls) is filled with tiles picked from it
+   'seed' is an integer (e.g. from math.random()).
+   Returns a flat list {x, y, w, h, x, y, w, h, ...} of the rooms (including
+   their walls), and a flat list {x, y, x, y, ...} of the doors. Use
+   layers:saveTiles() to copy the tiles to the Lua tiles. */
+int clib_generatebsp(lua_State *L)
+{
+	MapLayers *layers = MapLayers_check(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	BSP bsp;
+	bsp.random = check_random_seed(L, 3);
+	int floor_id = int_option(L, "floor", 0);
+	int wall_id = int_option(L, "wall", 0);
+	int door_id = int_option(L, "door", 0);
+	if (floor_id < 1 || floor_id >= MAX_TILE_TYPES || wall_id < 1 ||
+	    wall_id >= MAX_TILE_TYPES || door_id < 1 || door_id >= MAX_TILE_TYPES)
+		luaL_error(L, "floor, wall and door must be tile ids");
+	bsp.max_depth = int_option(L, "maxDepth", 4);
+	bsp.min_size = int_option(L, "minSize", 6);
+	if (bsp.min_size < 6)
+		bsp.min_size = 6;
+	lua_getfield(L, 2, "irregularChance");
+	bsp.irregular_chance = lua_tonumber(L, -1);
+	lua_pop(L, 1);
+
+	/* Read the palettes */
+	lua_getfield(L, 2, "palettes");
+	int palettes_index = lua_gettop(L);
+	int num_palettes = lua_istable(L, palettes_index) ? (int)lua_rawlen(L, palettes_index) : 0;
+	int i, j, x, y;
+	check_palettes(L, palettes_index, num_palettes);
+	int *palette_sizes = malloc(sizeof(int) * (num_palettes + 1));
+	int (*palette_ids)[MAX_TILE_TYPES] = malloc(sizeof(*palette_ids) * (num_palettes + 1));
+	double (*palette_weights)[MAX_TILE_TYPES] = malloc(sizeof(*palette_weights) * (num_palettes + 1));
+	double *palette_totals = malloc(sizeof(double) * (num_palettes + 1));
+	for (i = 0; i < num_palettes; i++)
+	{
+		lua_rawgeti(L, palettes_index, i + 1);
+		palette_sizes[i] = check_tile_weights(L, lua_gettop(L), palette_ids[i], palette_weights[i]);
+		lua_pop(L, 1);
+		palette_totals[i] = 0;
+		for (j = 0; j < palette_sizes[i]; j++)
+			palette_totals[i] += palette_weights[i][j];
+	}
+	lua_pop(L, 1);
+
+	/* Split the map into rooms */
+	bsp.max_rooms = 16;
+	bsp.rooms = malloc(sizeof(Room) * bsp.max_rooms);
+	bsp.doors = malloc(sizeof(int) * 2 * bsp.max_rooms);
+	bsp.num_rooms = bsp.num_doors = 0;
+	Room whole = { 1, 1, layers->w, layers->h };
+	add_room(&bsp, whole);
+	split(&bsp, 0, 0);
+
+	/* Write the tiles: rooms, their decoration, then doors */
+	unsigned char *ids = layers->tile_ids;
+	for (i = 0; i < bsp.num_rooms; i++)
+	{
+		Room *r = &bsp.rooms[i];
+		for (y = r->y; y < r->y + r->h; y++)
+		{
+			for (x = r->x; x < r->x + r->w; x++)
+			{
+				int edge = x == r->x || y == r->y || x == r->x + r->w - 1 || y == r->y + r->h - 1;
+				ids[LAYERS_INDEX(layers, x, y)] = edge ? wall_id : floor_id;
+			}
+		}
+
+		if (!num_palettes)
+			continue;
+		int p = random_int(&bsp.random, 0, num_palettes - 1);
+		if (!palette_sizes[p] || palette_totals[p] <= 0)
+			continue;
+		for (y = r->y + 2; y <= r->y + r->h - 3; y++)
+		{
+			for (x = r->x + 2; x <= r->x + r->w - 3; x++)
+			{
+				ids[LAYERS_INDEX(layers, x, y)] = random_tile(&bsp.random, palette_sizes[p],
+					palette_ids[p], palette_weights[p], palette_totals[p]);
+			}
+		}
+	}
+	for (i = 0; i < bsp.num_doors; i++)
+		ids[LAYERS_INDEX(layers, bsp.doors[i * 2], bsp.doors[i * 2 + 1])] = door_id;
+	MapLayers_tiles_changed(layers);
+
+	int *room_ints = malloc(sizeof(int) * 4 * bsp.num_rooms);
+	for (i = 0; i < bsp.num_rooms; i++)
+	{
+		room_ints[i * 4] = bsp.rooms[i].x;
+		room_ints[i * 4 + 1] = bsp.rooms[i].y;
+		room_ints[i * 4 + 2] = bsp.rooms[i].w;
+		room_ints[i * 4 + 3] = bsp.rooms[i].h;
+	}
+	push_ints(L, room_ints, bsp.num_rooms * 4);
+	push_ints(L, bsp.doors, bsp.num_doors * 2);
+
+	free(room_ints);
+	free(bsp.rooms);
+	free(bsp.doors);
+	free(palette_sizes);
+	free(palette_ids);
+	free(palette_weights);
+	free(palette_totals);
+	return 2;
+}
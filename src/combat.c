@@ -0,0 +1,212 @@
+/* -*- c-basic-offset: 8 -*- */
+/* This file contains CombatLog, which resolves attacks and keeps what
+   happened as compact event records until the screen is next drawn: only
+   then are the events the player can see picked out (looking up where they
+   happened in the player's sight map) to be turned into messages, so
+   nothing is spent on describing fights out of sight. Attack rolls come
+   from the log's own seeded random numbers. */
+
+#include <stdlib.h>
+#include "nush.h"
+
+#define COMBAT_LOG_METATABLE "nush.CombatLog"
+
+/* Kinds of events */
+#define EVENT_ATTACK 1
+#define EVENT_DEATH 2
+
+/* Event flags */
+#define EVENT_HIT 1
+#define EVENT_RANGED 2
+#define EVENT_ATTACKER_SEEN 4  /* set by log:take() */
+#define EVENT_DEFENDER_SEEN 8
+
+
+typedef struct {
+	unsigned char kind, flags;
+	short map;                /* Map.num of where it happened */
+	int attacker, defender;   /* Actor._ids; a death only has a defender */
+	short ax, ay, dx, dy;     /* where they were */
+	short verb;               /* the attack, see log:attack() */
+	short damage;
+} CombatEvent;
+
+typedef struct {
+	RandomState random;
+	CombatEvent *events;
+	int num, max;
+} CombatLog;
+
+static CombatLog *check_log(lua_State *L, int arg)
+{
+	return luaL_checkudata(L, arg, COMBAT_LOG_METATABLE);
+}
+
+static CombatEvent *new_event(CombatLog *log)
+{
+	if (log->num == log->max)
+	{
+		log->max = log->max ? log->max * 2 : 64;
+		log->events = realloc(log->events, sizeof(CombatEvent) * log->max);
+	}
+	return &log->events[log->num++];
+}
+
+/* clib.newCombatLog(seed) - create an empty combat log, whose attack rolls
+   are seeded with 'seed', an integer (e.g. from math.random()) */
+int clib_newcombatlog(lua_State *L)
+{
+	RandomState random = check_random_seed(L, 1);
+	CombatLog *log = lua_newuserdata(L, sizeof(CombatLog));
+	log->random = random;
+	log->events = NULL;
+	log->num = log->max = 0;
+
+	luaL_getmetatable(L, COMBAT_LOG_METATABLE);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+static int log_gc(lua_State *L)
+{
+	free(check_log(L, 1)->events);
+	return 0;
+}
+
+/* log:attack(map, attacker, ax, ay, defender, dx, dy, verb, accuracy,
+              minDamage, maxDamage, ranged)
+   Rolls an attack on map number 'map' by the actor with Actor._id
+   'attacker' at ax, ay on 'defender' at dx, dy: it hits with a chance of
+   'accuracy' (0 to 1; use 0 or 1 if it's already decided), doing between
+   'minDamage' and 'maxDamage'. 'verb' is a number for the Lua code to tell
+   how it's described. Records the event, and returns whether it hit and
+   the damage (0 if it missed) */
+static int log_attack(lua_State *L)
+{
+	CombatLog *log = check_log(L, 1);
+	double accuracy = luaL_checknumber(L, 10);
+	int min_damage = luaL_checkinteger(L, 11);
+	int max_damage = luaL_checkinteger(L, 12);
+	int hit = random_double(&log->random) < accuracy;
+	int damage = hit ? random_int(&log->random, min_damage, max_damage) : 0;
+
+	CombatEvent *event = new_event(log);
+	event->kind = EVENT_ATTACK;
+	event->flags = (hit ? EVENT_HIT : 0) | (lua_toboolean(L, 13) ? EVENT_RANGED : 0);
+	event->map = luaL_checkinteger(L, 2);
+	event->attacker = luaL_checkinteger(L, 3);
+	event->ax = luaL_checkinteger(L, 4);
+	event->ay = luaL_checkinteger(L, 5);
+	event->defender = luaL_checkinteger(L, 6);
+	event->dx = luaL_checkinteger(L, 7);
+	event->dy = luaL_checkinteger(L, 8);
+	event->verb = luaL_checkinteger(L, 9);
+	event->damage = damage;
+
+	lua_pushboolean(L, hit);
+	lua_pushinteger(L, damage);
+	return 2;
+}
+
+/* log:death(map, id, x, y) - records the death of an actor at x, y on map
+   number 'map' */
+static int log_death(lua_State *L)
+{
+	CombatLog *log = check_log(L, 1);
+	CombatEvent *event = new_event(log);
+	event->kind = EVENT_DEATH;
+	event->flags = 0;
+	event->map = luaL_checkinteger(L, 2);
+	event->attacker = 0;
+	event->defender = luaL_checkinteger(L, 3);
+	event->dx = luaL_checkinteger(L, 4);
+	event->dy = luaL_checkinteger(L, 5);
+	event->ax = event->ay = event->verb = event->damage = 0;
+	return 0;
+}
+
+/* Returns true if a tile is true in the sight map at a stack index */
+static int sees(lua_State *L, int arg, int x, int y)
+{
+	lua_rawgeti(L, arg, x);
+	if (!lua_istable(L, -1))
+	{
+		lua_pop(L, 1);
+		return 0;
+	}
+	lua_rawgeti(L, -1, y);
+	int seen = lua_toboolean(L, -1);
+	lua_pop(L, 2);
+	return seen;
+}
+
+/* log:take(map, sightMap, playerId) - empties the log, returning the events
+   on map number 'map' which the player (with Actor._id 'playerId') can
+   tell happened, as a flat list {kind, attacker, defender, verb, damage,
+   flags, ...}. 'kind' is 1 for an attack and 2 for a death; 'flags' add up
+   1 if the attack hit, 2 if it was ranged, 4 if the attacker can be seen and
+   8 if the defender can be seen, going by the 2D grid 'sightMap'. Attacks
+   the player can't see any part of are left out, except ranged attacks on
+   someone who can be seen; deaths are always heard */
+static int log_take(lua_State *L)
+{
+	CombatLog *log = check_log(L, 1);
+	int map = luaL_checkinteger(L, 2);
+	luaL_checktype(L, 3, LUA_TTABLE);
+	int player = luaL_checkinteger(L, 4);
+	int i, num = 0;
+
+	lua_newtable(L);
+	for (i = 0; i < log->num; i++)
+	{
+		CombatEvent *event = &log->events[i];
+		if (event->map != map)
+			continue;
+		int flags = event->flags;
+		if (event->kind == EVENT_ATTACK &&
+		    (event->attacker == player || sees(L, 3, event->ax, event->ay)))
+			flags |= EVENT_ATTACKER_SEEN;
+		if (event->defender == player || sees(L, 3, event->dx, event->dy))
+			flags |= EVENT_DEFENDER_SEEN;
+		if (event->kind == EVENT_ATTACK && !(flags & EVENT_ATTACKER_SEEN) &&
+		    !((flags & EVENT_RANGED) && (flags & EVENT_DEFENDER_SEEN)))
+			continue;
+
+		int fields[6] = { event->kind, event->attacker, event->defender,
+				  event->verb, event->damage, flags }, f;
+		for (f = 0; f < 6; f++)
+		{
+			lua_pushinteger(L, fields[f]);
+			lua_rawseti(L, -2, ++num);
+		}
+	}
+	log->num = 0;
+	return 1;
+}
+
+/* log:pending() - returns the number of events not yet taken */
+static int log_pending(lua_State *L)
+{
+	lua_pushinteger(L, check_log(L, 1)->num);
+	return 1;
+}
+
+static luaL_Reg log_methods[] = {
+	{	"attack",		log_attack },
+	{	"death",		log_death },
+	{	"take",			log_take },
+	{	"pending",		log_pending },
+	{	NULL,			NULL }
+};
+
+/* Create the metatable used for CombatLog userdata */
+void CombatLog_init_metatable(lua_State *L)
+{
+	luaL_newmetatable(L, COMBAT_LOG_METATABLE);
+	lua_pushcfunction(L, log_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_newtable(L);
+	luaL_setfuncs(L, log_methods, 0);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+}
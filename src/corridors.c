@@ -0,0 +1,91 @@
+/* -*- c-basic-offset: 8 -*- */
+/* This file contains the corridor router used by map generation: it finds
+   where to dig the corridors linking rooms, with A* (see route_corridor())
+   over a field of dig costs given per tile type, so that corridors join up
+   with ones dug before, keep out of rooms, and don't turn needlessly. */
+
+#include <stdlib.h>
+#include "nush.h"
+
+
+/* clib.routeCorridors(layers, digCosts, links, floorId [, turnCost])
+   Routes a batch of corridors, in order. 'digCosts' maps Tile.ids to the
+   cost of digging a corridor through a tile of that type; tiles of types
+   not in it are never dug through. Each link is a list {x1, y1, x2, y2}.
+   The tiles along each corridor cost no more than tile type 'floorId' for
+   the corridors after it, so that later corridors can share them. Changing
+   direction costs 'turnCost' more (default 0).
+   Returns a list with, for each link, the tiles of its corridor (both ends
+   included) as a flat list {x, y, x, y, ...}; empty if there was no way. */
+/* Reads link i of the list at a stack index into ends {x1, y1, x2, y2},
+   raising an error if it's out of bounds */
+static void read_link(lua_State *L, int arg, int i, MapLayers *layers, int *ends)
+{
+	int j;
+	lua_rawgeti(L, arg, i);
+	luaL_checktype(L, -1, LUA_TTABLE);
+	for (j = 0; j < 4; j++)
+	{
+		lua_rawgeti(L, -1, j + 1);
+		ends[j] = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	if (ends[0] < 1 || ends[0] > layers->w || ends[1] < 1 || ends[1] > layers->h ||
+	    ends[2] < 1 || ends[2] > layers->w || ends[3] < 1 || ends[3] > layers->h)
+		luaL_error(L, "link %d is out of bounds", i);
+}
+
+int clib_routecorridors(lua_State *L)
+{
+	MapLayers *layers = MapLayers_check(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	luaL_checktype(L, 3, LUA_TTABLE);
+	int floor_id = luaL_checkinteger(L, 4);
+	disttype turn_cost = luaL_optnumber(L, 5, 0);
+	int w = layers->w, h = layers->h, i, j;
+
+	disttype tile_costs[MAX_TILE_TYPES];
+	for (i = 0; i < MAX_TILE_TYPES; i++)
+	{
+		lua_rawgeti(L, 2, i);
+		tile_costs[i] = lua_type(L, -1) == LUA_TNUMBER ? lua_tonumber(L, -1) : IMPASSABLE_COST;
+		lua_pop(L, 1);
+	}
+	if (floor_id < 1 || floor_id >= MAX_TILE_TYPES)
+		luaL_error(L, "tile id %d out of range", floor_id);
+
+	/* Check every link before anything is allocated, which would leak if
+	   an error were raised */
+	int ends[4], num = lua_rawlen(L, 3);
+	for (i = 0; i < num; i++)
+		read_link(L, 3, i + 1, layers, ends);
+
+	disttype *costs = malloc(sizeof(disttype) * w * h);
+	for (i = 0; i < w * h; i++)
+		costs[i] = tile_costs[layers->tile_ids[i]];
+	int *path = malloc(sizeof(int) * w * h * 4);
+
+	lua_createtable(L, num, 0);
+	for (i = 0; i < num; i++)
+	{
+		read_link(L, 3, i + 1, layers, ends);
+		int len = route_corridor(costs, w, h, ends[0], ends[1], ends[2], ends[3],
+					 turn_cost, path);
+		lua_createtable(L, len * 2, 0);
+		for (j = 0; j < len; j++)
+		{
+			lua_pushinteger(L, path[j] % w + 1);
+			lua_rawseti(L, -2, j * 2 + 1);
+			lua_pushinteger(L, path[j] / w + 1);
+			lua_rawseti(L, -2, j * 2 + 2);
+			if (costs[path[j]] > tile_costs[floor_id])
+				costs[path[j]] = tile_costs[floor_id];
+		}
+		lua_rawseti(L, -2, i + 1);
+	}
+
+	free(costs);
+	free(path);
+	return 1;
+}
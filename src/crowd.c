@@ -0,0 +1,301 @@
+/* -*- c-basic-offset: 8 -*- */
+/* This file contains the crowd move planner: given every moving actor's
+   preferred steps (from the Dijkstra maps they're following), decides where
+   each of them moves this turn in one go, so that actors queue up behind
+   each other, step aside, and swap places instead of bumping into each
+   other. */
+
+#include <stdlib.h>
+#include <string.h>
+#include "nush.h"
+
+enum { UNPLANNED, MOVING, STAYING, ATTACKING };
+
+typedef struct {
+	int x, y;
+	LuaMap *distmap;  /* shared between movers following the same map */
+	disttype maxcost;
+	int attack_id;    /* occupant the mover may bump into (attack), or 0 */
+	disttype dist;    /* distmap value at x,y */
+	int num_cands;
+	int cands[8];     /* neighbouring tile indices, best first */
+	disttype cand_dists[8];
+	int state;
+	int target;       /* tile index moved to or attacked */
+	int swap_with;    /* index of the mover swapped with, or -1 */
+} Mover;
+
+/* Order in which movers are planned: nearest to their goals first, so that
+   the ones in front get out of the way of the ones behind */
+static Mover *sort_movers;
+static int compare_movers(const void *a, const void *b)
+{
+	disttype da = sort_movers[*(const int *)a].dist;
+	disttype db = sort_movers[*(const int *)b].dist;
+	return (da > db) - (da < db);
+}
+
+/* Find the tiles a mover would like to step onto: those which don't take it
+   further from its goal, best first */
+static void find_candidates(Mover *m, MapLayers *layers, int rotate)
+{
+	static const int xoffs[8] = { -1, 0, 1, 1, 1, 0, -1, -1 };
+	static const int yoffs[8] = { -1, -1, -1, 0, 1, 1, 1, 0 };
+	int i, j;
+
+	m->num_cands = 0;
+	for (i = 0; i < 8; i++)
+	{
+		/* rotate the start direction so that ties don't always go the same
+		   way, making movers form lines */
+		int dir = (i + rotate) % 8;
+		int x = m->x + xoffs[dir], y = m->y + yoffs[dir];
+		if (x < 1 || x > layers->w || y < 1 || y > layers->h)
+			continue;
+		int idx = LAYERS_INDEX(layers, x, y);
+		disttype dist = LuaMap_read(m->distmap, x, y);
+
+		if (m->attack_id && layers->occupants[idx] == m->attack_id)
+			dist = -IMPASSABLE_COST;  /* always prefer attacking */
+		else if (dist >= m->maxcost || dist > m->dist)
+			continue;
+
+		/* insertion sort, stable */
+		for (j = m->num_cands; j > 0 && m->cand_dists[j - 1] > dist; j--)
+		{
+			m->cands[j] = m->cands[j - 1];
+			m->cand_dists[j] = m->cand_dists[j - 1];
+		}
+		m->cands[j] = idx;
+		m->cand_dists[j] = dist;
+		m->num_cands++;
+	}
+}
+
+/* Returns true if mover m would be happy to step onto tile idx */
+static int wants_tile(Mover *m, int idx)
+{
+	int i;
+	for (i = 0; i < m->num_cands; i++)
+	{
+		if (m->cands[i] == idx)
+			return 1;
+	}
+	return 0;
+}
+
+/* Try to plan a move for one mover. If 'patient', gives up (returning 0) on
+   reaching a candidate tile held by a mover which hasn't been planned yet,
+   rather than settling for a worse tile. Returns 1 if planned. */
+static int plan_mover(Mover *movers, int mi, MapLayers *layers, int *mover_at,
+		      unsigned char *claimed, int patient)
+{
+	Mover *m = &movers[mi];
+	int own_idx = LAYERS_INDEX(layers, m->x, m->y);
+	int i;
+
+	for (i = 0; i < m->num_cands; i++)
+	{
+		int idx = m->cands[i];
+		if (m->attack_id && layers->occupants[idx] == m->attack_id)
+		{
+			m->state = ATTACKING;
+			m->target = idx;
+			return 1;
+		}
+		if (claimed[idx])
+			continue;
+
+		int oi = mover_at[idx];
+		if (oi < 0)
+		{
+			/* someone who isn't moving */
+			if (layers->occupants[idx])
+				continue;
+		}
+		else
+		{
+			Mover *o = &movers[oi];
+			if (o->state == STAYING || o->state == ATTACKING)
+				continue;  /* look for a way around */
+			if (o->state == UNPLANNED)
+			{
+				/* swap with it if it wants to go where we are */
+				if (!claimed[own_idx] && wants_tile(o, own_idx))
+				{
+					o->state = MOVING;
+					o->target = own_idx;
+					o->swap_with = mi;
+					m->swap_with = oi;
+					claimed[own_idx] = 1;
+				}
+				else if (patient)
+					return 0;
+				else
+					continue;
+			}
+			/* else it's leaving, so follow it */
+		}
+
+		m->state = MOVING;
+		m->target = idx;
+		claimed[idx] = 1;
+		return 1;
+	}
+
+	if (patient)
+		return 0;
+	m->state = STAYING;
+	claimed[own_idx] = 1;
+	return 1;
+}
+
+/* clib.planMoves(layers, movers)
+   Plans one step for each of a list of actors on a map at once. Each mover
+   is a table with:
+     x, y         - its position; its Actor._id must be in the map's
+                    occupancy layer (layers:setOccupant())
+     distmap      - the Dijkstra map it's following (towards lower values);
+                    must have a .maxcost field. Actors following the same map
+                    should pass the same table
+     attack       - optional Actor._id of an actor it may step into (attack)
+   Tiles are never claimed by two movers; a mover may move onto a tile which
+   another mover is leaving, and two movers may swap places if they each
+   want the other's tile. Other actors are obstacles.
+   Returns a list with, for each mover, either false (it should wait) or a
+   table {x, y, attack = bool, swap = index of the mover to swap with}.
+   The moves aren't carried out; that's up to the caller. */
+int clib_planmoves(lua_State *L)
+{
+	MapLayers *layers = MapLayers_check(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	int num = lua_rawlen(L, 2);
+	int i;
+
+	/* Check every mover before anything is allocated, which would leak if
+	   an error were raised */
+	luaL_checkstack(L, num + 10, "planMoves");
+	for (i = 0; i < num; i++)
+	{
+		lua_rawgeti(L, 2, i + 1);
+		luaL_checktype(L, -1, LUA_TTABLE);
+		lua_getfield(L, -1, "x");
+		lua_getfield(L, -2, "y");
+		int x = lua_tointeger(L, -2), y = lua_tointeger(L, -1);
+		if (x < 1 || x > layers->w || y < 1 || y > layers->h)
+			luaL_error(L, "planMoves: mover %d at %d,%d is out of bounds", i + 1, x, y);
+		lua_getfield(L, -3, "distmap");
+		luaL_checktype(L, -1, LUA_TTABLE);
+		lua_pop(L, 4);
+	}
+
+	Mover *movers = calloc(num + 1, sizeof(Mover));
+	/* Distinct distmaps, each both on the stack and as a LuaMap */
+	LuaMap **distmaps = calloc(num + 1, sizeof(LuaMap *));
+	const void **distmap_ptrs = calloc(num + 1, sizeof(void *));
+	int num_distmaps = 0;
+	int *mover_at = malloc(sizeof(int) * layers->w * layers->h);
+	unsigned char *claimed = calloc(layers->w * layers->h, 1);
+	for (i = 0; i < layers->w * layers->h; i++)
+		mover_at[i] = -1;
+
+	for (i = 0; i < num; i++)
+	{
+		Mover *m = &movers[i];
+		lua_rawgeti(L, 2, i + 1);
+		lua_getfield(L, -1, "x");
+		lua_getfield(L, -2, "y");
+		lua_getfield(L, -3, "attack");
+		m->x = lua_tointeger(L, -3);
+		m->y = lua_tointeger(L, -2);
+		m->attack_id = lua_tointeger(L, -1);
+		lua_pop(L, 3);
+
+		lua_getfield(L, -1, "distmap");
+		const void *ptr = lua_topointer(L, -1);
+		int d;
+		for (d = 0; d < num_distmaps && distmap_ptrs[d] != ptr; d++)
+			;
+		lua_getfield(L, -1, "maxcost");
+		m->maxcost = lua_tonumber(L, -1);
+		lua_pop(L, 1);
+		if (d == num_distmaps)
+		{
+			/* Leave the table on the stack for the LuaMap to read */
+			lua_replace(L, -2);
+			distmap_ptrs[d] = ptr;
+			distmaps[d] = LuaMap_from_table(lua_gettop(L), 0, layers->w, layers->h, m->maxcost);
+			num_distmaps++;
+		}
+		else
+			lua_pop(L, 2);
+		m->distmap = distmaps[d];
+
+		m->dist = LuaMap_read(m->distmap, m->x, m->y);
+		m->swap_with = -1;
+		m->state = UNPLANNED;
+		mover_at[LAYERS_INDEX(layers, m->x, m->y)] = i;
+	}
+
+	for (i = 0; i < num; i++)
+		find_candidates(&movers[i], layers, i);
+
+	int *order = malloc(sizeof(int) * (num + 1));
+	for (i = 0; i < num; i++)
+		order[i] = i;
+	sort_movers = movers;
+	qsort(order, num, sizeof(int), compare_movers);
+
+	/* Plan patiently (waiting for whoever is in the way to be planned first)
+	   while that makes progress, then settle for whatever is left */
+	int progress = 1, patient = 1, remaining = num;
+	while (remaining)
+	{
+		progress = 0;
+		for (i = 0; i < num; i++)
+		{
+			Mover *m = &movers[order[i]];
+			if (m->state == UNPLANNED && plan_mover(movers, order[i], layers, mover_at, claimed, patient))
+				progress = 1;
+		}
+		remaining = 0;
+		for (i = 0; i < num; i++)
+			remaining += movers[i].state == UNPLANNED;
+		if (!progress)
+			patient = 0;
+	}
+
+	lua_createtable(L, num, 0);
+	for (i = 0; i < num; i++)
+	{
+		Mover *m = &movers[i];
+		if (m->state == STAYING)
+			lua_pushboolean(L, 0);
+		else
+		{
+			lua_createtable(L, 2, 2);
+			lua_pushinteger(L, m->target % layers->w + 1);
+			lua_rawseti(L, -2, 1);
+			lua_pushinteger(L, m->target / layers->w + 1);
+			lua_rawseti(L, -2, 2);
+			lua_pushboolean(L, m->state == ATTACKING);
+			lua_setfield(L, -2, "attack");
+			if (m->swap_with >= 0)
+			{
+				lua_pushinteger(L, m->swap_with + 1);
+				lua_setfield(L, -2, "swap");
+			}
+		}
+		lua_rawseti(L, -2, i + 1);
+	}
+
+	for (i = 0; i < num_distmaps; i++)
+		LuaMap_free(distmaps[i]);
+	free(distmaps);
+	free(distmap_ptrs);
+	free(movers);
+	free(order);
+	free(mover_at);
+	free(claimed);
+	return 1;
+}
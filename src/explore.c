@@ -0,0 +1,192 @@
+/* -*- c-basic-offset: 8 -*- */
+/* This file contains auto-explore and travel for the player: the way to the
+   nearest unexplored part of a map (the frontier: remembered tiles which can
+   be crossed, next to tiles never seen) or to a chosen tile, found with one
+   Dijkstra map over the tiles the player remembers, and the check made
+   before each step of following it. */
+
+#include <stdlib.h>
+#include "nush.h"
+
+
+/* Reads a 2D grid of Lua values at a stack index into a newly allocated
+   [w*h] grid which is 1 where the value is neither nil nor false */
+static unsigned char *read_known(lua_State *L, int arg, MapLayers *layers)
+{
+	int x, y;
+	luaL_checktype(L, arg, LUA_TTABLE);
+	/* Check the columns before allocating, so nothing leaks on an error */
+	for (x = 1; x <= layers->w; x++)
+	{
+		lua_rawgeti(L, arg, x);
+		if (!lua_istable(L, -1))
+			luaL_error(L, "column %d of the memory grid is missing", x);
+		lua_pop(L, 1);
+	}
+
+	unsigned char *known = malloc(layers->w * layers->h);
+	for (x = 1; x <= layers->w; x++)
+	{
+		lua_rawgeti(L, arg, x);
+		for (y = 1; y <= layers->h; y++)
+		{
+			lua_rawgeti(L, -1, y);
+			known[LAYERS_INDEX(layers, x, y)] = lua_toboolean(L, -1);
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+	}
+	return known;
+}
+
+/* Returns true if a tile has a neighbour which isn't known */
+static int on_frontier(MapLayers *layers, const unsigned char *known, int x, int y)
+{
+	int dx, dy;
+	for (dy = -1; dy <= 1; dy++)
+	{
+		for (dx = -1; dx <= 1; dx++)
+		{
+			if (x + dx < 1 || x + dx > layers->w || y + dy < 1 || y + dy > layers->h)
+				continue;
+			if (!known[LAYERS_INDEX(layers, x + dx, y + dy)])
+				return 1;
+		}
+	}
+	return 0;
+}
+
+/* clib.explorePath(layers, memory, profile, x, y [, tx, ty]) - returns the
+   way from x, y to the tile tx, ty or, without a target, to the nearest
+   tile on the frontier of the explored part of the map, as a flat list
+   {x, y, x, y, ...} of the tiles to step onto in turn. 'memory' is a 2D grid
+   which is nil or false on the tiles which have never been seen; the way
+   only crosses tiles which have been, which are costed by the cost profile
+   'profile' (actors in the way aren't taken into account). Returns nil if
+   there's nowhere to go or no known way there */
+int clib_explorepath(lua_State *L)
+{
+	MapLayers *layers = MapLayers_check(L, 1);
+	int profile = check_cost_profile(L, 3);
+	int x = luaL_checkinteger(L, 4);
+	int y = luaL_checkinteger(L, 5);
+	int travel = !lua_isnoneornil(L, 6);
+	int tx = luaL_optinteger(L, 6, 0);
+	int ty = luaL_optinteger(L, 7, 0);
+	int w = layers->w, h = layers->h, i, cx, cy, num_goals = 0;
+	if (x < 1 || x > w || y < 1 || y > h)
+		luaL_error(L, "position %d,%d is out of bounds", x, y);
+	if (travel && (tx < 1 || tx > w || ty < 1 || ty > h))
+		luaL_error(L, "target %d,%d is out of bounds", tx, ty);
+	unsigned char *known = read_known(L, 2, layers);
+
+	/* Tiles which have never been seen can't be crossed */
+	LuaMap *costmap = MapLayers_costmap(layers, profile);
+	for (i = 0; i < w * h; i++)
+	{
+		if (!known[i])
+			costmap->tiles[i] = IMPASSABLE_COST;
+	}
+
+	PathGoal *goals = malloc(sizeof(PathGoal) * (travel ? 1 : w * h));
+	if (travel)
+	{
+		goals[0].x = tx;
+		goals[0].y = ty;
+		goals[0].cost = 0;
+		num_goals = 1;
+	}
+	else
+	{
+		for (cy = 1; cy <= h; cy++)
+		{
+			for (cx = 1; cx <= w; cx++)
+			{
+				i = LAYERS_INDEX(layers, cx, cy);
+				if (costmap->tiles[i] < IMPASSABLE_COST && on_frontier(layers, known, cx, cy))
+				{
+					goals[num_goals].x = cx;
+					goals[num_goals].y = cy;
+					goals[num_goals++].cost = 0;
+				}
+			}
+		}
+	}
+	LuaMap *distmap = goal_list_dijkstra_map(costmap, goals, num_goals, IMPASSABLE_COST, NULL);
+
+	/* Walk downhill from x, y to a goal */
+	cx = x;
+	cy = y;
+	disttype dist = LuaMap_read(distmap, cx, cy);
+	if (dist >= IMPASSABLE_COST || dist == 0)
+		lua_pushnil(L);
+	else
+	{
+		int num = 0, dx, dy;
+		lua_newtable(L);
+		while (dist > 0)
+		{
+			int best_x = 0, best_y = 0;
+			disttype best = dist;
+			for (dy = -1; dy <= 1; dy++)
+			{
+				for (dx = -1; dx <= 1; dx++)
+				{
+					if (cx + dx < 1 || cx + dx > w || cy + dy < 1 || cy + dy > h)
+						continue;
+					disttype d = LuaMap_read(distmap, cx + dx, cy + dy);
+					if (d < best)
+					{
+						best = d;
+						best_x = cx + dx;
+						best_y = cy + dy;
+					}
+				}
+			}
+			if (!best_x)
+				break;
+			cx = best_x;
+			cy = best_y;
+			dist = best;
+			lua_pushinteger(L, cx);
+			lua_rawseti(L, -2, ++num);
+			lua_pushinteger(L, cy);
+			lua_rawseti(L, -2, ++num);
+		}
+	}
+
+	LuaMap_free(distmap);
+	LuaMap_free(costmap);
+	free(goals);
+	free(known);
+	return 1;
+}
+
+/* clib.travelInterrupted(layers, sightMap, id) - checked before each step
+   of travel or auto-explore by the actor with Actor._id 'id': returns the
+   Actor._id of another actor on a tile which is true in the 2D grid
+   'sightMap', or nil if none can be seen. Only occupied tiles are looked
+   up in the sight map */
+int clib_travelinterrupted(lua_State *L)
+{
+	MapLayers *layers = MapLayers_check(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	int id = luaL_checkinteger(L, 3);
+	int i, seen;
+	for (i = 0; i < layers->w * layers->h; i++)
+	{
+		if (!layers->occupants[i] || layers->occupants[i] == id)
+			continue;
+		lua_rawgeti(L, 2, i % layers->w + 1);
+		lua_rawgeti(L, -1, i / layers->w + 1);
+		seen = lua_toboolean(L, -1);
+		lua_pop(L, 2);
+		if (seen)
+		{
+			lua_pushinteger(L, layers->occupants[i]);
+			return 1;
+		}
+	}
+	lua_pushnil(L);
+	return 1;
+}
@@ -0,0 +1,307 @@
+/* -*- c-basic-offset: 8 -*- */
+/* This file contains grid kernels used by map generation: whole-map passes
+   over the tile ids of a MapLayers which count neighbours of a class of
+   tiles, grow or shrink areas of tiles (dilate, erode), spread tiles
+   randomly and flood fill. Classes of tiles are given as sets of Tile.ids
+   (see check_tile_set()). Passes change tiles with MapLayers_set_tile(), so
+   layers:saveTiles() must be used to copy the changes to the Lua tiles. */
+
+#include <stdlib.h>
+#include <string.h>
+#include "nush.h"
+
+
+/* Index of a tile in a mask, which has a border of one tile */
+#define MASK_INDEX(layers, x, y) ((x) + (y) * ((layers)->w + 2))
+
+/* Returns a newly allocated (w+2)*(h+2) grid which is 1 for tiles in a set
+   of tile ids and 0 elsewhere, including the border */
+static unsigned char *make_mask(MapLayers *layers, const unsigned char *set)
+{
+	unsigned char *mask = calloc((layers->w + 2) * (layers->h + 2), 1);
+	int x, y;
+	for (y = 1; y <= layers->h; y++)
+	{
+		for (x = 1; x <= layers->w; x++)
+			mask[MASK_INDEX(layers, x, y)] = set[layers->tile_ids[LAYERS_INDEX(layers, x, y)]];
+	}
+	return mask;
+}
+
+/* Fills counts (indexed like the layers) with the number of the 8
+   neighbours of each tile which are set in a mask. The inner loop has no
+   branches so that the compiler can vectorise it */
+static void count_neighbours(MapLayers *layers, const unsigned char *mask, unsigned char *counts)
+{
+	int w = layers->w, x, y;
+	for (y = 1; y <= layers->h; y++)
+	{
+		const unsigned char *up = mask + MASK_INDEX(layers, 0, y - 1);
+		const unsigned char *mid = mask + MASK_INDEX(layers, 0, y);
+		const unsigned char *down = mask + MASK_INDEX(layers, 0, y + 1);
+		unsigned char *out = counts + (y - 1) * w - 1;
+		for (x = 1; x <= w; x++)
+		{
+			out[x] = up[x - 1] + up[x] + up[x + 1] + mid[x - 1] + mid[x + 1]
+				+ down[x - 1] + down[x] + down[x + 1];
+		}
+	}
+}
+
+/* Random numbers for map generation (xorshift64*), seeded from Lua so that
+   maps are reproducible from the game's random seed */
+
+/* Returns the state for a seed, an integer from the argument at a stack
+   index (e.g. from math.random()) */
+RandomState check_random_seed(lua_State *L, int arg)
+{
+	return luaL_checkinteger(L, arg) * 2654435761ULL + 1;
+}
+
+/* Returns a random number 0 <= r < 1 */
+double random_double(RandomState *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return ((*state * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Returns a random integer lo <= i <= hi */
+int random_int(RandomState *state, int lo, int hi)
+{
+	return lo + (int)(random_double(state) * (hi - lo + 1));
+}
+
+/* Reads a table mapping Tile.ids to relative weights at a stack index into
+   ids and weights ([MAX_TILE_TYPES]); returns how many there are */
+int check_tile_weights(lua_State *L, int arg, int *ids, double *weights)
+{
+	int num = 0;
+	luaL_checktype(L, arg, LUA_TTABLE);
+	lua_pushnil(L);
+	while (lua_next(L, arg))
+	{
+		int id = lua_tointeger(L, -2);
+		if (id < 1 || id >= MAX_TILE_TYPES)
+			luaL_error(L, "tile id %d out of range", id);
+		ids[num] = id;
+		weights[num++] = lua_tonumber(L, -1);
+		lua_pop(L, 1);
+	}
+	return num;
+}
+
+/* Returns one of a list of tile ids, picked at random by their weights,
+   whose total is 'total' */
+int random_tile(RandomState *state, int num, const int *ids, const double *weights, double total)
+{
+	double pick = random_double(state) * total;
+	int i;
+	for (i = 0; i < num - 1 && pick >= weights[i]; i++)
+		pick -= weights[i];
+	return ids[i];
+}
+
+/* clib.countNeighbours(layers, ids) - returns a 2D grid of the number of
+   neighbours (out of 8) of each tile which are in the set 'ids' */
+int clib_countneighbours(lua_State *L)
+{
+	MapLayers *layers = MapLayers_check(L, 1);
+	unsigned char set[MAX_TILE_TYPES];
+	check_tile_set(L, 2, set);
+
+	unsigned char *mask = make_mask(layers, set);
+	unsigned char *counts = malloc(layers->w * layers->h);
+	count_neighbours(layers, mask, counts);
+
+	LuaMap *map = LuaMap_new(layers->w, layers->h, 0);
+	int i;
+	for (i = 0; i < layers->w * layers->h; i++)
+		map->tiles[i] = counts[i];
+	LuaMap_push(map);
+	LuaMap_free(map);
+	free(counts);
+	free(mask);
+	return 1;
+}
+
+/* clib.dilate(layers, ids, into, to [, min]) - grows areas of tiles: every
+   tile in the set 'into' (any tile if nil) with at least 'min' (default 1)
+   neighbours in the set 'ids' becomes tile type 'to'. All tiles change at
+   once, so tiles which change don't count as neighbours until the next
+   pass. Returns the number of tiles changed */
+int clib_dilate(lua_State *L)
+{
+	MapLayers *layers = MapLayers_check(L, 1);
+	unsigned char set[MAX_TILE_TYPES], into[MAX_TILE_TYPES];
+	check_tile_set(L, 2, set);
+	check_tile_set(L, 3, into);
+	int to = check_tile_id(L, 4);
+	int min = luaL_optinteger(L, 5, 1);
+
+	unsigned char *mask = make_mask(layers, set);
+	unsigned char *counts = malloc(layers->w * layers->h);
+	count_neighbours(layers, mask, counts);
+
+	int x, y, changed = 0;
+	for (y = 1; y <= layers->h; y++)
+	{
+		for (x = 1; x <= layers->w; x++)
+		{
+			int idx = LAYERS_INDEX(layers, x, y);
+			if (into[layers->tile_ids[idx]] && counts[idx] >= min && layers->tile_ids[idx] != to)
+			{
+				MapLayers_set_tile(layers, x, y, to);
+				changed++;
+			}
+		}
+	}
+	free(counts);
+	free(mask);
+	lua_pushinteger(L, changed);
+	return 1;
+}
+
+/* clib.erode(layers, ids, to [, min]) - shrinks areas of tiles: every tile
+   in the set 'ids' with fewer than 'min' (default 8) neighbours also in
+   'ids' becomes tile type 'to'; all at once, like clib.dilate(). Returns
+   the number of tiles changed */
+int clib_erode(lua_State *L)
+{
+	MapLayers *layers = MapLayers_check(L, 1);
+	unsigned char set[MAX_TILE_TYPES];
+	check_tile_set(L, 2, set);
+	int to = check_tile_id(L, 3);
+	int min = luaL_optinteger(L, 4, 8);
+
+	unsigned char *mask = make_mask(layers, set);
+	unsigned char *counts = malloc(layers->w * layers->h);
+	count_neighbours(layers, mask, counts);
+
+	int x, y, changed = 0;
+	for (y = 1; y <= layers->h; y++)
+	{
+		for (x = 1; x <= layers->w; x++)
+		{
+			int idx = LAYERS_INDEX(layers, x, y);
+			if (mask[MASK_INDEX(layers, x, y)] && counts[idx] < min && layers->tile_ids[idx] != to)
+			{
+				MapLayers_set_tile(layers, x, y, to);
+				changed++;
+			}
+		}
+	}
+	free(counts);
+	free(mask);
+	lua_pushinteger(L, changed);
+	return 1;
+}
+
+/* clib.spreadTiles(layers, ids, into, chance, to, seed) - spreads tiles
+   randomly: each tile in the set 'into' which is next to a tile in the set
+   'ids' changes, with probability 'chance', into tile type 'to', which is
+   either a Tile.id or a table mapping Tile.ids to their relative weights.
+   Tiles are visited column by column, and those which change into a tile in
+   'ids' spread further as the pass goes on. 'seed' is an integer (e.g. from
+   math.random()). Returns the number of tiles changed */
+int clib_spreadtiles(lua_State *L)
+{
+	MapLayers *layers = MapLayers_check(L, 1);
+	unsigned char set[MAX_TILE_TYPES], into[MAX_TILE_TYPES];
+	int i;
+	check_tile_set(L, 2, set);
+	check_tile_set(L, 3, into);
+	double chance = luaL_checknumber(L, 4);
+	RandomState state = check_random_seed(L, 6);
+
+	int num_to, to_ids[MAX_TILE_TYPES];
+	double to_weights[MAX_TILE_TYPES], total = 0;
+	if (lua_type(L, 5) == LUA_TTABLE)
+		num_to = check_tile_weights(L, 5, to_ids, to_weights);
+	else
+	{
+		to_ids[0] = check_tile_id(L, 5);
+		to_weights[0] = 1;
+		num_to = 1;
+	}
+	for (i = 0; i < num_to; i++)
+		total += to_weights[i];
+	if (num_to == 0 || total <= 0)
+		luaL_error(L, "nothing to spread");
+
+	unsigned char *mask = make_mask(layers, set);
+	int x, y, dx, dy, to, changed = 0;
+	for (x = 1; x <= layers->w; x++)
+	{
+		for (y = 1; y <= layers->h; y++)
+		{
+			int idx = LAYERS_INDEX(layers, x, y);
+			if (!into[layers->tile_ids[idx]])
+				continue;
+			int near = 0;
+			for (dy = -1; dy <= 1; dy++)
+			{
+				for (dx = -1; dx <= 1; dx++)
+					near += mask[MASK_INDEX(layers, x + dx, y + dy)];
+			}
+			near -= mask[MASK_INDEX(layers, x, y)];
+			if (!near || random_double(&state) >= chance)
+				continue;
+
+			to = random_tile(&state, num_to, to_ids, to_weights, total);
+			MapLayers_set_tile(layers, x, y, to);
+			mask[MASK_INDEX(layers, x, y)] = set[to];
+			changed++;
+		}
+	}
+	free(mask);
+	lua_pushinteger(L, changed);
+	return 1;
+}
+
+/* clib.floodFill(layers, x, y, ids, to) - changes the area of tiles in the
+   set 'ids' around x, y (connected orthogonally) into tile type 'to'.
+   Returns the number of tiles changed; 0 if x, y isn't in 'ids' */
+int clib_floodfill(lua_State *L)
+{
+	MapLayers *layers = MapLayers_check(L, 1);
+	int x = luaL_checkinteger(L, 2);
+	int y = luaL_checkinteger(L, 3);
+	unsigned char set[MAX_TILE_TYPES];
+	check_tile_set(L, 4, set);
+	int to = check_tile_id(L, 5);
+	if (x < 1 || x > layers->w || y < 1 || y > layers->h)
+		luaL_error(L, "position %d,%d is out of bounds", x, y);
+	if (set[to])
+		luaL_error(L, "can't flood fill with a tile which is being filled");
+
+	unsigned char *mask = make_mask(layers, set);
+	int *stack = malloc(sizeof(int) * layers->w * layers->h);
+	int num = 0, changed = 0;
+	if (mask[MASK_INDEX(layers, x, y)])
+	{
+		mask[MASK_INDEX(layers, x, y)] = 0;
+		stack[num++] = MASK_INDEX(layers, x, y);
+	}
+	while (num)
+	{
+		int m = stack[--num], i;
+		int neighbours[4] = { m - 1, m + 1, m - (layers->w + 2), m + (layers->w + 2) };
+		MapLayers_set_tile(layers, m % (layers->w + 2), m / (layers->w + 2), to);
+		changed++;
+		for (i = 0; i < 4; i++)
+		{
+			/* The border is never set, so this stays in bounds */
+			if (mask[neighbours[i]])
+			{
+				mask[neighbours[i]] = 0;
+				stack[num++] = neighbours[i];
+			}
+		}
+	}
+	free(stack);
+	free(mask);
+	lua_pushinteger(L, changed);
+	return 1;
+}
@@ -0,0 +1,168 @@
+/* -*- c-basic-offset: 8 -*- */
+/* This file contains the hazard layer of a map: fire, which spreads each
+   turn to flammable neighbouring tiles (fuel) and burns out, and the smoke
+   it gives off, which blocks sight (see MapLayers_opacity()) until it clears.
+   Fire tiles which weren't lit by spreading (e.g. placed when the map was
+   generated) burn forever. */
+
+#include <stdlib.h>
+#include <string.h>
+#include "nush.h"
+
+
+/* The rules of fire, see clib.defineFire() */
+static int fire_id = 0;
+static int burn_time, smoke_time;
+static float ignite_chance[MAX_TILE_TYPES];
+static unsigned char burns_to[MAX_TILE_TYPES];
+
+/* clib.defineFire(fireId, burnTime, smokeTime, fuels, burnsTo) - set the
+   rules of fire: 'fireId' is the Tile.id of fire; fire which spreads burns
+   for 'burnTime' turns; smoke lingers for 'smokeTime' turns after the fire
+   under it stops. 'fuels' maps the Tile.ids of flammable tiles to the chance
+   each turn of catching fire from each burning neighbour, and 'burnsTo'
+   maps them to the Tile.id of what is left when they have burnt (by
+   default, the same tile) */
+int clib_definefire(lua_State *L)
+{
+	int id = luaL_checkinteger(L, 1);
+	if (id < 1 || id >= MAX_TILE_TYPES)
+		luaL_error(L, "tile id %d out of range", id);
+	burn_time = luaL_checkinteger(L, 2);
+	smoke_time = luaL_checkinteger(L, 3);
+	if (burn_time < 1 || burn_time > 255 || smoke_time < 0 || smoke_time > 255)
+		luaL_error(L, "burn and smoke times must be 1-255 and 0-255 turns");
+	luaL_checktype(L, 4, LUA_TTABLE);
+	luaL_checktype(L, 5, LUA_TTABLE);
+
+	int i;
+	for (i = 0; i < MAX_TILE_TYPES; i++)
+	{
+		lua_rawgeti(L, 4, i);
+		ignite_chance[i] = lua_tonumber(L, -1);
+		lua_rawgeti(L, 5, i);
+		burns_to[i] = lua_isnil(L, -1) ? i : lua_tointeger(L, -1);
+		lua_pop(L, 2);
+	}
+	fire_id = id;
+	return 0;
+}
+
+/* Returns the hazard layer of a map, creating it (without hazards) if
+   needed */
+HazardLayer *MapLayers_hazards(MapLayers *layers)
+{
+	if (!layers->hazards)
+	{
+		int size = layers->w * layers->h;
+		HazardLayer *hazards = malloc(sizeof(HazardLayer));
+		hazards->burn = calloc(size, 1);
+		hazards->fuel = calloc(size, 1);
+		hazards->smoke = calloc(size, 1);
+		hazards->next_ids = malloc(size);
+		layers->hazards = hazards;
+	}
+	return layers->hazards;
+}
+
+void HazardLayer_free(HazardLayer *hazards)
+{
+	if (!hazards)
+		return;
+	free(hazards->burn);
+	free(hazards->fuel);
+	free(hazards->smoke);
+	free(hazards->next_ids);
+	free(hazards);
+}
+
+/* Returns true if there's smoke on a tile */
+int MapLayers_smoky(MapLayers *layers, int idx)
+{
+	return layers->hazards && layers->hazards->smoke[idx];
+}
+
+/* Advances fire and smoke by one turn, all tiles at once: fires which
+   spread burn down and may burn out, each fire may spread to each flammable
+   neighbour, and smoke clears. Changes the tiles, and fills 'changed' with
+   the indices of the tiles whose type or smoke changed; returns how many */
+int MapLayers_update_hazards(MapLayers *layers, RandomState *random, int *changed)
+{
+	int w = layers->w, h = layers->h, size = w * h;
+	int x, y, dx, dy, i, num_changed = 0;
+	unsigned char *ids = layers->tile_ids;
+	if (!fire_id)
+		return 0;
+
+	/* Nothing to do unless something is burning or smoking */
+	if (!layers->hazards)
+	{
+		for (i = 0; i < size && ids[i] != fire_id; i++)
+			;
+		if (i == size)
+			return 0;
+	}
+	HazardLayer *hz = MapLayers_hazards(layers);
+	unsigned char *next = hz->next_ids;
+	memcpy(next, ids, size);
+
+	for (y = 1; y <= h; y++)
+	{
+		for (x = 1; x <= w; x++)
+		{
+			int idx = LAYERS_INDEX(layers, x, y);
+			if (ids[idx] != fire_id)
+			{
+				/* unless it was lit earlier in this scan */
+				if (next[idx] != fire_id)
+					hz->burn[idx] = 0;
+				continue;
+			}
+
+			/* Burn down; fire which never had a timer burns forever */
+			if (hz->burn[idx] && !--hz->burn[idx])
+				next[idx] = burns_to[hz->fuel[idx]];
+
+			/* Spread */
+			for (dy = -1; dy <= 1; dy++)
+			{
+				for (dx = -1; dx <= 1; dx++)
+				{
+					if (x + dx < 1 || x + dx > w || y + dy < 1 || y + dy > h)
+						continue;
+					int n = LAYERS_INDEX(layers, x + dx, y + dy);
+					if (next[n] == fire_id || !ignite_chance[ids[n]])
+						continue;
+					if (random_double(random) < ignite_chance[ids[n]])
+					{
+						next[n] = fire_id;
+						hz->burn[n] = burn_time;
+						hz->fuel[n] = ids[n];
+					}
+				}
+			}
+		}
+	}
+
+	for (i = 0; i < size; i++)
+	{
+		int was_smoky = hz->smoke[i] != 0, id_changed = next[i] != ids[i];
+		if (id_changed)
+			MapLayers_set_tile(layers, i % w + 1, i / w + 1, next[i]);
+
+		int was_opaque = MapLayers_opaque(layers, i);
+		if (next[i] == fire_id)
+			hz->smoke[i] = smoke_time;
+		else if (hz->smoke[i])
+			hz->smoke[i]--;
+		if ((hz->smoke[i] != 0) != was_smoky)
+		{
+			if (MapLayers_opaque(layers, i) != was_opaque)
+				MapLayers_journal(layers, i, ids[i], was_opaque);
+		}
+		else if (!id_changed)
+			continue;
+		changed[num_changed++] = i;
+	}
+	return num_changed;
+}
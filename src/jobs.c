@@ -0,0 +1,209 @@
+/* -*- c-basic-offset: 8 -*- */
+/* This file contains a small pool of worker threads which runs batches of
+   independent jobs, e.g. Dijkstra maps which don't depend on each other.
+   Jobs must never touch the lua_State; everything they need has to be read
+   out of Lua on the main thread before the batch is submitted. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "nush.h"
+
+#ifndef NO_THREADS
+	#include <pthread.h>
+#endif
+
+/* Upper limit on the number of worker threads */
+#define MAX_WORKERS 8
+
+
+#ifdef NO_THREADS
+
+/* Without threads every job is run on the main thread when waited on */
+
+void JobBatch_submit(JobBatch *batch)
+{
+	batch->next = 0;
+	batch->finished = 0;
+}
+
+void JobBatch_wait(JobBatch *batch)
+{
+	while (batch->next < batch->num_jobs)
+	{
+		int idx = batch->next++;
+		batch->func(batch->args[idx]);
+		batch->finished++;
+	}
+}
+
+void JobBatch_cancel(JobBatch *batch)
+{
+	batch->num_jobs = batch->next;
+}
+
+int jobs_num_workers()
+{
+	return 0;
+}
+
+#else
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_available = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t batch_finished = PTHREAD_COND_INITIALIZER;
+
+/* Batches which still have jobs which haven't been handed out, oldest first */
+static JobBatch *queue_head = NULL;
+
+static pthread_t workers[MAX_WORKERS];
+static int num_workers = -1;  /* -1 until the pool has been started */
+
+
+/* Remove a batch from the queue once all its jobs have been handed out.
+   Must hold the lock. */
+static void unqueue(JobBatch *batch)
+{
+	JobBatch **link = &queue_head;
+	while (*link)
+	{
+		if (*link == batch)
+		{
+			*link = batch->queue_next;
+			batch->queue_next = NULL;
+			return;
+		}
+		link = &(*link)->queue_next;
+	}
+}
+
+/* Hand out the next job of a batch, returning its index, or -1 if they have
+   all been handed out. Must hold the lock. */
+static int take_job(JobBatch *batch)
+{
+	if (batch->next >= batch->num_jobs)
+		return -1;
+	int idx = batch->next++;
+	if (batch->next == batch->num_jobs)
+		unqueue(batch);
+	return idx;
+}
+
+/* Run one job of a batch (which has been taken with take_job()) and count
+   it as finished. Must hold the lock, which is released while running. */
+static void run_job(JobBatch *batch, int idx)
+{
+	pthread_mutex_unlock(&lock);
+	batch->func(batch->args[idx]);
+	pthread_mutex_lock(&lock);
+
+	if (++batch->finished == batch->num_jobs)
+		pthread_cond_broadcast(&batch_finished);
+}
+
+static void *worker_main(void *unused)
+{
+	(void)unused;
+	pthread_mutex_lock(&lock);
+	while (1)
+	{
+		while (!queue_head)
+			pthread_cond_wait(&work_available, &lock);
+
+		JobBatch *batch = queue_head;
+		run_job(batch, take_job(batch));
+	}
+	return NULL;
+}
+
+/* Start the worker threads, one fewer than the number of CPUs because the
+   main thread also runs jobs while it waits. Must hold the lock. */
+static void start_workers()
+{
+	int ncpus = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	num_workers = ncpus - 1;
+	if (num_workers > MAX_WORKERS)
+		num_workers = MAX_WORKERS;
+	if (num_workers < 1)
+		num_workers = 1;
+
+	int i;
+	for (i = 0; i < num_workers; i++)
+	{
+		if (pthread_create(&workers[i], NULL, worker_main, NULL))
+		{
+			log_printf("jobs: failed to create worker thread %d", i);
+			break;
+		}
+	}
+	num_workers = i;
+	log_printf("jobs: started %d worker threads", num_workers);
+}
+
+/* Queue all the jobs in a batch to be run by the workers. The batch (and the
+   args) must stay alive until JobBatch_wait() returns. */
+void JobBatch_submit(JobBatch *batch)
+{
+	pthread_mutex_lock(&lock);
+	if (num_workers < 0)
+		start_workers();
+
+	batch->next = 0;
+	batch->finished = 0;
+	batch->queue_next = NULL;
+	if (batch->num_jobs > 0)
+	{
+		JobBatch **link = &queue_head;
+		while (*link)
+			link = &(*link)->queue_next;
+		*link = batch;
+		pthread_cond_broadcast(&work_available);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/* Wait until every job in a submitted batch has finished. The calling thread
+   runs any jobs of the batch which no worker has picked up yet. */
+void JobBatch_wait(JobBatch *batch)
+{
+	pthread_mutex_lock(&lock);
+	int idx;
+	while ((idx = take_job(batch)) >= 0)
+		run_job(batch, idx);
+	while (batch->finished < batch->num_jobs)
+		pthread_cond_wait(&batch_finished, &lock);
+	pthread_mutex_unlock(&lock);
+}
+
+/* Stop handing out jobs of a submitted batch, and wait for the ones already
+   running to finish. Afterwards batch->num_jobs is the number of jobs which
+   were run; the rest never will be. */
+void JobBatch_cancel(JobBatch *batch)
+{
+	pthread_mutex_lock(&lock);
+	if (batch->next < batch->num_jobs)
+	{
+		unqueue(batch);
+		batch->num_jobs = batch->next;
+	}
+	while (batch->finished < batch->num_jobs)
+		pthread_cond_wait(&batch_finished, &lock);
+	pthread_mutex_unlock(&lock);
+}
+
+int jobs_num_workers()
+{
+	return num_workers < 0 ? 0 : num_workers;
+}
+
+#endif  /* NO_THREADS */
+
+/* Run every job in a batch and wait for them all to finish */
+void JobBatch_run(JobBatch *batch)
+{
+	JobBatch_submit(batch);
+	JobBatch_wait(batch);
+}
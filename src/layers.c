@@ -0,0 +1,1064 @@
+/* -*- c-basic-offset: 8 -*- */
+/* This file contains MapLayers, the native side of a Map: grids of plain
+   values mirroring the Lua Tiles and Actors which the C code can use without
+   reading Lua tables, including a cost layer for each cost profile, the
+   scent and hazard layers (see scent.c and hazards.c), and a summed-area
+   table used to place rooms during map generation. A journal of the changes
+   to tiles lets caches made from a map tell whether they are affected by
+   what has changed since. Also the registry of tile types and cost
+   profiles. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nush.h"
+
+#define LAYERS_METATABLE "nush.MapLayers"
+
+
+/****************************** Tile types **********************************/
+/* Each Tile type has an integer id (Tile.id) and a terrain type
+   (Tile.terrainType), which is what cost profiles give costs for */
+
+static char *terrain_names[MAX_TERRAIN_TYPES];
+static int num_terrains = 0;
+
+/* terrain type of each tile id */
+static unsigned char tile_terrain[MAX_TILE_TYPES];
+/* whether each tile id blocks sight */
+static unsigned char tile_opaque[MAX_TILE_TYPES];
+/* whether actors and items can be placed on each tile id when it's free */
+static unsigned char tile_placeable[MAX_TILE_TYPES];
+
+typedef struct {
+	char *name;
+	disttype cost[MAX_TERRAIN_TYPES];
+} CostProfile;
+
+static CostProfile profiles[MAX_COST_PROFILES];
+static int num_profiles = 0;
+
+/* Incremented whenever a tile type or cost profile is (re)defined, so
+   compiled cost layers know they are out of date */
+static int registry_version = 1;
+
+/* Returns the version of the tile types and cost profiles, which changes
+   whenever they do */
+int tile_registry_version(void)
+{
+	return registry_version;
+}
+
+/* Returns the id of a terrain type, adding it if it's new */
+static int terrain_id(lua_State *L, const char *name)
+{
+	int i;
+	for (i = 0; i < num_terrains; i++)
+	{
+		if (!strcmp(terrain_names[i], name))
+			return i;
+	}
+	if (num_terrains == MAX_TERRAIN_TYPES)
+		luaL_error(L, "too many terrain types");
+	terrain_names[num_terrains] = strdup(name);
+	return num_terrains++;
+}
+
+/* Returns the index of a cost profile, or -1 if there is none by that name */
+int cost_profile_index(const char *name)
+{
+	int i;
+	for (i = 0; i < num_profiles; i++)
+	{
+		if (!strcmp(profiles[i].name, name))
+			return i;
+	}
+	return -1;
+}
+
+/* Like cost_profile_index() but throws an error if it doesn't exist */
+int check_cost_profile(lua_State *L, int arg)
+{
+	const char *name = luaL_checkstring(L, arg);
+	int profile = cost_profile_index(name);
+	if (profile < 0)
+		luaL_error(L, "unknown cost profile '%s'", name);
+	return profile;
+}
+
+/* clib.defineTile(id, terrainType, opaque, placeable) - tell the C code
+   about a tile type; 'placeable' if it counts as empty space (see
+   layers:randomFreeTile()) when nobody is on it */
+int clib_definetile(lua_State *L)
+{
+	int id = luaL_checkinteger(L, 1);
+	const char *terrain = luaL_checkstring(L, 2);
+	if (id < 1 || id >= MAX_TILE_TYPES)
+		luaL_error(L, "tile id %d out of range", id);
+	tile_terrain[id] = terrain_id(L, terrain);
+	tile_opaque[id] = lua_toboolean(L, 3);
+	tile_placeable[id] = lua_toboolean(L, 4);
+	registry_version++;
+	return 0;
+}
+
+/* Checks that an integer argument is a valid Tile.id, returning it */
+int check_tile_id(lua_State *L, int arg)
+{
+	int id = luaL_checkinteger(L, arg);
+	if (id < 1 || id >= MAX_TILE_TYPES)
+		luaL_error(L, "tile id %d out of range", id);
+	return id;
+}
+
+/* Reads a set of tile types {[Tile.id] = true} at a stack index into a
+   [MAX_TILE_TYPES] array of flags; nil/none means every tile type */
+void check_tile_set(lua_State *L, int arg, unsigned char *set)
+{
+	int i;
+	if (lua_isnoneornil(L, arg))
+	{
+		memset(set, 1, MAX_TILE_TYPES);
+		return;
+	}
+	luaL_checktype(L, arg, LUA_TTABLE);
+	for (i = 0; i < MAX_TILE_TYPES; i++)
+	{
+		lua_rawgeti(L, arg, i);
+		set[i] = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
+}
+
+/* clib.defineCostProfile(name, costs) - define (or redefine) a cost profile.
+   'costs' maps terrain types to the cost of stepping onto a tile of that
+   type; terrain types which are missing or false are impassable. */
+int clib_definecostprofile(lua_State *L)
+{
+	const char *name = luaL_checkstring(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	int profile = cost_profile_index(name);
+	if (profile < 0)
+	{
+		if (num_profiles == MAX_COST_PROFILES)
+			luaL_error(L, "too many cost profiles");
+		profile = num_profiles++;
+		profiles[profile].name = strdup(name);
+	}
+
+	CostProfile *prof = &profiles[profile];
+	int i;
+	for (i = 0; i < MAX_TERRAIN_TYPES; i++)
+		prof->cost[i] = IMPASSABLE_COST;
+
+	lua_pushnil(L);
+	while (lua_next(L, 2))
+	{
+		/* key at -2, value at -1 */
+		if (lua_type(L, -2) == LUA_TSTRING && lua_type(L, -1) == LUA_TNUMBER)
+			prof->cost[terrain_id(L, lua_tostring(L, -2))] = lua_tonumber(L, -1);
+		lua_pop(L, 1);
+	}
+	registry_version++;
+	return 0;
+}
+
+
+/******************************** MapLayers *********************************/
+
+/* The MapLayers.id of the next MapLayers made */
+static long next_layers_id = 1;
+
+/* Returns the cost layer of a map for a cost profile, compiling it from the
+   tile ids if it hasn't been used before or the profile has changed */
+disttype *MapLayers_costs(MapLayers *layers, int profile)
+{
+	if (!layers->costs[profile])
+		layers->costs[profile] = malloc(sizeof(disttype) * layers->w * layers->h);
+	else if (layers->costs_version[profile] == registry_version)
+		return layers->costs[profile];
+
+	disttype *costs = layers->costs[profile], *terrain_cost = profiles[profile].cost;
+	int i;
+	for (i = 0; i < layers->w * layers->h; i++)
+		costs[i] = terrain_cost[tile_terrain[layers->tile_ids[i]]];
+	layers->costs_version[profile] = registry_version;
+	return costs;
+}
+
+/* Returns a LuaMap holding a copy of a cost layer, which can be handed to
+   a worker thread while the map keeps changing */
+LuaMap *MapLayers_costmap(MapLayers *layers, int profile)
+{
+	LuaMap *costmap = LuaMap_new(layers->w, layers->h, 0);
+	memcpy(costmap->tiles, MapLayers_costs(layers, profile),
+	       sizeof(disttype) * layers->w * layers->h);
+	return costmap;
+}
+
+/* Returns a newly allocated grid which is nonzero for tiles which block
+   sight: opaque tiles and smoke */
+unsigned char *MapLayers_opacity(MapLayers *layers)
+{
+	unsigned char *opacity = malloc(layers->w * layers->h);
+	int i;
+	for (i = 0; i < layers->w * layers->h; i++)
+		opacity[i] = MapLayers_opaque(layers, i);
+	return opacity;
+}
+
+/* Returns a LuaMap of Dijkstra map goals: 0 on every tile of a terrain type,
+   maxcost elsewhere */
+LuaMap *MapLayers_terrain_goals(lua_State *L, MapLayers *layers, const char *terrain, disttype maxcost)
+{
+	int terrain_type = terrain_id(L, terrain);
+	LuaMap *goals = LuaMap_new(layers->w, layers->h, maxcost);
+	int i;
+	for (i = 0; i < layers->w * layers->h; i++)
+	{
+		if (tile_terrain[layers->tile_ids[i]] == terrain_type)
+			goals->tiles[i] = 0;
+	}
+	return goals;
+}
+
+/* Adds or removes a tile from the free tile index, if it has become free
+   (placeable and unoccupied) or stopped being free. Removing swaps the last
+   free tile into the hole, so both are O(1) */
+static void update_free_tile(MapLayers *layers, int idx)
+{
+	int is_free = tile_placeable[layers->tile_ids[idx]] && !layers->occupants[idx];
+	int pos = layers->free_pos[idx];
+	if (is_free && pos < 0)
+	{
+		layers->free_pos[idx] = layers->num_free;
+		layers->free_tiles[layers->num_free++] = idx;
+	}
+	else if (!is_free && pos >= 0)
+	{
+		int last = layers->free_tiles[--layers->num_free];
+		layers->free_tiles[pos] = last;
+		layers->free_pos[last] = pos;
+		layers->free_pos[idx] = -1;
+	}
+}
+
+/* Rebuilds the free tile index from scratch */
+static void rebuild_free_tiles(MapLayers *layers)
+{
+	int i;
+	layers->num_free = 0;
+	for (i = 0; i < layers->w * layers->h; i++)
+	{
+		layers->free_pos[i] = -1;
+		update_free_tile(layers, i);
+	}
+}
+
+/* Must be called after writing to tile_ids directly: brings everything
+   compiled from the tile ids up to date */
+void MapLayers_tiles_changed(MapLayers *layers)
+{
+	int i;
+	/* Recompile cost layers when next used */
+	for (i = 0; i < MAX_COST_PROFILES; i++)
+		layers->costs_version[i] = 0;
+	layers->filled_sum_valid = 0;
+	rebuild_free_tiles(layers);
+	layers->reset_epoch = ++layers->epoch;
+}
+
+/* Returns true if a tile blocks sight: an opaque tile, or smoke */
+int MapLayers_opaque(MapLayers *layers, int idx)
+{
+	return tile_opaque[layers->tile_ids[idx]] || MapLayers_smoky(layers, idx);
+}
+
+/* Adds a change of one tile, from what it was before, to the journal */
+void MapLayers_journal(MapLayers *layers, int idx, int old_id, int old_opaque)
+{
+	TileChange *change = &layers->journal[layers->epoch++ % JOURNAL_SIZE];
+	change->idx = idx;
+	change->old_id = old_id;
+	change->new_id = layers->tile_ids[idx];
+	change->old_opaque = old_opaque;
+	change->new_opaque = MapLayers_opaque(layers, idx);
+}
+
+/* Returns how many changes have been made since an epoch, or -1 if the
+   journal can't tell, because everything changed since or the changes have
+   been forgotten */
+static int changes_since(MapLayers *layers, long epoch)
+{
+	if (epoch < layers->reset_epoch || epoch > layers->epoch ||
+	    layers->epoch - epoch > JOURNAL_SIZE)
+		return -1;
+	return layers->epoch - epoch;
+}
+
+/* Returns the nth change made since an epoch */
+static TileChange *change_since(MapLayers *layers, long epoch, int n)
+{
+	return &layers->journal[(epoch + n) % JOURNAL_SIZE];
+}
+
+/* Changes the type of one tile, keeping compiled cost layers and the free
+   tile index up to date */
+void MapLayers_set_tile(MapLayers *layers, int x, int y, int id)
+{
+	int idx = LAYERS_INDEX(layers, x, y);
+	int old_id = layers->tile_ids[idx], old_opaque = MapLayers_opaque(layers, idx);
+	layers->tile_ids[idx] = id;
+	if (id != old_id)
+		MapLayers_journal(layers, idx, old_id, old_opaque);
+	layers->filled_sum_valid = 0;
+	update_free_tile(layers, idx);
+
+	int terrain = tile_terrain[id], profile;
+	for (profile = 0; profile < num_profiles; profile++)
+	{
+		if (layers->costs[profile] && layers->costs_version[profile] == registry_version)
+			layers->costs[profile][idx] = profiles[profile].cost[terrain];
+	}
+}
+
+/* Returns the summed-area table of non-blank tiles, (re)building it if a
+   tile has changed since it was last used */
+static int *MapLayers_filled_sum(MapLayers *layers)
+{
+	int w = layers->w, x, y;
+	if (!layers->filled_sum)
+		layers->filled_sum = calloc((w + 1) * (layers->h + 1), sizeof(int));
+	else if (layers->filled_sum_valid)
+		return layers->filled_sum;
+
+	int *sum = layers->filled_sum;
+	for (y = 1; y <= layers->h; y++)
+	{
+		int row = 0;
+		for (x = 1; x <= w; x++)
+		{
+			row += layers->tile_ids[LAYERS_INDEX(layers, x, y)] != layers->blank_id;
+			sum[x + y * (w + 1)] = sum[x + (y - 1) * (w + 1)] + row;
+		}
+	}
+	layers->filled_sum_valid = 1;
+	return sum;
+}
+
+/* Returns the number of non-blank tiles in a rectangle, which must be in
+   bounds, in O(1) time */
+int MapLayers_count_filled(MapLayers *layers, int x, int y, int w, int h)
+{
+	int *sum = MapLayers_filled_sum(layers), stride = layers->w + 1;
+	int x1 = x - 1, y1 = y - 1, x2 = x + w - 1, y2 = y + h - 1;
+	return sum[x2 + y2 * stride] - sum[x1 + y2 * stride]
+		- sum[x2 + y1 * stride] + sum[x1 + y1 * stride];
+}
+
+MapLayers *MapLayers_check(lua_State *L, int arg)
+{
+	return luaL_checkudata(L, arg, LAYERS_METATABLE);
+}
+
+/* Returns true if the value at a stack index is a MapLayers */
+int MapLayers_is(lua_State *L, int index)
+{
+	if (lua_type(L, index) != LUA_TUSERDATA || !lua_getmetatable(L, index))
+		return 0;
+	luaL_getmetatable(L, LAYERS_METATABLE);
+	int ret = lua_rawequal(L, -1, -2);
+	lua_pop(L, 2);
+	return ret;
+}
+
+/* Checks that x,y arguments at arg and arg+1 are in bounds */
+static void check_xy(lua_State *L, MapLayers *layers, int arg, int *x, int *y)
+{
+	*x = luaL_checkinteger(L, arg);
+	*y = luaL_checkinteger(L, arg + 1);
+	if (*x < 1 || *x > layers->w || *y < 1 || *y > layers->h)
+		luaL_error(L, "position %d,%d is out of bounds", *x, *y);
+}
+
+/* clib.newMapLayers(w, h, id) - create the native layers of a map, with
+   every tile set to tile type 'id' */
+int clib_newmaplayers(lua_State *L)
+{
+	int w = luaL_checkinteger(L, 1);
+	int h = luaL_checkinteger(L, 2);
+	int id = luaL_checkinteger(L, 3);
+	if (w < 1 || h < 1 || w > 65535 || h > 65535)
+		luaL_error(L, "bad map size %dx%d", w, h);
+
+	MapLayers *layers = lua_newuserdata(L, sizeof(MapLayers));
+	memset(layers, 0, sizeof(MapLayers));
+	layers->id = next_layers_id++;
+	layers->w = w;
+	layers->h = h;
+	layers->blank_id = id;
+	layers->tile_ids = malloc(w * h);
+	memset(layers->tile_ids, id, w * h);
+	layers->occupants = calloc(w * h, sizeof(int));
+	layers->free_tiles = malloc(sizeof(int) * w * h);
+	layers->free_pos = malloc(sizeof(int) * w * h);
+	rebuild_free_tiles(layers);
+	layers->journal = malloc(sizeof(TileChange) * JOURNAL_SIZE);
+
+	luaL_getmetatable(L, LAYERS_METATABLE);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+/* Returns a newly allocated copy of an array, or NULL */
+static void *copy_array(const void *array, size_t size)
+{
+	if (!array)
+		return NULL;
+	void *copy = malloc(size);
+	memcpy(copy, array, size);
+	return copy;
+}
+
+/* Makes 'to' an independent copy of a MapLayers: the tiles, occupants,
+   free tile index, scent and hazards. The copy gets its own id, so caches
+   keyed by the id don't mix them up, and keeps the epoch, but its journal
+   starts empty; cost layers are compiled again when used */
+static void copy_layers(MapLayers *to, const MapLayers *from)
+{
+	int size = from->w * from->h;
+	memset(to, 0, sizeof(MapLayers));
+	to->id = next_layers_id++;
+	to->w = from->w;
+	to->h = from->h;
+	to->blank_id = from->blank_id;
+	to->tile_ids = copy_array(from->tile_ids, size);
+	to->occupants = copy_array(from->occupants, sizeof(int) * size);
+	to->free_tiles = copy_array(from->free_tiles, sizeof(int) * size);
+	to->free_pos = copy_array(from->free_pos, sizeof(int) * size);
+	to->num_free = from->num_free;
+	to->journal = malloc(sizeof(TileChange) * JOURNAL_SIZE);
+	to->epoch = to->reset_epoch = from->epoch;
+
+	if (from->scent)
+	{
+		int scent_size = (from->w + 2) * (from->h + 2);
+		memcpy(MapLayers_scent(to)->cur, from->scent->cur, sizeof(float) * scent_size);
+	}
+	if (from->hazards)
+	{
+		HazardLayer *hazards = MapLayers_hazards(to);
+		memcpy(hazards->burn, from->hazards->burn, size);
+		memcpy(hazards->fuel, from->hazards->fuel, size);
+		memcpy(hazards->smoke, from->hazards->smoke, size);
+	}
+}
+
+/* Frees what a MapLayers holds (but not the MapLayers itself) */
+static void release_layers(MapLayers *layers)
+{
+	int i;
+	for (i = 0; i < MAX_COST_PROFILES; i++)
+		free(layers->costs[i]);
+	free(layers->tile_ids);
+	free(layers->occupants);
+	free(layers->free_tiles);
+	free(layers->free_pos);
+	free(layers->filled_sum);
+	free(layers->journal);
+	ScentLayer_free(layers->scent);
+	HazardLayer_free(layers->hazards);
+}
+
+/* Returns a newly allocated copy of a MapLayers, not owned by Lua; free it
+   with MapLayers_free() */
+MapLayers *MapLayers_clone(const MapLayers *from)
+{
+	MapLayers *layers = malloc(sizeof(MapLayers));
+	copy_layers(layers, from);
+	return layers;
+}
+
+/* Pushes a copy of a MapLayers as a new userdata */
+void MapLayers_push_clone(lua_State *L, const MapLayers *from)
+{
+	MapLayers *layers = lua_newuserdata(L, sizeof(MapLayers));
+	copy_layers(layers, from);
+	luaL_getmetatable(L, LAYERS_METATABLE);
+	lua_setmetatable(L, -2);
+}
+
+/* Frees a MapLayers made by MapLayers_clone() */
+void MapLayers_free(MapLayers *layers)
+{
+	release_layers(layers);
+	free(layers);
+}
+
+static int layers_gc(lua_State *L)
+{
+	release_layers(MapLayers_check(L, 1));
+	return 0;
+}
+
+/* layers:setTile(x, y, id) - change the type of one tile */
+static int layers_settile(lua_State *L)
+{
+	MapLayers *layers = MapLayers_check(L, 1);
+	int x, y;
+	check_xy(L, layers, 2, &x, &y);
+	MapLayers_set_tile(layers, x, y, check_tile_id(L, 4));
+	return 0;
+}
+
+/* layers:loadTiles(tilemap) - set every tile from a 2D grid of Tiles, using
+   their .id */
+static int layers_loadtiles(lua_State *L)
+{
+	MapLayers *layers = MapLayers_check(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	/* Check every id first, so nothing is written if one is bad */
+	int x, y, pass;
+	for (pass = 0; pass < 2; pass++)
+	{
+		for (x = 1; x <= layers->w; x++)
+		{
+			lua_rawgeti(L, 2, x);
+			luaL_checktype(L, -1, LUA_TTABLE);
+			for (y = 1; y <= layers->h; y++)
+			{
+				lua_rawgeti(L, -1, y);
+				luaL_checktype(L, -1, LUA_TTABLE);
+				lua_getfield(L, -1, "id");
+				int id = lua_tointeger(L, -1);
+				if (id < 1 || id >= MAX_TILE_TYPES)
+					luaL_error(L, "tile at %d,%d has id %d, out of range", x, y, id);
+				if (pass)
+					layers->tile_ids[LAYERS_INDEX(layers, x, y)] = id;
+				lua_pop(L, 2);
+			}
+			lua_pop(L, 1);
+		}
+	}
+	MapLayers_tiles_changed(layers);
+	return 0;
+}
+
+/* layers:saveTiles(tilemap, tilesById) - the reverse of loadTiles(): set
+   each tile of a 2D grid of Tiles whose .id isn't the id in the layers to
+   tilesById[id] (e.g. Tile.byId), for copying back changes made by the
+   grid kernels (see grid.c). Returns the number of tiles set */
+static int layers_savetiles(lua_State *L)
+{
+	MapLayers *layers = MapLayers_check(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	luaL_checktype(L, 3, LUA_TTABLE);
+
+	int x, y, changed = 0;
+	for (x = 1; x <= layers->w; x++)
+	{
+		lua_rawgeti(L, 2, x);
+		luaL_checktype(L, -1, LUA_TTABLE);
+		for (y = 1; y <= layers->h; y++)
+		{
+			int id = layers->tile_ids[LAYERS_INDEX(layers, x, y)];
+			lua_rawgeti(L, -1, y);
+			lua_getfield(L, -1, "id");
+			if (lua_tointeger(L, -1) != id)
+			{
+				lua_rawgeti(L, 3, id);
+				lua_rawseti(L, -4, y);
+				changed++;
+			}
+			lua_pop(L, 2);
+		}
+		lua_pop(L, 1);
+	}
+	lua_pushinteger(L, changed);
+	return 1;
+}
+
+/* layers:tileId(x, y) - returns the type of a tile */
+static int layers_tileid(lua_State *L)
+{
+	MapLayers *layers = MapLayers_check(L, 1);
+	int x, y;
+	check_xy(L, layers, 2, &x, &y);
+	lua_pushinteger(L, layers->tile_ids[LAYERS_INDEX(layers, x, y)]);
+	return 1;
+}
+
+/* layers:cost(profile, x, y) - returns the cost of stepping onto a tile for
+   a cost profile; IMPASSABLE_COST if impassable */
+static int layers_cost(lua_State *L)
+{
+	MapLayers *layers = MapLayers_check(L, 1);
+	int profile = check_cost_profile(L, 2);
+	int x, y;
+	check_xy(L, layers, 3, &x, &y);
+	lua_pushnumber(L, MapLayers_costs(layers, profile)[LAYERS_INDEX(layers, x, y)]);
+	return 1;
+}
+
+/* layers:setOccupant(x, y, id) - record which actor (by Actor._id) is on a
+   tile; 0 for none */
+static int layers_setoccupant(lua_State *L)
+{
+	MapLayers *layers = MapLayers_check(L, 1);
+	int x, y;
+	check_xy(L, layers, 2, &x, &y);
+	int idx = LAYERS_INDEX(layers, x, y);
+	layers->occupants[idx] = luaL_checkinteger(L, 4);
+	update_free_tile(layers, idx);
+	return 0;
+}
+
+/* layers:occupant(x, y) - returns the Actor._id of the actor on a tile, or 0
+   if none or out of bounds */
+static int layers_occupant(lua_State *L)
+{
+	MapLayers *layers = MapLayers_check(L, 1);
+	int x = luaL_checkinteger(L, 2);
+	int y = luaL_checkinteger(L, 3);
+	if (x < 1 || x > layers->w || y < 1 || y > layers->h)
+		lua_pushinteger(L, 0);
+	else
+		lua_pushinteger(L, layers->occupants[LAYERS_INDEX(layers, x, y)]);
+	return 1;
+}
+
+/* layers:isFree(x, y) - returns true if a tile is free: placeable (see
+   clib.defineTile()) and without an occupant */
+static int layers_isfree(lua_State *L)
+{
+	MapLayers *layers = MapLayers_check(L, 1);
+	int x, y;
+	check_xy(L, layers, 2, &x, &y);
+	lua_pushboolean(L, layers->free_pos[LAYERS_INDEX(layers, x, y)] >= 0);
+	return 1;
+}
+
+/* layers:numFree() - returns the number of free tiles */
+static int layers_numfree(lua_State *L)
+{
+	MapLayers *layers = MapLayers_check(L, 1);
+	lua_pushinteger(L, layers->num_free);
+	return 1;
+}
+
+/* layers:randomFreeTile(r [, ids]) - picks a free tile using a random
+   number 0 <= r < 1 (e.g. from math.random()), so that each is equally
+   likely; in O(1) time unless 'ids' is given, a set {[Tile.id] = true} of
+   the only types of tile to choose from. Returns x, y, or nothing if there
+   are no (matching) free tiles */
+static int layers_randomfreetile(lua_State *L)
+{
+	MapLayers *layers = MapLayers_check(L, 1);
+	double r = luaL_checknumber(L, 2);
+	int i, num = layers->num_free, idx = -1;
+	unsigned char wanted[MAX_TILE_TYPES];
+
+	if (lua_type(L, 3) == LUA_TTABLE)
+	{
+		check_tile_set(L, 3, wanted);
+		num = 0;
+		for (i = 0; i < layers->num_free; i++)
+			num += wanted[layers->tile_ids[layers->free_tiles[i]]];
+	}
+	if (num == 0)
+		return 0;
+
+	int pick = r * num;
+	if (pick < 0 || pick >= num)
+		pick = num - 1;
+	if (num == layers->num_free)
+		idx = layers->free_tiles[pick];
+	else
+	{
+		for (i = 0; idx < 0; i++)
+		{
+			if (wanted[layers->tile_ids[layers->free_tiles[i]]] && pick-- == 0)
+				idx = layers->free_tiles[i];
+		}
+	}
+	lua_pushinteger(L, idx % layers->w + 1);
+	lua_pushinteger(L, idx / layers->w + 1);
+	return 2;
+}
+
+/* Returns true if a tile is labelled 1 in a 2D grid of region labels at a
+   stack index, or if there is no grid there */
+static int in_main_region(lua_State *L, int arg, int idx, int w)
+{
+	if (lua_isnoneornil(L, arg))
+		return 1;
+	lua_rawgeti(L, arg, idx % w + 1);
+	lua_rawgeti(L, -1, idx / w + 1);
+	int ret = lua_tointeger(L, -1) == 1;
+	lua_pop(L, 2);
+	return ret;
+}
+
+/* Returns true if a free tile of one MapLayers is also free in another of
+   the same size, and in the main region of both */
+static int shared_free_tile(lua_State *L, MapLayers *other, int idx, int w)
+{
+	return other->free_pos[idx] >= 0 && in_main_region(L, 3, idx, w) &&
+		in_main_region(L, 5, idx, w);
+}
+
+/* layers:randomSharedFreeTile(r, labels, other, otherLabels) - picks a tile
+   which is free both in these layers and in the MapLayers 'other' (of the
+   same size), using a random number 0 <= r < 1 so that each is equally
+   likely. 'labels' and 'otherLabels' are the region labels of each map (see
+   clib.findRegions()), and the tile has to be in region 1 of both; either
+   may be nil to allow any region. Only the free tiles of these layers are
+   looked at. Returns x, y, or nothing if there is no such tile */
+static int layers_randomsharedfreetile(lua_State *L)
+{
+	MapLayers *layers = MapLayers_check(L, 1);
+	double r = luaL_checknumber(L, 2);
+	MapLayers *other = MapLayers_check(L, 4);
+	if (!lua_isnoneornil(L, 3))
+		luaL_checktype(L, 3, LUA_TTABLE);
+	if (!lua_isnoneornil(L, 5))
+		luaL_checktype(L, 5, LUA_TTABLE);
+	if (other->w != layers->w || other->h != layers->h)
+		luaL_error(L, "layers of different sizes");
+	int i, num = 0, idx = -1, w = layers->w;
+
+	for (i = 0; i < layers->num_free; i++)
+		num += shared_free_tile(L, other, layers->free_tiles[i], w);
+	if (num == 0)
+		return 0;
+
+	int pick = r * num;
+	if (pick < 0 || pick >= num)
+		pick = num - 1;
+	for (i = 0; idx < 0; i++)
+	{
+		if (shared_free_tile(L, other, layers->free_tiles[i], w) && pick-- == 0)
+			idx = layers->free_tiles[i];
+	}
+	lua_pushinteger(L, idx % w + 1);
+	lua_pushinteger(L, idx / w + 1);
+	return 2;
+}
+
+/* layers:isAreaBlank(x, y, w, h) - returns true if every tile of a
+   rectangle is blank (still the tile type given to clib.newMapLayers()),
+   in O(1) time; false if it's not entirely in bounds */
+static int layers_isareablank(lua_State *L)
+{
+	MapLayers *layers = MapLayers_check(L, 1);
+	int x = luaL_checkinteger(L, 2);
+	int y = luaL_checkinteger(L, 3);
+	int w = luaL_checkinteger(L, 4);
+	int h = luaL_checkinteger(L, 5);
+	if (x < 1 || y < 1 || w < 1 || h < 1 || x + w - 1 > layers->w || y + h - 1 > layers->h)
+		lua_pushboolean(L, 0);
+	else
+		lua_pushboolean(L, MapLayers_count_filled(layers, x, y, w, h) == 0);
+	return 1;
+}
+
+/* layers:sampleBlankAreas(w, h, rs [, step]) - finds where a w*h rectangle
+   of blank tiles (see isAreaBlank()) would fit, at x and y which are 1
+   modulo 'step' (default 1), and picks one of those places for each random
+   number 0 <= r < 1 in the list 'rs' (each place being equally likely).
+   Returns a list of {x = x, y = y}, empty if the rectangle fits nowhere */
+static int layers_sampleblankareas(lua_State *L)
+{
+	MapLayers *layers = MapLayers_check(L, 1);
+	int w = luaL_checkinteger(L, 2);
+	int h = luaL_checkinteger(L, 3);
+	luaL_checktype(L, 4, LUA_TTABLE);
+	int step = lua_isnoneornil(L, 5) ? 1 : luaL_checkinteger(L, 5);
+	if (w < 1 || h < 1 || step < 1)
+		luaL_error(L, "bad area %dx%d, step %d", w, h, step);
+
+	int num_rs = lua_rawlen(L, 4), num = 0, x, y, i;
+	int *places = malloc(sizeof(int) * layers->w * layers->h);
+	for (y = 1; y + h - 1 <= layers->h; y += step)
+	{
+		for (x = 1; x + w - 1 <= layers->w; x += step)
+		{
+			if (!MapLayers_count_filled(layers, x, y, w, h))
+				places[num++] = LAYERS_INDEX(layers, x, y);
+		}
+	}
+
+	lua_createtable(L, num ? num_rs : 0, 0);
+	for (i = 0; num && i < num_rs; i++)
+	{
+		lua_rawgeti(L, 4, i + 1);
+		int pick = lua_tonumber(L, -1) * num;
+		lua_pop(L, 1);
+		if (pick < 0 || pick >= num)
+			pick = num - 1;
+		lua_createtable(L, 0, 2);
+		lua_pushinteger(L, places[pick] % layers->w + 1);
+		lua_setfield(L, -2, "x");
+		lua_pushinteger(L, places[pick] / layers->w + 1);
+		lua_setfield(L, -2, "y");
+		lua_rawseti(L, -2, i + 1);
+	}
+	free(places);
+	return 1;
+}
+
+/* layers:addScent(x, y, amount) - leave scent on a tile */
+static int layers_addscent(lua_State *L)
+{
+	MapLayers *layers = MapLayers_check(L, 1);
+	int x, y;
+	check_xy(L, layers, 2, &x, &y);
+	MapLayers_add_scent(layers, x, y, luaL_checknumber(L, 4));
+	return 0;
+}
+
+/* layers:updateScent(profile, decay, rate) - advance the scent by one turn:
+   all scent is multiplied by 'decay', and each tile swaps a fraction 'rate'
+   of its scent with its neighbours; tiles which are impassable for the cost
+   profile are barriers */
+static int layers_updatescent(lua_State *L)
+{
+	MapLayers *layers = MapLayers_check(L, 1);
+	int profile = check_cost_profile(L, 2);
+	MapLayers_update_scent(layers, profile, luaL_checknumber(L, 3), luaL_checknumber(L, 4));
+	return 0;
+}
+
+/* layers:scent(x, y) - returns the amount of scent on a tile */
+static int layers_scent(lua_State *L)
+{
+	MapLayers *layers = MapLayers_check(L, 1);
+	int x, y;
+	check_xy(L, layers, 2, &x, &y);
+	lua_pushnumber(L, MapLayers_get_scent(layers, x, y));
+	return 1;
+}
+
+/* layers:scentMap(threshold, maxcost) - returns the scent as a 2D grid which
+   can be followed like a Dijkstra map (towards lower values): -scent on
+   tiles with at least 'threshold' scent, otherwise maxcost (which is stored
+   in .maxcost) */
+static int layers_scentmap(lua_State *L)
+{
+	MapLayers *layers = MapLayers_check(L, 1);
+	float threshold = luaL_checknumber(L, 2);
+	disttype maxcost = luaL_checknumber(L, 3);
+
+	LuaMap *map = LuaMap_new(layers->w, layers->h, maxcost);
+	int x, y;
+	for (y = 1; y <= layers->h; y++)
+	{
+		for (x = 1; x <= layers->w; x++)
+		{
+			float scent = MapLayers_get_scent(layers, x, y);
+			if (scent >= threshold)
+				LuaMap_write(map, x, y, -scent);
+		}
+	}
+	LuaMap_push(map);
+	LuaMap_free(map);
+	lua_pushnumber(L, maxcost);
+	lua_setfield(L, -2, "maxcost");
+	return 1;
+}
+
+/* layers:updateHazards(seed) - advance fire and smoke by one turn (see
+   hazards.c); 'seed' is an integer (e.g. from math.random()). Returns a
+   flat list {x, y, id, smoky, ...} of only the tiles which changed: their
+   new Tile.id, and 1 if there's smoke on them or 0 */
+static int layers_updatehazards(lua_State *L)
+{
+	MapLayers *layers = MapLayers_check(L, 1);
+	RandomState random = check_random_seed(L, 2);
+	int *changed = malloc(sizeof(int) * layers->w * layers->h);
+	int num = MapLayers_update_hazards(layers, &random, changed), i;
+
+	lua_createtable(L, num * 4, 0);
+	for (i = 0; i < num; i++)
+	{
+		int idx = changed[i];
+		lua_pushinteger(L, idx % layers->w + 1);
+		lua_rawseti(L, -2, i * 4 + 1);
+		lua_pushinteger(L, idx / layers->w + 1);
+		lua_rawseti(L, -2, i * 4 + 2);
+		lua_pushinteger(L, layers->tile_ids[idx]);
+		lua_rawseti(L, -2, i * 4 + 3);
+		lua_pushinteger(L, MapLayers_smoky(layers, idx));
+		lua_rawseti(L, -2, i * 4 + 4);
+	}
+	free(changed);
+	return 1;
+}
+
+/* layers:epoch() - returns the number of changes made to the map's tiles
+   so far, to remember what a cache was made from */
+static int layers_epoch(lua_State *L)
+{
+	lua_pushinteger(L, MapLayers_check(L, 1)->epoch);
+	return 1;
+}
+
+/* layers:changesSince(epoch) - returns a flat list {x, y, ...} of the tiles
+   which changed type or started or stopped blocking sight since an epoch
+   (see layers:epoch()), or nil if the journal can't tell (everything may
+   have changed) */
+static int layers_changessince(lua_State *L)
+{
+	MapLayers *layers = MapLayers_check(L, 1);
+	long epoch = luaL_checkinteger(L, 2);
+	int num = changes_since(layers, epoch), n;
+	if (num < 0)
+		return 0;
+	lua_createtable(L, num * 2, 0);
+	for (n = 0; n < num; n++)
+	{
+		int idx = change_since(layers, epoch, n)->idx;
+		lua_pushinteger(L, idx % layers->w + 1);
+		lua_rawseti(L, -2, n * 2 + 1);
+		lua_pushinteger(L, idx / layers->w + 1);
+		lua_rawseti(L, -2, n * 2 + 2);
+	}
+	return 1;
+}
+
+/* Reads grid[x][y] from a 2D grid at a stack index as a number; 'def' if
+   it's missing or not a number */
+static disttype read_grid(lua_State *L, int arg, int x, int y, disttype def)
+{
+	lua_rawgeti(L, arg, x);
+	lua_rawgeti(L, -1, y);
+	disttype value = lua_type(L, -1) == LUA_TNUMBER ? lua_tonumber(L, -1) : def;
+	lua_pop(L, 2);
+	return value;
+}
+
+/* layers:sightAffected(epoch, sightMap) - returns true if a sight map (2D
+   grid of booleans) computed at an epoch may be out of date: if a tile which
+   was visible started or stopped blocking sight since. Tiles which weren't
+   visible can't change what is */
+static int layers_sightaffected(lua_State *L)
+{
+	MapLayers *layers = MapLayers_check(L, 1);
+	long epoch = luaL_checkinteger(L, 2);
+	luaL_checktype(L, 3, LUA_TTABLE);
+	int num = changes_since(layers, epoch), n, affected = num < 0;
+	for (n = 0; n < num && !affected; n++)
+	{
+		TileChange *change = change_since(layers, epoch, n);
+		if (change->old_opaque == change->new_opaque)
+			continue;
+		lua_rawgeti(L, 3, change->idx % layers->w + 1);
+		lua_rawgeti(L, -1, change->idx / layers->w + 1);
+		affected = lua_toboolean(L, -1);
+		lua_pop(L, 2);
+	}
+	lua_pushboolean(L, affected);
+	return 1;
+}
+
+/* layers:distMapAffected(epoch, distMap, profile [, terrain]) - returns
+   true if a Dijkstra map made at an epoch for a cost profile (with its
+   maxcost in distMap.maxcost) may be out of date because of the tiles
+   changed since; with 'terrain', it's a map towards the tiles of that
+   terrain type, which are out of date if any tile changed to or from it.
+   A tile which got cheaper only matters if it's now closer than it was
+   through one of its neighbours; one which got dearer only matters if it
+   was reached */
+static int layers_distmapaffected(lua_State *L)
+{
+	MapLayers *layers = MapLayers_check(L, 1);
+	long epoch = luaL_checkinteger(L, 2);
+	luaL_checktype(L, 3, LUA_TTABLE);
+	int profile = check_cost_profile(L, 4);
+	int terrain = lua_isnoneornil(L, 5) ? -1 : terrain_id(L, luaL_checkstring(L, 5));
+	lua_getfield(L, 3, "maxcost");
+	disttype maxcost = lua_type(L, -1) == LUA_TNUMBER ? lua_tonumber(L, -1) : IMPASSABLE_COST;
+	lua_pop(L, 1);
+
+	disttype *cost = profiles[profile].cost;
+	int num = changes_since(layers, epoch), n, affected = num < 0;
+	for (n = 0; n < num && !affected; n++)
+	{
+		TileChange *change = change_since(layers, epoch, n);
+		int old_terrain = tile_terrain[change->old_id], new_terrain = tile_terrain[change->new_id];
+		if ((old_terrain == terrain) != (new_terrain == terrain))
+		{
+			affected = 1;
+			break;
+		}
+		disttype old_cost = cost[old_terrain], new_cost = cost[new_terrain];
+		if (old_cost == new_cost)
+			continue;
+
+		int x = change->idx % layers->w + 1, y = change->idx / layers->w + 1, dx, dy;
+		disttype dist = read_grid(L, 3, x, y, maxcost);
+		if (new_cost > old_cost)
+		{
+			affected = dist < maxcost;
+			continue;
+		}
+		for (dx = -1; dx <= 1 && !affected; dx++)
+		{
+			for (dy = -1; dy <= 1; dy++)
+			{
+				if ((!dx && !dy) || x + dx < 1 || x + dx > layers->w ||
+				    y + dy < 1 || y + dy > layers->h)
+					continue;
+				disttype from = read_grid(L, 3, x + dx, y + dy, maxcost);
+				/* Diagonal steps cost slightly more, see dijvisit() */
+				if (from < maxcost && from + new_cost + (dx && dy ? 0.001 : 0) < dist)
+				{
+					affected = 1;
+					break;
+				}
+			}
+		}
+	}
+	lua_pushboolean(L, affected);
+	return 1;
+}
+
+static luaL_Reg layers_methods[] = {
+	{	"setTile",		layers_settile },
+	{	"loadTiles",		layers_loadtiles },
+	{	"saveTiles",		layers_savetiles },
+	{	"tileId",		layers_tileid },
+	{	"cost",			layers_cost },
+	{	"setOccupant",		layers_setoccupant },
+	{	"occupant",		layers_occupant },
+	{	"isFree",		layers_isfree },
+	{	"numFree",		layers_numfree },
+	{	"randomFreeTile",	layers_randomfreetile },
+	{	"randomSharedFreeTile",	layers_randomsharedfreetile },
+	{	"isAreaBlank",		layers_isareablank },
+	{	"sampleBlankAreas",	layers_sampleblankareas },
+	{	"addScent",		layers_addscent },
+	{	"updateScent",		layers_updatescent },
+	{	"scent",		layers_scent },
+	{	"scentMap",		layers_scentmap },
+	{	"updateHazards",	layers_updatehazards },
+	{	"epoch",		layers_epoch },
+	{	"changesSince",		layers_changessince },
+	{	"sightAffected",	layers_sightaffected },
+	{	"distMapAffected",	layers_distmapaffected },
+	{	NULL,			NULL }
+};
+
+/* Create the metatable used for MapLayers userdata */
+void MapLayers_init_metatable(lua_State *L)
+{
+	luaL_newmetatable(L, LAYERS_METATABLE);
+	lua_pushcfunction(L, layers_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_newtable(L);
+	luaL_setfuncs(L, layers_methods, 0);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+}
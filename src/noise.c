@@ -0,0 +1,91 @@
+/* -*- c-basic-offset: 8 -*- */
+/* This file contains noise propagation: finding out which actors hear each
+   of a batch of noises. Sound spreads like a Dijkstra map, losing loudness
+   on every tile it crosses according to a cost profile, so that doors and
+   walls dampen it. */
+
+#include <stdlib.h>
+#include "nush.h"
+
+
+/* Reads the noise at index i of the list at a stack index into a
+   PathRequest, raising an error if it's out of bounds */
+static void read_noise(lua_State *L, int arg, int i, MapLayers *layers, PathRequest *req)
+{
+	lua_rawgeti(L, arg, i);
+	luaL_checktype(L, -1, LUA_TTABLE);
+	lua_getfield(L, -1, "x");
+	lua_getfield(L, -2, "y");
+	lua_getfield(L, -3, "volume");
+	req->x = lua_tointeger(L, -3);
+	req->y = lua_tointeger(L, -2);
+	req->maxcost = lua_tonumber(L, -1);
+	lua_pop(L, 4);
+	if (req->x < 1 || req->x > layers->w || req->y < 1 || req->y > layers->h)
+		luaL_error(L, "noise at %d,%d is out of bounds", req->x, req->y);
+}
+
+/* clib.propagateNoise(layers, profile, noises)
+   Each noise is a table with x, y (where it's made) and volume (how many
+   tiles of cost 1 it carries across); 'profile' is the name of the cost
+   profile giving how much each terrain type dampens sound. The noises are
+   spread concurrently on the worker threads, and the actors which hear
+   them are found from the map's occupancy layer.
+   Returns a list with, for each noise, a table mapping the Actor._id of
+   everyone who heard it (including whoever is at x, y) to how loud it was
+   where they are (volume minus the cost of the way there, > 0). */
+int clib_propagatenoise(lua_State *L)
+{
+	MapLayers *layers = MapLayers_check(L, 1);
+	int profile = check_cost_profile(L, 2);
+	luaL_checktype(L, 3, LUA_TTABLE);
+	int num = lua_rawlen(L, 3);
+	int i;
+
+	/* Check every noise before anything is allocated, which would leak if
+	   an error were raised */
+	PathRequest check;
+	for (i = 0; i < num; i++)
+		read_noise(L, 3, i + 1, layers, &check);
+
+	LuaMap *costmap = MapLayers_costmap(layers, profile);
+	PathRequest *reqs = calloc(num + 1, sizeof(PathRequest));
+	void **args = malloc(sizeof(void *) * (num + 1));
+	for (i = 0; i < num; i++)
+	{
+		PathRequest *req = &reqs[i];
+		read_noise(L, 3, i + 1, layers, req);
+		req->costmap = costmap;
+		args[i] = req;
+	}
+
+	JobBatch batch;
+	batch.func = PathRequest_run;
+	batch.args = args;
+	batch.num_jobs = num;
+	JobBatch_run(&batch);
+
+	lua_createtable(L, num, 0);
+	for (i = 0; i < num; i++)
+	{
+		PathRequest *req = &reqs[i];
+		disttype *dists = req->distmap->tiles;
+		int idx;
+		lua_newtable(L);
+		for (idx = 0; idx < layers->w * layers->h; idx++)
+		{
+			if (layers->occupants[idx] && dists[idx] < req->maxcost)
+			{
+				lua_pushnumber(L, req->maxcost - dists[idx]);
+				lua_rawseti(L, -2, layers->occupants[idx]);
+			}
+		}
+		lua_rawseti(L, -2, i + 1);
+		PathRequest_free(req);
+	}
+
+	LuaMap_free(costmap);
+	free(reqs);
+	free(args);
+	return 1;
+}
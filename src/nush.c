@@ -582,6 +582,309 @@ static int clib_time( lua_State *L )
 	return 1;
 }
 
+/* Returns the width and height of the 2D grid at a stack index */
+static void grid_size( lua_State *L, int index, int *w, int *h )
+{
+	luaL_checktype( L, index, LUA_TTABLE );
+	*w = lua_rawlen( L, index );
+	lua_rawgeti( L, index, 1 ); /* tiles[1] */
+	luaL_checktype( L, -1, LUA_TTABLE );
+	*h = lua_rawlen( L, -1 );
+	lua_pop( L, 1 );
+	if ( *h > 65535 || *w > 65535 )
+		luaL_error( L, "maps larger than 65535*65535 are unsupported" );
+}
+
+/* Reads the whole cost map from a 2D grid of Tiles at a stack index, using
+   the passability flag in .solid, which should be either a bool or int */
+static void load_costmap( lua_State *L, int tiles_index, int w, int h, LuaMap **costmap )
+{
+	lua_pushstring( L, "solid" );
+	/* stored before reading, so the caller can free it if that fails */
+	*costmap = LuaMap_from_table( tiles_index, lua_gettop( L ), w, h, 1.0 );
+	LuaMap_load_all( *costmap );
+	lua_pop( L, 1 );
+}
+
+/* Reads the 'combine' list of {map, weight} pairs of a request table at a
+   stack index into a PathRequest, if there is one */
+static void read_path_sources( lua_State *L, int index, PathRequest *req )
+{
+	lua_getfield( L, index, "combine" );
+	if ( lua_type( L, -1 ) != LUA_TTABLE )
+	{
+		lua_pop( L, 1 );
+		return;
+	}
+	int num = lua_rawlen( L, -1 );
+	if ( num == 0 )
+		luaL_error( L, "Dijkstra map request has nothing to combine" );
+	req->sources = calloc( num, sizeof(LuaMap *) );
+	req->weights = malloc( sizeof(disttype) * num );
+	req->source_maxcosts = malloc( sizeof(disttype) * num );
+
+	int i;
+	for ( i = 0; i < num; i++ )
+	{
+		lua_rawgeti( L, -1, i + 1 );
+		luaL_checktype( L, -1, LUA_TTABLE );
+		lua_rawgeti( L, -1, 1 );
+		luaL_checktype( L, -1, LUA_TTABLE );
+		lua_getfield( L, -1, "maxcost" );
+		if ( lua_type( L, -1 ) != LUA_TNUMBER )
+			luaL_error( L, "map %d to combine is missing maxcost", i + 1 );
+		req->source_maxcosts[i] = lua_tonumber( L, -1 );
+		lua_pop( L, 1 );
+		req->sources[i] = LuaMap_from_table( lua_gettop( L ), 0, req->costmap->w,
+						     req->costmap->h, req->source_maxcosts[i] );
+		req->num_sources = i + 1;
+		LuaMap_load_all( req->sources[i] );
+		lua_rawgeti( L, -2, 2 );
+		req->weights[i] = luaL_checknumber( L, -1 );
+		lua_pop( L, 3 );
+	}
+	lua_pop( L, 1 );
+}
+
+/* Adds a goal to the goal list of a PathRequest, growing it as needed; the
+   list starts with room for 8 */
+static void add_path_goal( lua_State *L, PathRequest *req, int x, int y, disttype cost )
+{
+	if ( x < 1 || x > req->costmap->w || y < 1 || y > req->costmap->h )
+		luaL_error( L, "Dijkstra map request goal %d,%d is out of bounds", x, y );
+	if ( req->num_goals >= 8 && ( req->num_goals & ( req->num_goals - 1 ) ) == 0 )
+		req->goals = realloc( req->goals, sizeof(PathGoal) * 2 * req->num_goals );
+	req->goals[req->num_goals].x = x;
+	req->goals[req->num_goals].y = y;
+	req->goals[req->num_goals].cost = cost;
+	req->num_goals++;
+}
+
+/* Reads a 2D grid of goal costs at a stack index into the goal list of a
+   PathRequest. Only the entries which are present are visited, so a sparse
+   grid is cheap; values which aren't numbers < maxcost aren't goals. */
+static void read_goal_grid( lua_State *L, int index, PathRequest *req )
+{
+	req->goals = malloc( sizeof(PathGoal) * 8 );
+	req->num_goals = 0;
+	lua_pushnil( L );
+	while ( lua_next( L, index ) )
+	{
+		int x = lua_tointeger( L, -2 );
+		if ( lua_type( L, -1 ) == LUA_TTABLE )
+		{
+			lua_pushnil( L );
+			while ( lua_next( L, -2 ) )
+			{
+				if ( lua_type( L, -1 ) == LUA_TNUMBER && lua_tonumber( L, -1 ) < req->maxcost )
+					add_path_goal( L, req, x, lua_tointeger( L, -2 ), lua_tonumber( L, -1 ) );
+				lua_pop( L, 1 );
+			}
+		}
+		lua_pop( L, 1 );
+	}
+}
+
+/* Reads the 'goalList' of a request table at a stack index into a
+   PathRequest, if there is one */
+static void read_path_goals( lua_State *L, int index, PathRequest *req )
+{
+	lua_getfield( L, index, "goalList" );
+	if ( lua_type( L, -1 ) != LUA_TTABLE )
+	{
+		lua_pop( L, 1 );
+		return;
+	}
+	int num = lua_rawlen( L, -1 );
+	/* may be empty, in which case nothing is reached */
+	req->goals = malloc( sizeof(PathGoal) * 8 );
+	req->num_goals = 0;
+
+	int i;
+	for ( i = 0; i < num; i++ )
+	{
+		lua_rawgeti( L, -1, i + 1 );
+		luaL_checktype( L, -1, LUA_TTABLE );
+		lua_rawgeti( L, -1, 1 );
+		lua_rawgeti( L, -2, 2 );
+		lua_rawgeti( L, -3, 3 );
+		add_path_goal( L, req, lua_tointeger( L, -3 ), lua_tointeger( L, -2 ),
+			       lua_isnil( L, -1 ) ? 0 : lua_tonumber( L, -1 ) );
+		lua_pop( L, 4 );
+	}
+	lua_pop( L, 1 );
+
+	lua_getfield( L, index, "labels" );
+	req->want_labels = lua_toboolean( L, -1 );
+	lua_pop( L, 1 );
+}
+
+/* Fills in a PathRequest from the request table at a stack index; see
+   clib.dijkstraMaps(). layers may be NULL if the map isn't a MapLayers.
+   All Lua values are read here, so the request can be run without touching
+   the lua_State */
+static void read_path_request( lua_State *L, int index, PathRequest *req,
+			       MapLayers *layers, LuaMap *costmap )
+{
+	memset( req, 0, sizeof(PathRequest) );
+	req->costmap = costmap;
+
+	lua_getfield( L, index, "maxcost" );
+	if ( lua_type( L, -1 ) != LUA_TNUMBER )
+		luaL_error( L, "Dijkstra map request is missing maxcost" );
+	req->maxcost = lua_tonumber( L, -1 );
+	lua_pop( L, 1 );
+
+	lua_getfield( L, index, "goals" );
+	if ( lua_type( L, -1 ) == LUA_TTABLE )
+		read_goal_grid( L, lua_gettop( L ), req );
+	lua_pop( L, 1 );
+
+	lua_getfield( L, index, "terrain" );
+	if ( !req->goals && lua_type( L, -1 ) == LUA_TSTRING )
+	{
+		if ( !layers )
+			luaL_error( L, "terrain goals need a MapLayers" );
+		req->distmap = MapLayers_terrain_goals( L, layers, lua_tostring( L, -1 ), req->maxcost );
+	}
+	lua_pop( L, 1 );
+
+	if ( !req->distmap && !req->goals )
+		read_path_goals( L, index, req );
+	if ( !req->distmap && !req->goals )
+		read_path_sources( L, index, req );
+
+	if ( !req->distmap && !req->num_sources && !req->goals )
+	{
+		lua_getfield( L, index, "x" );
+		lua_getfield( L, index, "y" );
+		req->x = lua_tointeger( L, -2 );
+		req->y = lua_tointeger( L, -1 );
+		lua_pop( L, 2 );
+		if ( req->x < 1 || req->x > costmap->w || req->y < 1 || req->y > costmap->h )
+			luaL_error( L, "Dijkstra map request goal %d,%d is out of bounds", req->x, req->y );
+	}
+
+	lua_getfield( L, index, "sparse" );
+	req->sparse = lua_toboolean( L, -1 );
+	lua_pop( L, 1 );
+
+	lua_getfield( L, index, "rescale" );
+	if ( lua_type( L, -1 ) == LUA_TTABLE )
+	{
+		req->rescale = 1;
+		lua_rawgeti( L, -1, 1 );
+		lua_rawgeti( L, -2, 2 );
+		req->rescale_mul = lua_tonumber( L, -2 );
+		req->rescale_add = lua_tonumber( L, -1 );
+		lua_pop( L, 2 );
+	}
+	lua_pop( L, 1 );
+}
+
+/* Returns the cost grid to use for the request table at the top of the
+   stack: if reading from MapLayers, a snapshot of the cost layer for the
+   request's profile, taken the first time each profile is used, otherwise
+   the snapshot of the Tiles in costmaps[0]. The index of the profile is
+   stored in *profile (0 without MapLayers). */
+static LuaMap *request_costmap( lua_State *L, MapLayers *layers, LuaMap **costmaps,
+				int *profile )
+{
+	*profile = 0;
+	if ( !layers )
+		return costmaps[0];
+
+	lua_getfield( L, -1, "profile" );
+	*profile = check_cost_profile( L, lua_gettop( L ) );
+	lua_pop( L, 1 );
+	if ( !costmaps[*profile] )
+		costmaps[*profile] = MapLayers_costmap( layers, *profile );
+	return costmaps[*profile];
+}
+
+static void free_costmaps( LuaMap **costmaps )
+{
+	int i;
+	for ( i = 0; i < MAX_COST_PROFILES; i++ )
+	{
+		if ( costmaps[i] )
+			LuaMap_free( costmaps[i] );
+		costmaps[i] = NULL;
+	}
+}
+
+/* Pushes the tiles reached by a PathRequest as a list of {x, y, distance}
+   or {x, y, distance, label} */
+static void push_sparse_result( lua_State *L, PathRequest *req )
+{
+	int i, n = 0, w = req->distmap->w;
+	lua_newtable( L );
+	for ( i = 0; i < w * req->distmap->h; i++ )
+	{
+		if ( req->distmap->tiles[i] >= req->maxcost )
+			continue;
+		lua_createtable( L, req->labels ? 4 : 3, 0 );
+		lua_pushinteger( L, i % w + 1 );
+		lua_rawseti( L, -2, 1 );
+		lua_pushinteger( L, i / w + 1 );
+		lua_rawseti( L, -2, 2 );
+		lua_pushnumber( L, req->distmap->tiles[i] );
+		lua_rawseti( L, -2, 3 );
+		if ( req->labels )
+		{
+			lua_pushinteger( L, req->labels[i] );
+			lua_rawseti( L, -2, 4 );
+		}
+		lua_rawseti( L, -2, ++n );
+	}
+}
+
+/* Pushes the result of a PathRequest which has been run: a 2D grid of
+   distances, with a .labels grid if they were asked for, or if it's sparse,
+   a list of the tiles reached */
+static void push_path_result( lua_State *L, PathRequest *req )
+{
+	if ( req->sparse )
+	{
+		push_sparse_result( L, req );
+		return;
+	}
+	LuaMap_push( req->distmap );
+	if ( !req->labels )
+		return;
+
+	int x, y, w = req->distmap->w, h = req->distmap->h;
+	lua_createtable( L, w, 0 );
+	for ( x = 1; x <= w; x++ )
+	{
+		lua_createtable( L, h, 0 );
+		for ( y = 1; y <= h; y++ )
+		{
+			lua_pushinteger( L, req->labels[(x - 1) + (y - 1) * w] );
+			lua_rawseti( L, -2, y );
+		}
+		lua_rawseti( L, -2, x );
+	}
+	lua_setfield( L, -2, "labels" );
+}
+
+/* Pushes a 2D grid of booleans, true where grid is nonzero */
+static void push_bool_grid( lua_State *L, unsigned char *grid, int w, int h )
+{
+	int x, y;
+	lua_createtable( L, w, 0 );
+	for ( x = 1; x <= w; x++ )
+	{
+		lua_createtable( L, h, 0 );
+		for ( y = 1; y <= h; y++ )
+		{
+			lua_pushboolean( L, grid[(x - 1) + (y - 1) * w] );
+			lua_rawseti( L, -2, y );
+		}
+		lua_rawseti( L, -2, x );
+	}
+}
+
 /* clib.dijkstraMap(tilemap, maxcost, x, y)
    OR
    clib.dijkstraMap(tilemap, maxcost, distmap)
@@ -595,46 +898,37 @@ static int clib_dijkstramap( lua_State *L )
 	long long spent_us = microseconds();
 
 	int tiles_index = 1; /* first arg */
-	luaL_checktype( L, tiles_index, LUA_TTABLE );
-
-	/* Find map width and height */
-	int w = lua_rawlen( L, tiles_index );
-	lua_rawgeti( L, tiles_index, 1); /* tiles[1] */
-	luaL_checktype( L, -1, LUA_TTABLE );
-	int h = lua_rawlen( L, -1 );
-	lua_pop( L, 1 );
-	if ( h > 65535 || w > 65535 )
-		luaL_error( L, "maps larger than 65535*65535 are unsupported" );
+	int w, h;
+	grid_size( L, tiles_index, &w, &h );
 
-	double maxcost = luaL_checknumber( L, 2 );
+	PathRequest req;
+	memset( &req, 0, sizeof(PathRequest) );
+	req.maxcost = luaL_checknumber( L, 2 );
 
 	/* Get the goal: distmap for multiple source, x,y for single source */
-	LuaMap *distmap = NULL;
-	int goalx = 0, goaly = 0;
+	req.distmap = NULL;
 	if ( lua_type( L, 3 ) == LUA_TTABLE )
 	{
 		/* Missing values in distmap are maxcost (unvisited/nongoals) */
-		distmap = LuaMap_from_table( 3, 0, w, h, maxcost );
+		req.distmap = LuaMap_from_table( 3, 0, w, h, req.maxcost );
 	}
 	else
 	{
-		goalx = luaL_checkinteger( L, 3 );
-		goaly = luaL_checkinteger( L, 4 );
+		req.x = luaL_checkinteger( L, 3 );
+		req.y = luaL_checkinteger( L, 4 );
 	}
 
 	/* Member of Tile used for cost of a tile,
-	   which should be either a bool or int */
+	   which should be either a bool or int.
+	   Tiles are read lazily, only as far as the search reaches. */
 	lua_pushstring( L, "solid" );
 	int attr_index = lua_gettop( L );
-	LuaMap *costmap = LuaMap_from_table( tiles_index, attr_index, w, h, 1.0 );
+	req.costmap = LuaMap_from_table( tiles_index, attr_index, w, h, 1.0 );
 
-	if ( distmap )
-		multiple_source_dijkstra_map( costmap, distmap, maxcost );
-	else
-		distmap = single_source_dijkstra_map( costmap, goalx, goaly, maxcost );
-	LuaMap_push( distmap );
-	LuaMap_free( distmap );
-	LuaMap_free( costmap );
+	PathRequest_run( &req );
+	LuaMap_push( req.distmap );
+	LuaMap_free( req.distmap );
+	LuaMap_free( req.costmap );
 
 	spent_us = microseconds() - spent_us;
 	log_printf("dijkstraMap done in %fs", spent_us * 1e-6);
@@ -642,11 +936,445 @@ static int clib_dijkstramap( lua_State *L )
 	return 1;
 }
 
+/* The buffers of a clib.dijkstraMaps() call, kept in a userdata so that
+   the garbage collector frees them if a bad request raises an error part
+   way through reading the requests */
+typedef struct {
+	PathRequest *reqs;  /* zeroed until read, so all can be freed */
+	int num;
+	void **args;
+	PathCacheKey *keys;
+	LuaMap *costmaps[MAX_COST_PROFILES];
+} PathBatch;
+
+#define PATHBATCH_METATABLE "nush.PathBatch"
+
+/* Free everything held by a PathBatch; it may be freed again */
+static void PathBatch_free( PathBatch *pb )
+{
+	int i;
+	for ( i = 0; i < pb->num; i++ )
+	{
+		PathRequest_free( &pb->reqs[i] );
+		PathCacheKey_free( &pb->keys[i] );
+	}
+	free( pb->reqs );
+	free( pb->args );
+	free( pb->keys );
+	pb->reqs = NULL;
+	pb->args = NULL;
+	pb->keys = NULL;
+	pb->num = 0;
+	free_costmaps( pb->costmaps );
+}
+
+static int pathbatch_gc( lua_State *L )
+{
+	PathBatch_free( luaL_checkudata( L, 1, PATHBATCH_METATABLE ) );
+	return 0;
+}
+
+static void init_pathbatch_metatable( lua_State *L )
+{
+	luaL_newmetatable( L, PATHBATCH_METATABLE );
+	lua_pushcfunction( L, pathbatch_gc );
+	lua_setfield( L, -2, "__gc" );
+	lua_pop( L, 1 );
+}
+
+/* clib.dijkstraMaps(tilemap, requests)
+   OR
+   clib.dijkstraMaps(layers, requests)
+   Computes several independent Dijkstra maps over the same map concurrently,
+   on the worker threads. The map is either a 2D grid of Tiles, using .solid
+   as for clib.dijkstraMap(), or a Map's MapLayers, in which case each request
+   names the cost profile to use. Each request is a table with:
+     maxcost      - as for clib.dijkstraMap()
+     profile      - name of a cost profile (only with MapLayers)
+     x, y         - a single goal tile, OR
+     goals        - a 2D grid of goal costs, as for clib.dijkstraMap(), OR
+     goalList     - a list of goals, each {x, y} or {x, y, cost}; cheaper
+                    than a grid when there are few goals, OR
+     terrain      - a terrain type; every tile of that type is a goal with
+                    cost 0 (only with MapLayers), OR
+     combine      - a list of {map, weight} pairs, making a "desire map": the
+                    goals are the sum of the weighted maps (each of which
+                    must have a .maxcost field), which is then searched again
+                    so that the values are consistent. Tiles which a map with
+                    a positive weight didn't reach aren't goals; unreached
+                    tiles in maps with negative weights count as its maxcost
+     labels       - optional, with goalList: if true, the result has a
+                    .labels 2D grid giving for each tile the index in
+                    goalList of the nearest goal (the one its distance is
+                    to), or 0 if unreached. Nearest-target questions for
+                    any number of actors can then be answered from one map
+     sparse       - optional: if true, instead of a grid the result is a
+                    list of the tiles reached (closer than maxcost), each
+                    {x, y, distance} (plus the label if asked for), so a
+                    search with a small maxcost is cheap all the way through
+     rescale      - optional {mul, add}: every reached distance d is replaced
+                    with mul * d + add and the map is searched again; e.g.
+                    {-1.4, 100} makes a flee map out of a map to a goal
+   Returns a list of 2D grids, one for each request, in the same order.
+   With MapLayers, maps are kept in a cache (see pathcache.c), and requests
+   for a map already computed since the map last changed aren't run again. */
+static int clib_dijkstramaps( lua_State *L )
+{
+	long long spent_us = microseconds();
+
+	MapLayers *layers = NULL;
+	int w, h;
+	if ( MapLayers_is( L, 1 ) )
+	{
+		layers = MapLayers_check( L, 1 );
+		w = layers->w;
+		h = layers->h;
+	}
+	else
+		grid_size( L, 1, &w, &h );
+	luaL_checktype( L, 2, LUA_TTABLE );
+	int num = lua_rawlen( L, 2 );
+
+	PathBatch *pb = lua_newuserdata( L, sizeof(PathBatch) );
+	memset( pb, 0, sizeof(PathBatch) );
+	luaL_getmetatable( L, PATHBATCH_METATABLE );
+	lua_setmetatable( L, -2 );
+	pb->num = num;
+	pb->reqs = calloc( num + 1, sizeof(PathRequest) );
+	pb->args = malloc( sizeof(void *) * (num + 1) );
+	/* Cache key of each request which has to be run; the hash is 0 if
+	   cached */
+	pb->keys = calloc( num + 1, sizeof(PathCacheKey) );
+	PathRequest *reqs = pb->reqs;
+	void **args = pb->args;
+	PathCacheKey *keys = pb->keys;
+
+	/* Snapshot the cost grids, as workers can't read them from Lua, and
+	   the cost layers may change before they're done. One per cost profile
+	   used, or just one from the Tiles */
+	LuaMap **costmaps = pb->costmaps;
+	if ( !layers )
+		load_costmap( L, 1, w, h, &costmaps[0] );
+
+	int i, profile, num_jobs = 0;
+	for ( i = 0; i < num; i++ )
+	{
+		lua_rawgeti( L, 2, i + 1 );
+		luaL_checktype( L, -1, LUA_TTABLE );
+		LuaMap *costmap = request_costmap( L, layers, costmaps, &profile );
+		read_path_request( L, lua_gettop( L ), &reqs[i], layers, costmap );
+		lua_pop( L, 1 );
+		if ( layers )
+		{
+			PathCacheKey key;
+			PathCache_key( &key, &reqs[i], layers, profile, tile_registry_version() );
+			if ( PathCache_lookup( &key, &reqs[i] ) )
+			{
+				PathCacheKey_free( &key );
+				continue;
+			}
+			keys[i] = key;
+		}
+		args[num_jobs++] = &reqs[i];
+	}
+
+	JobBatch batch;
+	batch.func = PathRequest_run;
+	batch.args = args;
+	batch.num_jobs = num_jobs;
+	JobBatch_run( &batch );
+
+	lua_createtable( L, num, 0 );
+	for ( i = 0; i < num; i++ )
+	{
+		if ( keys[i].hash )
+			PathCache_store( &keys[i], &reqs[i] );
+		push_path_result( L, &reqs[i] );
+		lua_rawseti( L, -2, i + 1 );
+		PathRequest_free( &reqs[i] );
+	}
+	PathBatch_free( pb );
+
+	spent_us = microseconds() - spent_us;
+	log_printf("dijkstraMaps: %d maps (%d cached) on %d workers done in %fs",
+		num, num - num_jobs, jobs_num_workers(), spent_us * 1e-6);
+
+	return 1;
+}
+
+/* clib.sightMap(layers, x, y, range) - returns a 2D grid of booleans giving
+   which tiles of a map can be seen from x,y */
+static int clib_sightmap( lua_State *L )
+{
+	MapLayers *layers = MapLayers_check( L, 1 );
+	SightRequest req;
+	req.w = layers->w;
+	req.h = layers->h;
+	req.x = luaL_checkinteger( L, 2 );
+	req.y = luaL_checkinteger( L, 3 );
+	req.range = luaL_checkinteger( L, 4 );
+	if ( req.x < 1 || req.x > req.w || req.y < 1 || req.y > req.h )
+		luaL_error( L, "sight map origin %d,%d is out of bounds", req.x, req.y );
+
+	unsigned char *opacity = MapLayers_opacity( layers );
+	req.opacity = opacity;
+	SightRequest_run( &req );
+	push_bool_grid( L, req.visible, req.w, req.h );
+	free( req.visible );
+	free( opacity );
+	return 1;
+}
+
+
+/*************************** Background jobs *********************************/
+
+/* One job of a clib.startJobs() batch: either a Dijkstra map or a sight map */
+typedef struct {
+	int is_sight;
+	PathRequest path;
+	SightRequest sight;
+	int done;  /* set by the job itself once it has run */
+	PathCacheKey key;  /* path cache key of a Dijkstra map; the hash is 0
+	                      if it came from the cache */
+} BackgroundJob;
+
+/* The userdata returned by clib.startJobs() */
+typedef struct {
+	JobBatch batch;
+	BackgroundJob *jobs;
+	void **args;
+	int num;
+	LuaMap *costmaps[MAX_COST_PROFILES];
+	unsigned char *opacity;
+	int cancelled;  /* no jobs are running, and args etc. have been freed */
+} BackgroundJobs;
+
+#define BACKGROUNDJOBS_METATABLE "nush.BackgroundJobs"
+
+static void BackgroundJob_run( void *arg )
+{
+	BackgroundJob *job = (BackgroundJob *)arg;
+	if ( job->is_sight )
+		SightRequest_run( &job->sight );
+	else
+		PathRequest_run( &job->path );
+	job->done = 1;
+}
+
+/* Push the result of a job, which must have been run */
+static void BackgroundJob_push( lua_State *L, BackgroundJob *job )
+{
+	if ( job->is_sight )
+		push_bool_grid( L, job->sight.visible, job->sight.w, job->sight.h );
+	else
+		push_path_result( L, &job->path );
+}
+
+/* Stop any jobs which haven't started and wait for the rest; the results of
+   the jobs which ran are kept */
+static void BackgroundJobs_stop( BackgroundJobs *bg )
+{
+	if ( bg->cancelled )
+		return;
+	JobBatch_cancel( &bg->batch );
+	bg->cancelled = 1;
+	free( bg->args );
+	bg->args = NULL;
+}
+
+/* Stop all jobs and free everything */
+static void BackgroundJobs_free( BackgroundJobs *bg )
+{
+	BackgroundJobs_stop( bg );
+	int i;
+	for ( i = 0; i < bg->num; i++ )
+	{
+		if ( bg->jobs[i].is_sight )
+			free( bg->jobs[i].sight.visible );
+		else
+			PathRequest_free( &bg->jobs[i].path );
+		PathCacheKey_free( &bg->jobs[i].key );
+	}
+	free( bg->jobs );
+	bg->jobs = NULL;
+	bg->num = 0;
+	free( bg->args );  /* if never submitted */
+	bg->args = NULL;
+	free_costmaps( bg->costmaps );
+	free( bg->opacity );
+	bg->opacity = NULL;
+}
+
+/* clib.startJobs(layers, requests)
+   Starts computing a list of maps of a MapLayers on the worker threads, and
+   returns immediately with a handle to them. Each request is either a
+   request as for clib.dijkstraMaps(), or a sight map request:
+     sight        - sight range, as for clib.sightMap()
+     x, y         - origin of the sight map
+   The map may be changed while the jobs run; they use a snapshot of it.
+   Dijkstra maps in the path cache (see pathcache.c) aren't run again.
+   The handle has methods:
+     take(i, ...) - returns the results of the requests with the given
+                    indices, running them now if they haven't been yet; any
+                    others which haven't started are cancelled. Can only be
+                    called once.
+     cancel()     - cancel all jobs which haven't started and free everything;
+                    also done when the handle is garbage collected */
+static int clib_startjobs( lua_State *L )
+{
+	MapLayers *layers = MapLayers_check( L, 1 );
+	luaL_checktype( L, 2, LUA_TTABLE );
+	int num = lua_rawlen( L, 2 );
+
+	BackgroundJobs *bg = lua_newuserdata( L, sizeof(BackgroundJobs) );
+	memset( bg, 0, sizeof(BackgroundJobs) );
+	bg->cancelled = 1;  /* until submitted */
+	luaL_getmetatable( L, BACKGROUNDJOBS_METATABLE );
+	lua_setmetatable( L, -2 );
+
+	bg->num = num;
+	bg->jobs = calloc( num + 1, sizeof(BackgroundJob) );
+	bg->args = malloc( sizeof(void *) * (num + 1) );
+	int i, profile, num_jobs = 0;
+	for ( i = 0; i < num; i++ )
+	{
+		BackgroundJob *job = &bg->jobs[i];
+		lua_rawgeti( L, 2, i + 1 );
+		luaL_checktype( L, -1, LUA_TTABLE );
+		lua_getfield( L, -1, "sight" );
+		job->is_sight = !lua_isnil( L, -1 );
+		if ( job->is_sight )
+		{
+			if ( !bg->opacity )
+				bg->opacity = MapLayers_opacity( layers );
+			job->sight.opacity = bg->opacity;
+			job->sight.w = layers->w;
+			job->sight.h = layers->h;
+			job->sight.range = lua_tointeger( L, -1 );
+			lua_getfield( L, -2, "x" );
+			lua_getfield( L, -3, "y" );
+			job->sight.x = lua_tointeger( L, -2 );
+			job->sight.y = lua_tointeger( L, -1 );
+			lua_pop( L, 2 );
+			if ( job->sight.x < 1 || job->sight.x > layers->w || job->sight.y < 1 || job->sight.y > layers->h )
+				luaL_error( L, "sight map origin %d,%d is out of bounds", job->sight.x, job->sight.y );
+		}
+		lua_pop( L, 1 );
+		if ( !job->is_sight )
+		{
+			LuaMap *costmap = request_costmap( L, layers, bg->costmaps, &profile );
+			read_path_request( L, lua_gettop( L ), &job->path, layers, costmap );
+			PathCache_key( &job->key, &job->path, layers, profile, tile_registry_version() );
+			if ( PathCache_lookup( &job->key, &job->path ) )
+			{
+				PathCacheKey_free( &job->key );
+				job->key.hash = 0;
+				job->done = 1;
+			}
+		}
+		lua_pop( L, 1 );
+		if ( !job->done )
+			bg->args[num_jobs++] = job;
+	}
+
+	bg->batch.func = BackgroundJob_run;
+	bg->batch.args = bg->args;
+	bg->batch.num_jobs = num_jobs;
+	bg->cancelled = 0;
+	JobBatch_submit( &bg->batch );
+	return 1;
+}
+
+static int backgroundjobs_take( lua_State *L )
+{
+	BackgroundJobs *bg = luaL_checkudata( L, 1, BACKGROUNDJOBS_METATABLE );
+	if ( !bg->jobs )
+		luaL_error( L, "background jobs already taken or cancelled" );
+	int nargs = lua_gettop( L ) - 1, i;
+	for ( i = 2; i <= nargs + 1; i++ )
+	{
+		int idx = luaL_checkinteger( L, i );
+		if ( idx < 1 || idx > bg->num )
+			luaL_error( L, "no background job %d", idx );
+	}
+
+	BackgroundJobs_stop( bg );
+	long long spent_us = microseconds();
+	int ran = 0;
+	for ( i = 2; i <= nargs + 1; i++ )
+	{
+		BackgroundJob *job = &bg->jobs[luaL_checkinteger( L, i ) - 1];
+		if ( !job->done )
+		{
+			BackgroundJob_run( job );
+			ran++;
+		}
+		if ( job->key.hash )
+			PathCache_store( &job->key, &job->path );
+		BackgroundJob_push( L, job );
+	}
+	BackgroundJobs_free( bg );
+
+	spent_us = microseconds() - spent_us;
+	log_printf("backgroundJobs: took %d results (%d not ready) in %fs",
+		nargs, ran, spent_us * 1e-6);
+	return nargs;
+}
+
+static int backgroundjobs_cancel( lua_State *L )
+{
+	BackgroundJobs *bg = luaL_checkudata( L, 1, BACKGROUNDJOBS_METATABLE );
+	BackgroundJobs_free( bg );
+	return 0;
+}
+
+static luaL_Reg backgroundjobs_methods[] = {
+	{	"take",			backgroundjobs_take },
+	{	"cancel",		backgroundjobs_cancel },
+	{	NULL,			NULL }
+};
+
+static void init_backgroundjobs_metatable( lua_State *L )
+{
+	luaL_newmetatable( L, BACKGROUNDJOBS_METATABLE );
+	lua_pushcfunction( L, backgroundjobs_cancel );
+	lua_setfield( L, -2, "__gc" );
+	lua_newtable( L );
+	luaL_setfuncs( L, backgroundjobs_methods, 0 );
+	lua_setfield( L, -2, "__index" );
+	lua_pop( L, 1 );
+}
+
 
 luaL_Reg clib[] = {
 	{	"sleep",		clib_sleep },
 	{	"time",			clib_time },
 	{	"dijkstraMap",		clib_dijkstramap },
+	{	"dijkstraMaps",		clib_dijkstramaps },
+	{	"sightMap",		clib_sightmap },
+	{	"startJobs",		clib_startjobs },
+	{	"defineTile",		clib_definetile },
+	{	"defineCostProfile",	clib_definecostprofile },
+	{	"newMapLayers",		clib_newmaplayers },
+	{	"planMoves",		clib_planmoves },
+	{	"propagateNoise",	clib_propagatenoise },
+	{	"countNeighbours",	clib_countneighbours },
+	{	"dilate",		clib_dilate },
+	{	"erode",		clib_erode },
+	{	"spreadTiles",		clib_spreadtiles },
+	{	"floodFill",		clib_floodfill },
+	{	"findRegions",		clib_findregions },
+	{	"routeCorridors",	clib_routecorridors },
+	{	"generateBSP",		clib_generatebsp },
+	{	"defineFire",		clib_definefire },
+	{	"newTimingWheel",	clib_newtimingwheel },
+	{	"pathCacheStats",	clib_pathcachestats },
+	{	"explorePath",		clib_explorepath },
+	{	"travelInterrupted",	clib_travelinterrupted },
+	{	"traceVolley",		clib_tracevolley },
+	{	"areaOfEffect",		clib_areaofeffect },
+	{	"newCombatLog",		clib_newcombatlog },
+	{	"snapshot",		clib_snapshot },
 	{	NULL,			NULL }
 };
 
@@ -726,6 +1454,12 @@ int main( int argc, char **argv )
 	#endif
 
 	init_constants( L );
+	MapLayers_init_metatable( L );
+	TimingWheel_init_metatable( L );
+	CombatLog_init_metatable( L );
+	Snapshot_init_metatable( L );
+	init_backgroundjobs_metatable( L );
+	init_pathbatch_metatable( L );
 	log_printf("Registered C libraries.");
 
 	/* Set ctrl-C handler, portably */
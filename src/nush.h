@@ -14,6 +14,8 @@
 /*	Lua 5.1 doesn't have lua_rawlen(), but instead lua_objlen() */
 #if LUA_VERSION_NUM < 502
 	#define lua_rawlen lua_objlen
+	/* Only supports nup == 0 */
+	#define luaL_setfuncs(L, l, nup) luaL_register(L, NULL, l)
 #endif
 
 /* In nush.c */
@@ -26,6 +28,9 @@ extern void log_printf( char *fmt, ... ) __attribute__((format (printf, 1, 2)));
 /* Type used to store distances and values in LuaMap and Dijkstra and A* */
 typedef float disttype;
 
+/* Cost of an impassable tile */
+#define IMPASSABLE_COST 999999
+
 /* A 2D array of int read from/written to a 2D grid of Tiles */
 typedef struct {
 	int tiles_index;/* index in lua stack of the table which is the Tiles grid */
@@ -43,9 +48,303 @@ LuaMap *LuaMap_from_table(int tiles_index, int attr_index, int w, int h, disttyp
 void LuaMap_free(LuaMap *map);
 void LuaMap_push(LuaMap *map);
 disttype LuaMap_read(LuaMap *map, int x, int y);
+void LuaMap_load_all(LuaMap *map);
 void LuaMap_write(LuaMap *map, int x, int y, disttype value);
 
+/* One goal of a Dijkstra map given as a list */
+typedef struct {
+	int x, y;
+	disttype cost;
+} PathGoal;
+
 LuaMap *single_source_dijkstra_map(LuaMap *costmap, int x, int y, disttype maxcost);
 void multiple_source_dijkstra_map(LuaMap *costmap, LuaMap *distmap, disttype maxcost);
+LuaMap *goal_list_dijkstra_map(LuaMap *costmap, PathGoal *goals, int num_goals,
+			       disttype maxcost, int *labels);
+
+/* A Dijkstra map to compute, possibly on a worker thread */
+typedef struct {
+	LuaMap *costmap;  /* fully loaded; only read, may be shared */
+	LuaMap *distmap;  /* fully loaded goals for multiple source, or NULL
+	                     for single source. Holds the result when done */
+	int x, y;         /* goal if single source */
+	PathGoal *goals;  /* if not NULL, the goals are instead this list */
+	int num_goals;
+	int want_labels;  /* if true (with a goal list), fill in labels */
+	int *labels;      /* [w*h] index of the nearest goal in the list */
+	int sparse;       /* if true, the result is pushed as a list of tiles */
+	disttype maxcost;
+	int rescale;      /* if true, rescale the result and search again */
+	disttype rescale_mul, rescale_add;
+	/* For a desire map, the fully loaded maps whose weighted sum gives the
+	   goals (instead of distmap or x, y); freed when run */
+	int num_sources;
+	LuaMap **sources;
+	disttype *weights;
+	disttype *source_maxcosts;
+} PathRequest;
+
+void PathRequest_run(void *req);
+void PathRequest_free(PathRequest *req);
+
+int route_corridor(const disttype *costs, int w, int h, int x1, int y1, int x2, int y2,
+		   disttype turn_cost, int *path);
+
+
+/* In sight.c */
+
+/* A sight map to compute, possibly on a worker thread */
+typedef struct {
+	const unsigned char *opacity;  /* [w*h] grid, nonzero if opaque; only read */
+	int w, h;
+	int x, y;        /* origin */
+	int range;       /* sight range in tiles */
+	unsigned char *visible;  /* [w*h] result, allocated when run */
+} SightRequest;
+
+void SightRequest_run(void *req);
+
+
+/* In jobs.c */
+
+typedef void (*JobFunc)(void *arg);
+
+/* A set of independent jobs, each a call of func on one of args */
+typedef struct JobBatch {
+	JobFunc func;
+	void **args;
+	int num_jobs;
+	/* Internal */
+	int next;      /* index of the next job to be handed out */
+	int finished;  /* number of jobs completed */
+	struct JobBatch *queue_next;
+} JobBatch;
+
+void JobBatch_submit(JobBatch *batch);
+void JobBatch_wait(JobBatch *batch);
+void JobBatch_run(JobBatch *batch);
+void JobBatch_cancel(JobBatch *batch);
+int jobs_num_workers();
+
+/* In layers.c */
+
+#define MAX_TILE_TYPES 256
+#define MAX_TERRAIN_TYPES 32
+#define MAX_COST_PROFILES 16
+
+/* A change to one tile of a MapLayers, in its journal */
+typedef struct {
+	int idx;
+	unsigned char old_id, new_id;          /* Tile.ids */
+	unsigned char old_opaque, new_opaque;  /* whether it blocked sight */
+} TileChange;
+
+/* How many changes the journal of a MapLayers holds */
+#define JOURNAL_SIZE 1024
+
+/* Native grids belonging to a Map */
+typedef struct {
+	int w, h;
+	unsigned char *tile_ids;  /* Tile.id of each tile */
+	int *occupants;           /* Actor._id of the actor on each tile, or 0 */
+	/* Index of the free tiles (placeable and unoccupied), in no order */
+	int *free_tiles;          /* [num_free] tile indices */
+	int *free_pos;            /* where each tile is in free_tiles, or -1 */
+	int num_free;
+	/* Summed-area table of the tiles which aren't blank (the tile type the
+	   layers were created with): [w+1][h+1], the number of such tiles in
+	   the rectangle from 1,1 to x,y. NULL until used; rebuilt when used
+	   after a tile changes */
+	int blank_id;
+	int *filled_sum;
+	int filled_sum_valid;
+	/* Cost layer for each cost profile, or NULL if not used yet */
+	disttype *costs[MAX_COST_PROFILES];
+	int costs_version[MAX_COST_PROFILES];
+	struct ScentLayer *scent; /* NULL until scent is first used */
+	struct HazardLayer *hazards; /* NULL until something burns */
+	/* Journal of the last JOURNAL_SIZE changes to single tiles, a ring
+	   indexed by (epoch - 1) % JOURNAL_SIZE. 'epoch' counts every change;
+	   changes to every tile at once (MapLayers_tiles_changed()) aren't
+	   journaled, but set 'reset_epoch' so that nothing made before them
+	   can be checked against the journal */
+	TileChange *journal;
+	long epoch, reset_epoch;
+	long id;                  /* unique to each MapLayers ever made */
+} MapLayers;
+
+/* Index of a tile in a MapLayers grid */
+#define LAYERS_INDEX(layers, x, y) (((x) - 1) + ((y) - 1) * (layers)->w)
+
+int tile_registry_version(void);
+int cost_profile_index(const char *name);
+int check_cost_profile(lua_State *L, int arg);
+disttype *MapLayers_costs(MapLayers *layers, int profile);
+LuaMap *MapLayers_costmap(MapLayers *layers, int profile);
+unsigned char *MapLayers_opacity(MapLayers *layers);
+LuaMap *MapLayers_terrain_goals(lua_State *L, MapLayers *layers, const char *terrain, disttype maxcost);
+void MapLayers_tiles_changed(MapLayers *layers);
+void MapLayers_set_tile(MapLayers *layers, int x, int y, int id);
+int MapLayers_opaque(MapLayers *layers, int idx);
+void MapLayers_journal(MapLayers *layers, int idx, int old_id, int old_opaque);
+int MapLayers_count_filled(MapLayers *layers, int x, int y, int w, int h);
+MapLayers *MapLayers_check(lua_State *L, int arg);
+int MapLayers_is(lua_State *L, int index);
+MapLayers *MapLayers_clone(const MapLayers *from);
+void MapLayers_push_clone(lua_State *L, const MapLayers *from);
+void MapLayers_free(MapLayers *layers);
+void MapLayers_init_metatable(lua_State *L);
+
+int check_tile_id(lua_State *L, int arg);
+void check_tile_set(lua_State *L, int arg, unsigned char *set);
+
+int clib_definetile(lua_State *L);
+int clib_definecostprofile(lua_State *L);
+int clib_newmaplayers(lua_State *L);
+
+
+/* In pathcache.c */
+
+/* What a Dijkstra map in the cache was computed from: a hash of everything,
+   and the fields and goals, all compared too so that a hash collision can't
+   hand back the wrong map */
+typedef struct {
+	unsigned long long hash;  /* 0 if the key isn't in use */
+	long layers_id, epoch;
+	int registry, profile;
+	disttype maxcost;
+	int kind;                 /* which kind of goals the request has */
+	int x, y;                 /* the single goal, or the number of goals or
+	                             maps combined */
+	int want_labels, rescale;
+	disttype rescale_mul, rescale_add;
+	void *goal_data;          /* copy of the goal list, grid or combined
+	                             maps and weights, or NULL */
+	size_t goal_size;
+} PathCacheKey;
+
+void PathCache_key(PathCacheKey *key, PathRequest *req, MapLayers *layers, int profile, int registry);
+void PathCacheKey_free(PathCacheKey *key);
+int PathCache_lookup(const PathCacheKey *key, PathRequest *req);
+void PathCache_store(const PathCacheKey *key, PathRequest *req);
+int clib_pathcachestats(lua_State *L);
+
+
+/* In grid.c */
+
+typedef unsigned long long RandomState;
+
+RandomState check_random_seed(lua_State *L, int arg);
+double random_double(RandomState *state);
+int random_int(RandomState *state, int lo, int hi);
+int check_tile_weights(lua_State *L, int arg, int *ids, double *weights);
+int random_tile(RandomState *state, int num, const int *ids, const double *weights, double total);
+
+int clib_countneighbours(lua_State *L);
+int clib_dilate(lua_State *L);
+int clib_erode(lua_State *L);
+int clib_spreadtiles(lua_State *L);
+int clib_floodfill(lua_State *L);
+
+
+/* In corridors.c */
+
+int clib_routecorridors(lua_State *L);
+
+
+/* In bsp.c */
+
+int clib_generatebsp(lua_State *L);
+
+
+/* In regions.c */
+
+int clib_findregions(lua_State *L);
+
+
+/* In crowd.c */
+
+int clib_planmoves(lua_State *L);
+
+
+/* In noise.c */
+
+int clib_propagatenoise(lua_State *L);
+
+
+/* In scent.c */
+
+/* Grids of (w+2)*(h+2) floats, including a border of one tile */
+typedef struct ScentLayer {
+	float *cur;     /* scent on each tile */
+	float *next, *share;   /* work space */
+	/* Per-tile factors for the diffusion: fraction of its scent a tile
+	   keeps, fraction it gives each neighbour, 1 if not a barrier */
+	float *keep, *spread, *open;
+} ScentLayer;
+
+ScentLayer *MapLayers_scent(MapLayers *layers);
+void ScentLayer_free(ScentLayer *scent);
+float MapLayers_get_scent(MapLayers *layers, int x, int y);
+void MapLayers_add_scent(MapLayers *layers, int x, int y, float amount);
+void MapLayers_update_scent(MapLayers *layers, int profile, float decay, float rate);
+
+
+/* In timers.c */
+
+struct TimingWheel;
+
+int clib_newtimingwheel(lua_State *L);
+struct TimingWheel *TimingWheel_test(lua_State *L, int index);
+struct TimingWheel *TimingWheel_clone(const struct TimingWheel *from);
+void TimingWheel_push_clone(lua_State *L, const struct TimingWheel *from);
+void TimingWheel_free(struct TimingWheel *wheel);
+void TimingWheel_init_metatable(lua_State *L);
+
+
+/* In hazards.c */
+
+typedef struct HazardLayer {
+	unsigned char *burn;    /* turns left until the fire on each tile burns
+	                           out, 0 if it burns forever */
+	unsigned char *fuel;    /* Tile.id of what is burning on each tile */
+	unsigned char *smoke;   /* turns left until the smoke on each tile clears */
+	unsigned char *next_ids;   /* work space */
+} HazardLayer;
+
+HazardLayer *MapLayers_hazards(MapLayers *layers);
+void HazardLayer_free(HazardLayer *hazards);
+int MapLayers_smoky(MapLayers *layers, int idx);
+int MapLayers_update_hazards(MapLayers *layers, RandomState *random, int *changed);
+
+int clib_definefire(lua_State *L);
+
+
+/* In explore.c */
+
+int clib_explorepath(lua_State *L);
+int clib_travelinterrupted(lua_State *L);
+
+
+/* In projectiles.c */
+
+int clib_tracevolley(lua_State *L);
+
+
+/* In area.c */
+
+int clib_areaofeffect(lua_State *L);
+
+
+/* In combat.c */
+
+int clib_newcombatlog(lua_State *L);
+void CombatLog_init_metatable(lua_State *L);
+
+
+/* In snapshot.c */
+
+int clib_snapshot(lua_State *L);
+void Snapshot_init_metatable(lua_State *L);
 
 extern lua_State *L;
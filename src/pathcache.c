@@ -0,0 +1,225 @@
+/* -*- c-basic-offset: 8 -*- */
+/* This file contains the cache of Dijkstra maps computed from MapLayers by
+   clib.dijkstraMaps(): the player often goes back and forth between the
+   same few tiles, and monsters ask again and again for maps towards the
+   same places. Each map is keyed by a hash of everything its result depends
+   on: the map (MapLayers.id), the tiles (epoch) and cost profiles
+   (registry version), the cost profile used and the request's goals and
+   options. The hash only finds the entry: every field, and a copy of the
+   goals (the goal list, grid or combined maps), is compared as well, so a
+   collision can't hand back the wrong map. The least recently used map is
+   replaced when the cache is full. */
+
+#include <stdlib.h>
+#include <string.h>
+#include "nush.h"
+
+#define PATH_CACHE_SIZE 32
+
+
+/* Kinds of goals, for PathCacheKey.kind */
+enum { GOAL_LIST = 1, GOAL_SOURCES, GOAL_GRID, GOAL_TILE };
+
+typedef struct {
+	PathCacheKey key;        /* key.hash is 0 if the entry is empty */
+	long last_used;
+	LuaMap *distmap;
+	int *labels;             /* or NULL */
+} PathCacheEntry;
+
+static PathCacheEntry cache[PATH_CACHE_SIZE];
+static long uses = 0;
+static long hits = 0, misses = 0;
+
+/* FNV-1a, on from a hash so far */
+static unsigned long long hash_bytes(unsigned long long hash, const void *data, size_t len)
+{
+	const unsigned char *bytes = data;
+	size_t i;
+	for (i = 0; i < len; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+#define HASH_VALUE(hash, value) hash_bytes((hash), &(value), sizeof(value))
+
+/* Appends to the copy of the goals kept in a key */
+static void add_goal_data(PathCacheKey *key, const void *data, size_t len)
+{
+	key->goal_data = realloc(key->goal_data, key->goal_size + len);
+	memcpy((char *)key->goal_data + key->goal_size, data, len);
+	key->goal_size += len;
+}
+
+/* Fills in the key of a request which has been read but not run, made from
+   a MapLayers with a cost profile; free it with PathCacheKey_free() */
+void PathCache_key(PathCacheKey *key, PathRequest *req, MapLayers *layers, int profile, int registry)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+	int cells = req->costmap->w * req->costmap->h, i;
+
+	memset(key, 0, sizeof(PathCacheKey));
+	key->layers_id = layers->id;
+	key->epoch = layers->epoch;
+	key->registry = registry;
+	key->profile = profile;
+	key->maxcost = req->maxcost;
+	key->want_labels = req->want_labels;
+	key->rescale = req->rescale;
+	if (req->rescale)
+	{
+		key->rescale_mul = req->rescale_mul;
+		key->rescale_add = req->rescale_add;
+	}
+
+	hash = HASH_VALUE(hash, layers->id);
+	hash = HASH_VALUE(hash, layers->epoch);
+	hash = HASH_VALUE(hash, registry);
+	hash = HASH_VALUE(hash, profile);
+	hash = HASH_VALUE(hash, req->maxcost);
+	hash = HASH_VALUE(hash, req->want_labels);
+	hash = HASH_VALUE(hash, req->rescale);
+	if (req->rescale)
+	{
+		hash = HASH_VALUE(hash, req->rescale_mul);
+		hash = HASH_VALUE(hash, req->rescale_add);
+	}
+
+	/* The goals: one of these */
+	if (req->goals)
+	{
+		key->kind = GOAL_LIST;
+		key->x = req->num_goals;
+		add_goal_data(key, req->goals, sizeof(PathGoal) * req->num_goals);
+	}
+	else if (req->num_sources)
+	{
+		key->kind = GOAL_SOURCES;
+		key->x = req->num_sources;
+		for (i = 0; i < req->num_sources; i++)
+		{
+			add_goal_data(key, req->sources[i]->tiles, sizeof(disttype) * cells);
+			add_goal_data(key, &req->weights[i], sizeof(disttype));
+			add_goal_data(key, &req->source_maxcosts[i], sizeof(disttype));
+		}
+	}
+	else if (req->distmap)
+	{
+		key->kind = GOAL_GRID;
+		add_goal_data(key, req->distmap->tiles, sizeof(disttype) * cells);
+	}
+	else
+	{
+		key->kind = GOAL_TILE;
+		key->x = req->x;
+		key->y = req->y;
+		hash = HASH_VALUE(hash, req->x);
+		hash = HASH_VALUE(hash, req->y);
+	}
+	hash = HASH_VALUE(hash, key->kind);
+	if (key->goal_size)
+		hash = hash_bytes(hash, key->goal_data, key->goal_size);
+	key->hash = hash ? hash : 1;
+}
+
+/* Frees the copy of the goals held by a key */
+void PathCacheKey_free(PathCacheKey *key)
+{
+	free(key->goal_data);
+	key->goal_data = NULL;
+	key->goal_size = 0;
+}
+
+/* Returns true if two keys are for the same request */
+static int same_key(const PathCacheKey *a, const PathCacheKey *b)
+{
+	return a->hash == b->hash && a->layers_id == b->layers_id &&
+		a->epoch == b->epoch && a->registry == b->registry &&
+		a->profile == b->profile && a->maxcost == b->maxcost &&
+		a->kind == b->kind && a->x == b->x && a->y == b->y &&
+		a->want_labels == b->want_labels && a->rescale == b->rescale &&
+		a->rescale_mul == b->rescale_mul && a->rescale_add == b->rescale_add &&
+		a->goal_size == b->goal_size &&
+		(!a->goal_size || !memcmp(a->goal_data, b->goal_data, a->goal_size));
+}
+
+static LuaMap *copy_distmap(LuaMap *map)
+{
+	LuaMap *copy = LuaMap_new(map->w, map->h, 0);
+	memcpy(copy->tiles, map->tiles, sizeof(disttype) * (map->w + 1) * (map->h + 1));
+	return copy;
+}
+
+static int *copy_labels(int *labels, int cells)
+{
+	if (!labels)
+		return NULL;
+	int *copy = malloc(sizeof(int) * cells);
+	memcpy(copy, labels, sizeof(int) * cells);
+	return copy;
+}
+
+/* If the result of a request with a key is cached, gives the request a
+   copy of it (as if it had been run, so the goals it was read with are
+   freed) and returns true; otherwise returns false */
+int PathCache_lookup(const PathCacheKey *key, PathRequest *req)
+{
+	int i, s;
+	for (i = 0; i < PATH_CACHE_SIZE; i++)
+	{
+		if (!cache[i].key.hash || !same_key(&cache[i].key, key))
+			continue;
+		cache[i].last_used = ++uses;
+		hits++;
+
+		if (req->distmap)
+			LuaMap_free(req->distmap);
+		for (s = 0; s < req->num_sources; s++)
+			LuaMap_free(req->sources[s]);
+		req->num_sources = 0;
+		req->distmap = copy_distmap(cache[i].distmap);
+		req->labels = copy_labels(cache[i].labels, req->costmap->w * req->costmap->h);
+		return 1;
+	}
+	misses++;
+	return 0;
+}
+
+/* Stores a copy of the result of a request which has been run, replacing
+   the least recently used entry */
+void PathCache_store(const PathCacheKey *key, PathRequest *req)
+{
+	int i, slot = 0;
+	for (i = 0; i < PATH_CACHE_SIZE; i++)
+	{
+		if (cache[i].key.hash && same_key(&cache[i].key, key))
+			return;
+		if (cache[i].last_used < cache[slot].last_used)
+			slot = i;
+	}
+	PathCacheEntry *entry = &cache[slot];
+	if (entry->distmap)
+		LuaMap_free(entry->distmap);
+	free(entry->labels);
+	PathCacheKey_free(&entry->key);
+	entry->key = *key;
+	entry->key.goal_data = NULL;
+	entry->key.goal_size = 0;
+	if (key->goal_size)
+		add_goal_data(&entry->key, key->goal_data, key->goal_size);
+	entry->last_used = ++uses;
+	entry->distmap = copy_distmap(req->distmap);
+	entry->labels = copy_labels(req->labels, req->costmap->w * req->costmap->h);
+}
+
+/* clib.pathCacheStats() - returns the number of Dijkstra maps served from
+   the cache and the number computed, since the game started */
+int clib_pathcachestats(lua_State *L)
+{
+	lua_pushinteger(L, hits);
+	lua_pushinteger(L, misses);
+	return 2;
+}
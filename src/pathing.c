@@ -1,9 +1,10 @@
 /* -*- c-basic-offset: 8 -*- */
-/* This file contains A*, Dijkstra, reading from/writing out 2D grids of Lua
+/* This file contains A* (for routing corridors), Dijkstra, reading from/writing out 2D grids of Lua
    values, and priority queues */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "nush.h"
 
 
@@ -12,6 +13,7 @@ typedef struct {
 	disttype f;   /* sorted by */
 	disttype g;
 	unsigned short x, y;  /* Count from 1! */
+	int label;    /* goal the path came from, for labelled Dijkstra maps */
 } Node;
 
 
@@ -20,9 +22,12 @@ static int lesseq(Node lhs, Node rhs) {
 	return lhs.f <= rhs.f;
 }
 
-void error(const char *msg) {
-	log_printf("%s", msg);
-	luaL_error(L, msg);
+/* For bugs in code which may be run on a worker thread (see jobs.c), where
+   neither Lua nor the log file may be touched */
+static void fatal_error(const char *msg)
+{
+	fprintf(stderr, "nush: %s\n", msg);
+	abort();
 }
 
 
@@ -51,6 +56,7 @@ PQueue *PQueue_new()
 void PQueue_free(PQueue *pq)
 {
 	free(pq->data);
+	free(pq);
 }
 
 int PQueue_size(PQueue *pq)
@@ -65,7 +71,7 @@ int PQueue_size(PQueue *pq)
 Qelem PQueue_pop(PQueue *pq)
 {
 	if (!pq->size)
-		error("pop from empty queue");
+		fatal_error("pop from empty queue");
 
 	Qelem ret = pq->data[0];
 
@@ -155,6 +161,7 @@ LuaMap *LuaMap_from_table(int tiles_index, int attr_index, int w, int h, disttyp
 void LuaMap_free(LuaMap *map)
 {
 	free(map->tiles);
+	free(map);
 }
 
 disttype LuaMap_read(LuaMap *map, int x, int y)
@@ -164,7 +171,7 @@ disttype LuaMap_read(LuaMap *map, int x, int y)
 	if (*tile != LUAMAP_UNCACHED_TILE)
 		return *tile;
 	if (!map->tiles_index)
-		error("LuaMap_read() called on a LuaMap without a table data source");
+		fatal_error("LuaMap_read() called on a LuaMap without a table data source");
 
 	/* Read the value from the map */
 	lua_rawgeti(L, map->tiles_index, x);    /* push tiles[x] */
@@ -181,7 +188,7 @@ disttype LuaMap_read(LuaMap *map, int x, int y)
 	if (type == LUA_TBOOLEAN)               /* tiles[x][y].key */
 	{
 		if (lua_toboolean(L, -1))
-			*tile = 999999;         /* true: impassable */
+			*tile = IMPASSABLE_COST; /* true: impassable */
 		else
 			*tile = 1;              /* cost = 1 for cost maps */
 	}
@@ -194,6 +201,17 @@ disttype LuaMap_read(LuaMap *map, int x, int y)
 	return *tile;
 }
 
+/* Read every tile which hasn't been cached yet, so that afterwards the
+   LuaMap can be used without touching the lua_State (e.g. from a worker
+   thread) */
+void LuaMap_load_all(LuaMap *map)
+{
+	int x, y;
+	for (x = 1; x <= map->w; x++)
+		for (y = 1; y <= map->h; y++)
+			LuaMap_read(map, x, y);
+}
+
 void LuaMap_write(LuaMap *map, int x, int y, disttype value)
 {
 	map->tiles[(x - 1) + (y - 1) * map->w] = value;
@@ -244,6 +262,7 @@ static void dijvisit(PQueue *pq, LuaMap *map, LuaMap *dists, Node parent, int xo
 		Node node;
 		node.f = cost;
 		node.x = x; node.y = y;
+		node.label = parent.label;
 		PQueue_push(pq, node);
 	}
 }
@@ -252,8 +271,10 @@ static void dijvisit(PQueue *pq, LuaMap *map, LuaMap *dists, Node parent, int xo
    costmap: A map giving the cost to step onto each tile.
    distmap: Initially filled with either a large constant (maxcost) if unvisited,
             or a lower value if a goal node.
+   labels:  If not NULL, a [w*h] grid which receives the label of the root
+            each tile was reached from.
  */
-static void compute_dijkstra(PQueue *pq, LuaMap *costmap, LuaMap *distmap)
+static void compute_dijkstra(PQueue *pq, LuaMap *costmap, LuaMap *distmap, int *labels)
 {
 	while (PQueue_size(pq))
 	{
@@ -262,6 +283,8 @@ static void compute_dijkstra(PQueue *pq, LuaMap *costmap, LuaMap *distmap)
 		if (node.f >= LuaMap_read(distmap, node.x, node.y))
 			continue;
 		LuaMap_write(distmap, node.x, node.y, node.f);
+		if (labels)
+			labels[(node.x - 1) + (node.y - 1) * distmap->w] = node.label;
 
 		int xoff, yoff;
 		for (xoff = -1; xoff <= 1; xoff++)
@@ -286,9 +309,10 @@ LuaMap *single_source_dijkstra_map(LuaMap *costmap, int x, int y, disttype maxco
 	Node node;
 	node.f = 0;
 	node.x = x; node.y = y;
+	node.label = 0;
 	PQueue_push(pq, node);
 
-	compute_dijkstra(pq, costmap, distmap);
+	compute_dijkstra(pq, costmap, distmap, NULL);
 	PQueue_free(pq);
 	return distmap;
 }
@@ -313,6 +337,7 @@ void multiple_source_dijkstra_map(LuaMap *costmap, LuaMap *distmap, disttype max
 				Node node;
 				node.f = value;
 				node.x = x; node.y = y;
+				node.label = 0;
 				PQueue_push(pq, node);
 			}
 			/* Write maxcost to this tile even if it's a goal, so
@@ -322,12 +347,244 @@ void multiple_source_dijkstra_map(LuaMap *costmap, LuaMap *distmap, disttype max
 		}
 	}
 
-	log_printf("multiple_source_dijkstra_map: found and pushed %d sources", pq->size);
-	compute_dijkstra(pq, costmap, distmap);
+	compute_dijkstra(pq, costmap, distmap, NULL);
 	PQueue_free(pq);
 	return;
 }
 
+/* Computes a LuaMap giving, for every tile, the minimum over a list of goals
+   of min(maxcost, distance(goal, tile) + cost of goal). If labels is not
+   NULL it's filled in with the 1-based index in the list of the goal each
+   tile is nearest to, or 0 for unreached tiles. */
+LuaMap *goal_list_dijkstra_map(LuaMap *costmap, PathGoal *goals, int num_goals,
+			       disttype maxcost, int *labels)
+{
+	PQueue *pq = PQueue_new();
+	LuaMap *distmap = LuaMap_new(costmap->w, costmap->h, maxcost);
+	int i;
+
+	if (labels)
+		memset(labels, 0, sizeof(int) * costmap->w * costmap->h);
+	for (i = 0; i < num_goals; i++)
+	{
+		if (goals[i].cost < maxcost)
+		{
+			Node node;
+			node.f = goals[i].cost;
+			node.x = goals[i].x; node.y = goals[i].y;
+			node.label = i + 1;
+			PQueue_push(pq, node);
+		}
+	}
+
+	compute_dijkstra(pq, costmap, distmap, labels);
+	PQueue_free(pq);
+	return distmap;
+}
+
+/* Replace every reached distance d in distmap with mul * d + add, then use
+   the results as goals for another multiple-source pass. With a negative
+   'mul' this turns a map towards a goal into a map for fleeing from it. */
+static void rescale_dijkstra_map(LuaMap *costmap, LuaMap *distmap, disttype maxcost,
+				 disttype mul, disttype add)
+{
+	int i;
+	for (i = 0; i < distmap->w * distmap->h; i++)
+	{
+		if (distmap->tiles[i] < maxcost)
+			distmap->tiles[i] = mul * distmap->tiles[i] + add;
+	}
+	multiple_source_dijkstra_map(costmap, distmap, maxcost);
+}
+
+/* Makes the goals of a desire map: the weighted sum of the source maps of a
+   PathRequest. A tile is only a goal if it's passable and was reached in
+   every source with a positive weight (there's no point going towards a
+   goal which can't be reached); unreached tiles in the other sources count
+   as that source's maxcost (as far away as it looks). Frees the sources. */
+static LuaMap *combine_sources(PathRequest *req)
+{
+	LuaMap *goals = LuaMap_new(req->costmap->w, req->costmap->h, req->maxcost);
+	int num = req->costmap->w * req->costmap->h;
+	int i, s;
+
+	for (i = 0; i < num; i++)
+	{
+		if (req->costmap->tiles[i] >= IMPASSABLE_COST)
+			continue;
+		disttype sum = 0;
+		for (s = 0; s < req->num_sources; s++)
+		{
+			disttype value = req->sources[s]->tiles[i];
+			if (value >= req->source_maxcosts[s])
+			{
+				if (req->weights[s] > 0)
+					break;
+				value = req->source_maxcosts[s];
+			}
+			sum += req->weights[s] * value;
+		}
+		if (s == req->num_sources && sum < req->maxcost)
+			goals->tiles[i] = sum;
+	}
+
+	for (s = 0; s < req->num_sources; s++)
+		LuaMap_free(req->sources[s]);
+	req->num_sources = 0;
+	return goals;
+}
+
+/******************************** Path requests ******************************/
+
+
+/* Computes the Dijkstra map described by a PathRequest, leaving it in
+   req->distmap. Never calls into Lua, so it can be run on a worker thread as
+   long as req->costmap and the goals in req->distmap (or the sources) were
+   fully loaded beforehand. costmap is only read, so may be shared between
+   requests. */
+void PathRequest_run(void *arg)
+{
+	PathRequest *req = arg;
+
+	if (req->num_sources)
+		req->distmap = combine_sources(req);
+
+	if (req->goals)
+	{
+		if (req->want_labels)
+			req->labels = malloc(sizeof(int) * req->costmap->w * req->costmap->h);
+		req->distmap = goal_list_dijkstra_map(req->costmap, req->goals, req->num_goals,
+						      req->maxcost, req->labels);
+	}
+	else if (req->distmap)
+		multiple_source_dijkstra_map(req->costmap, req->distmap, req->maxcost);
+	else
+		req->distmap = single_source_dijkstra_map(req->costmap, req->x, req->y, req->maxcost);
+
+	if (req->rescale)
+		rescale_dijkstra_map(req->costmap, req->distmap, req->maxcost,
+				     req->rescale_mul, req->rescale_add);
+}
+
+/* Frees the result and anything else held by a PathRequest, whether or not
+   it has been run */
+void PathRequest_free(PathRequest *req)
+{
+	int s;
+	for (s = 0; s < req->num_sources; s++)
+		LuaMap_free(req->sources[s]);
+	free(req->sources);
+	free(req->weights);
+	free(req->source_maxcosts);
+	free(req->goals);
+	free(req->labels);
+	if (req->distmap)
+		LuaMap_free(req->distmap);
+	req->num_sources = 0;
+	req->sources = NULL;
+	req->weights = req->source_maxcosts = NULL;
+	req->num_goals = 0;
+	req->goals = NULL;
+	req->labels = NULL;
+	req->distmap = NULL;
+}
+
+/******************************* Corridor routing ****************************/
+
+
+/* Orthogonal directions of corridors */
+static const int route_dx[4] = { 1, 0, -1, 0 };
+static const int route_dy[4] = { 0, 1, 0, -1 };
+
+/* Finds the cheapest orthogonal route from x1,y1 to x2,y2 with A*, where
+   stepping onto a tile costs costs[tile index] (tiles costing
+   IMPASSABLE_COST or more can't be used) and each change of direction
+   costs turn_cost more. The search is over (tile, direction) states so
+   that turns can be counted. Writes the tile indices of the route, start
+   and end included, to path ([w*h*4]), and returns its length, or 0 if
+   there is no route. */
+int route_corridor(const disttype *costs, int w, int h, int x1, int y1, int x2, int y2,
+		   disttype turn_cost, int *path)
+{
+	int num_states = w * h * 4, i, dir;
+	disttype *best = malloc(sizeof(disttype) * num_states);
+	int *came_from = malloc(sizeof(int) * num_states);
+	for (i = 0; i < num_states; i++)
+		best[i] = IMPASSABLE_COST;
+
+	/* The heuristic is the distance times the cheapest step, so that A*
+	   still finds the cheapest route */
+	disttype min_cost = IMPASSABLE_COST;
+	for (i = 0; i < w * h; i++)
+	{
+		if (costs[i] < min_cost)
+			min_cost = costs[i];
+	}
+
+	PQueue *pq = PQueue_new();
+	Node node;
+	for (dir = 0; dir < 4; dir++)
+	{
+		node.g = 0;
+		node.f = (abs(x2 - x1) + abs(y2 - y1)) * min_cost;
+		node.x = x1; node.y = y1;
+		node.label = dir;
+		PQueue_push(pq, node);
+		best[((x1 - 1) + (y1 - 1) * w) * 4 + dir] = 0;
+		came_from[((x1 - 1) + (y1 - 1) * w) * 4 + dir] = -1;
+	}
+
+	int found = -1;
+	while (PQueue_size(pq))
+	{
+		node = PQueue_pop(pq);
+		int state = ((node.x - 1) + (node.y - 1) * w) * 4 + node.label;
+		/* Skip if a cheaper way here was found after this was pushed */
+		if (node.g > best[state])
+			continue;
+		if (node.x == x2 && node.y == y2)
+		{
+			found = state;
+			break;
+		}
+
+		for (dir = 0; dir < 4; dir++)
+		{
+			int x = node.x + route_dx[dir], y = node.y + route_dy[dir];
+			if (x < 1 || x > w || y < 1 || y > h)
+				continue;
+			disttype step = costs[(x - 1) + (y - 1) * w];
+			if (step >= IMPASSABLE_COST)
+				continue;
+			disttype g = node.g + step + (dir != node.label ? turn_cost : 0);
+			int next = ((x - 1) + (y - 1) * w) * 4 + dir;
+			if (g < best[next])
+			{
+				Node child;
+				best[next] = g;
+				came_from[next] = state;
+				child.g = g;
+				child.f = g + (abs(x2 - x) + abs(y2 - y)) * min_cost;
+				child.x = x; child.y = y;
+				child.label = dir;
+				PQueue_push(pq, child);
+			}
+		}
+	}
+	PQueue_free(pq);
+
+	int len = 0;
+	for (i = found; i >= 0; i = came_from[i])
+		len++;
+	int pos = len;
+	for (i = found; i >= 0; i = came_from[i])
+		path[--pos] = i / 4;
+
+	free(best);
+	free(came_from);
+	return len;
+}
+
 /*********************************** Testing *********************************/
 
 /*
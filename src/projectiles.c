@@ -0,0 +1,182 @@
+/* -*- c-basic-offset: 8 -*- */
+/* This file contains the projectile tracer: the flight of every projectile
+   of a volley (e.g. the pellets of a shotgun blast) is worked out at once,
+   tile by tile from the centre of the shooter's tile in any direction, using
+   a cost profile to tell which tiles stop projectiles and the occupancy
+   layer to find the actors in the way. Whether each actor is hit is rolled
+   here too, since that decides whether the projectile flies on. */
+
+#include <stdlib.h>
+#include <math.h>
+#include "nush.h"
+
+
+/* A growable flat list of ints */
+typedef struct {
+	int *ints;
+	int num, max;
+} IntList;
+
+static void push_int(IntList *list, int value)
+{
+	if (list->num == list->max)
+	{
+		list->max = list->max ? list->max * 2 : 64;
+		list->ints = realloc(list->ints, sizeof(int) * list->max);
+	}
+	list->ints[list->num++] = value;
+}
+
+static void push_int_list(lua_State *L, IntList *list)
+{
+	int i;
+	lua_createtable(L, list->num, 0);
+	for (i = 0; i < list->num; i++)
+	{
+		lua_pushinteger(L, list->ints[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+}
+
+/* Returns a number field of the table at the top of the stack */
+static double number_field(lua_State *L, const char *name, double def)
+{
+	lua_getfield(L, -1, name);
+	double ret = lua_isnil(L, -1) ? def : lua_tonumber(L, -1);
+	lua_pop(L, 1);
+	return ret;
+}
+
+/* Traces one projectile from the centre of x, y in the direction dx, dy,
+   stepping to the next column or row (whichever is further) each time,
+   appending the tiles it crosses to 'path' and what it runs into to
+   'events' */
+static void trace_projectile(MapLayers *layers, const disttype *costs, RandomState *random,
+			     int num, int x, int y, double dx, double dy, int range,
+			     double accuracy, int penetration, IntList *path, IntList *events)
+{
+	double longest = fmax(fabs(dx), fabs(dy));
+	double curx = x + 0.5, cury = y + 0.5;
+	int step;
+	if (longest == 0)
+		return;
+	dx /= longest;
+	dy /= longest;
+
+	for (step = 1; step <= range; step++)
+	{
+		curx += dx;
+		cury += dy;
+		x = floor(curx);
+		y = floor(cury);
+		if (x < 1 || x > layers->w || y < 1 || y > layers->h)
+			break;
+		push_int(path, x);
+		push_int(path, y);
+
+		int idx = LAYERS_INDEX(layers, x, y), stop = 0;
+		if (layers->occupants[idx])
+		{
+			int hit = random_double(random) < accuracy;
+			push_int(events, num);
+			push_int(events, step);
+			push_int(events, x);
+			push_int(events, y);
+			push_int(events, layers->occupants[idx]);
+			push_int(events, hit);
+			/* misses fly past */
+			stop = hit && penetration-- <= 0;
+		}
+		if (!stop && costs[idx] >= IMPASSABLE_COST)
+		{
+			push_int(events, num);
+			push_int(events, step);
+			push_int(events, x);
+			push_int(events, y);
+			push_int(events, 0);
+			push_int(events, 1);
+			stop = 1;
+		}
+		if (stop)
+			break;
+	}
+}
+
+/* clib.traceVolley(layers, profile, x, y, shots, seed) - fires a volley from
+   x, y. Each of the list 'shots' is a table with:
+     dx, dy - the direction, any vector (not only the 8 directions)
+     range - how many tiles the projectiles fly, at most
+     accuracy - the chance (0 to 1) of hitting each actor in the way
+     pellets - how many projectiles (default 1)
+     spread - the angle in radians (default 0) over which the pellets are
+              scattered at random around dx, dy
+     penetration - how many actors each projectile can hit and fly on past
+                   (default 0)
+   Projectiles stop at the first tile which is impassable in the cost
+   profile 'profile'. 'seed' is an integer (e.g. from math.random()).
+   Returns a list of the paths of the projectiles, each a flat list
+   {x, y, x, y, ...} of the tiles it flew through (including the one it
+   stopped at), and a flat list of the events, {projectile, step, x, y, id,
+   hit, ...}: 'projectile' is the index of its path, 'step' the index in the
+   path where it happened; 'id' is the Actor._id of the actor in the way and
+   'hit' 1 if it was hit, 0 if missed, or 'id' is 0 if the projectile hit
+   the tile. The events of each projectile are in order */
+int clib_tracevolley(lua_State *L)
+{
+	MapLayers *layers = MapLayers_check(L, 1);
+	int profile = check_cost_profile(L, 2);
+	int x = luaL_checkinteger(L, 3);
+	int y = luaL_checkinteger(L, 4);
+	luaL_checktype(L, 5, LUA_TTABLE);
+	RandomState random = check_random_seed(L, 6);
+	if (x < 1 || x > layers->w || y < 1 || y > layers->h)
+		luaL_error(L, "position %d,%d is out of bounds", x, y);
+	disttype *costs = MapLayers_costs(layers, profile);
+
+	/* Check every shot before anything is allocated, which would leak if
+	   an error were raised */
+	int num_shots = lua_rawlen(L, 5), i, p, num = 0;
+	for (i = 1; i <= num_shots; i++)
+	{
+		lua_rawgeti(L, 5, i);
+		luaL_checktype(L, -1, LUA_TTABLE);
+		lua_pop(L, 1);
+	}
+
+	IntList events = { NULL, 0, 0 };
+	lua_newtable(L);
+	int paths_index = lua_gettop(L);
+	for (i = 1; i <= num_shots; i++)
+	{
+		lua_rawgeti(L, 5, i);
+		double dx = number_field(L, "dx", 0);
+		double dy = number_field(L, "dy", 0);
+		int range = number_field(L, "range", 0);
+		double accuracy = number_field(L, "accuracy", 1);
+		int pellets = number_field(L, "pellets", 1);
+		double spread = number_field(L, "spread", 0);
+		int penetration = number_field(L, "penetration", 0);
+		lua_pop(L, 1);
+
+		for (p = 0; p < pellets; p++)
+		{
+			double pdx = dx, pdy = dy;
+			if (spread)
+			{
+				double angle = atan2(dy, dx) + (random_double(&random) - 0.5) * spread;
+				pdx = cos(angle);
+				pdy = sin(angle);
+			}
+			IntList path = { NULL, 0, 0 };
+			num++;
+			trace_projectile(layers, costs, &random, num, x, y, pdx, pdy, range,
+					 accuracy, penetration, &path, &events);
+			push_int_list(L, &path);
+			lua_rawseti(L, paths_index, num);
+			free(path.ints);
+		}
+	}
+	push_int_list(L, &events);
+	free(events.ints);
+	return 2;
+}
@@ -0,0 +1,176 @@
+/* -*- c-basic-offset: 8 -*- */
+/* This file contains connectivity analysis of a map: labelling the regions
+   of tiles which can be walked between (by a cost profile, moving in 8
+   directions) in one sweep with union-find, and finding the impassable
+   tiles which would join two regions if they were dug out. */
+
+#include <stdlib.h>
+#include "nush.h"
+
+
+/* Returns the root of the set containing tile idx, halving the path */
+static int find_root(int *parent, int idx)
+{
+	while (parent[idx] != idx)
+	{
+		parent[idx] = parent[parent[idx]];
+		idx = parent[idx];
+	}
+	return idx;
+}
+
+static void join(int *parent, int a, int b)
+{
+	a = find_root(parent, a);
+	b = find_root(parent, b);
+	/* Keep the earliest tile as the root */
+	if (a < b)
+		parent[b] = a;
+	else if (b < a)
+		parent[a] = b;
+}
+
+/* Region sizes, for sorting regions biggest first */
+static int *sort_sizes;
+static int compare_regions(const void *a, const void *b)
+{
+	int sa = sort_sizes[*(const int *)a], sb = sort_sizes[*(const int *)b];
+	if (sa != sb)
+		return sb - sa;
+	return *(const int *)a - *(const int *)b;
+}
+
+/* clib.findRegions(layers, profile) - finds the regions of a map: sets of
+   tiles which are passable for the cost profile and connected to each other
+   (diagonally too). Returns a table with:
+     labels - 2D grid of the region of each tile, 0 if impassable
+     sizes - list of the number of tiles in each region; regions are numbered
+             biggest first, so region 1 is the main one
+     bridges - list of {x = x, y = y, a = a, b = b}: impassable tiles next to
+               both region a and region b (a < b, the two lowest numbered
+               neighbouring regions), which would join them if dug out */
+int clib_findregions(lua_State *L)
+{
+	MapLayers *layers = MapLayers_check(L, 1);
+	int profile = check_cost_profile(L, 2);
+	disttype *costs = MapLayers_costs(layers, profile);
+	int w = layers->w, h = layers->h, size = w * h;
+	int x, y, i, dx, dy;
+
+	/* Union each passable tile with the passable tiles before it */
+	int *parent = malloc(sizeof(int) * size);
+	for (y = 1; y <= h; y++)
+	{
+		for (x = 1; x <= w; x++)
+		{
+			int idx = LAYERS_INDEX(layers, x, y);
+			parent[idx] = idx;
+			if (costs[idx] >= IMPASSABLE_COST)
+				continue;
+			if (x > 1 && costs[idx - 1] < IMPASSABLE_COST)
+				join(parent, idx, idx - 1);
+			if (y == 1)
+				continue;
+			for (dx = -1; dx <= 1; dx++)
+			{
+				if (x + dx >= 1 && x + dx <= w && costs[idx - w + dx] < IMPASSABLE_COST)
+					join(parent, idx, idx - w + dx);
+			}
+		}
+	}
+
+	/* Number the regions in order of their roots, then biggest first */
+	int *labels = calloc(size, sizeof(int));
+	int *sizes = calloc(size + 1, sizeof(int));
+	int num_regions = 0;
+	for (i = 0; i < size; i++)
+	{
+		if (costs[i] >= IMPASSABLE_COST)
+			continue;
+		int root = find_root(parent, i);
+		if (root == i)
+			labels[i] = ++num_regions;
+		else
+			labels[i] = labels[root];
+		sizes[labels[i]]++;
+	}
+
+	int *order = malloc(sizeof(int) * (num_regions + 1));
+	int *renumber = malloc(sizeof(int) * (num_regions + 1));
+	for (i = 0; i < num_regions; i++)
+		order[i] = i + 1;
+	sort_sizes = sizes;
+	qsort(order, num_regions, sizeof(int), compare_regions);
+	renumber[0] = 0;
+	for (i = 0; i < num_regions; i++)
+		renumber[order[i]] = i + 1;
+	for (i = 0; i < size; i++)
+		labels[i] = renumber[labels[i]];
+
+	lua_createtable(L, 0, 3);
+
+	LuaMap *map = LuaMap_new(w, h, 0);
+	for (i = 0; i < size; i++)
+		map->tiles[i] = labels[i];
+	LuaMap_push(map);
+	LuaMap_free(map);
+	lua_setfield(L, -2, "labels");
+
+	lua_createtable(L, num_regions, 0);
+	for (i = 0; i < num_regions; i++)
+	{
+		lua_pushinteger(L, sizes[order[i]]);
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_setfield(L, -2, "sizes");
+
+	lua_newtable(L);
+	int num_bridges = 0;
+	for (y = 1; y <= h; y++)
+	{
+		for (x = 1; x <= w; x++)
+		{
+			if (labels[LAYERS_INDEX(layers, x, y)])
+				continue;
+			int a = 0, b = 0;
+			for (dy = -1; dy <= 1; dy++)
+			{
+				for (dx = -1; dx <= 1; dx++)
+				{
+					if (x + dx < 1 || x + dx > w || y + dy < 1 || y + dy > h)
+						continue;
+					int label = labels[LAYERS_INDEX(layers, x + dx, y + dy)];
+					if (!label || label == a || label == b)
+						continue;
+					if (!a || label < a)
+					{
+						b = a;
+						a = label;
+					}
+					else if (!b || label < b)
+						b = label;
+				}
+			}
+			if (!b)
+				continue;
+			lua_createtable(L, 0, 4);
+			lua_pushinteger(L, x);
+			lua_setfield(L, -2, "x");
+			lua_pushinteger(L, y);
+			lua_setfield(L, -2, "y");
+			lua_pushinteger(L, a);
+			lua_setfield(L, -2, "a");
+			lua_pushinteger(L, b);
+			lua_setfield(L, -2, "b");
+			lua_rawseti(L, -2, ++num_bridges);
+		}
+	}
+	lua_setfield(L, -2, "bridges");
+
+	free(parent);
+	free(labels);
+	free(sizes);
+	free(order);
+	free(renumber);
+	return 1;
+}
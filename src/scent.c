@@ -0,0 +1,158 @@
+/* -*- c-basic-offset: 8 -*- */
+/* This file contains the scent layer of a map: scent is left behind (by the
+   player), and each turn it fades and spreads to neighbouring tiles, but
+   not into or through tiles which are impassable for a cost profile (walls,
+   closed doors). */
+
+#include <stdlib.h>
+#include <string.h>
+#include "nush.h"
+
+
+/* Four floats, processed at once by the vector unit if there is one (GCC
+   vector extension; otherwise the compiler splits them up) */
+typedef float v4f __attribute__((vector_size(16)));
+
+static inline v4f load4(const float *p)
+{
+	v4f v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline void store4(float *p, v4f v)
+{
+	memcpy(p, &v, sizeof(v));
+}
+
+/* Index of a tile in the scent grids, which have a border of one tile */
+#define SCENT_INDEX(layers, x, y) ((x) + (y) * ((layers)->w + 2))
+
+/* Returns the scent layer of a map, creating it (without scent) if needed */
+ScentLayer *MapLayers_scent(MapLayers *layers)
+{
+	if (!layers->scent)
+	{
+		int size = (layers->w + 2) * (layers->h + 2);
+		ScentLayer *scent = malloc(sizeof(ScentLayer));
+		scent->cur = calloc(size, sizeof(float));
+		scent->next = calloc(size, sizeof(float));
+		scent->share = calloc(size, sizeof(float));
+		scent->keep = calloc(size, sizeof(float));
+		scent->spread = calloc(size, sizeof(float));
+		scent->open = calloc(size, sizeof(float));
+		layers->scent = scent;
+	}
+	return layers->scent;
+}
+
+void ScentLayer_free(ScentLayer *scent)
+{
+	if (!scent)
+		return;
+	free(scent->cur);
+	free(scent->next);
+	free(scent->share);
+	free(scent->keep);
+	free(scent->spread);
+	free(scent->open);
+	free(scent);
+}
+
+/* Returns the scent on a tile */
+float MapLayers_get_scent(MapLayers *layers, int x, int y)
+{
+	if (!layers->scent)
+		return 0;
+	return layers->scent->cur[SCENT_INDEX(layers, x, y)];
+}
+
+void MapLayers_add_scent(MapLayers *layers, int x, int y, float amount)
+{
+	MapLayers_scent(layers)->cur[SCENT_INDEX(layers, x, y)] += amount;
+}
+
+/* Work out from the cost layer how much of its scent each tile keeps and
+   how much it gives to each neighbour: barriers have none, and the rest
+   share what spreads out of them equally between their open neighbours */
+static void scent_factors(MapLayers *layers, ScentLayer *scent, disttype *costs,
+			  float decay, float rate)
+{
+	int x, y;
+	for (y = 1; y <= layers->h; y++)
+	{
+		for (x = 1; x <= layers->w; x++)
+		{
+			int i = SCENT_INDEX(layers, x, y);
+			int open = 0;
+			if (costs[LAYERS_INDEX(layers, x, y)] < IMPASSABLE_COST)
+			{
+				open += x > 1 && costs[LAYERS_INDEX(layers, x - 1, y)] < IMPASSABLE_COST;
+				open += x < layers->w && costs[LAYERS_INDEX(layers, x + 1, y)] < IMPASSABLE_COST;
+				open += y > 1 && costs[LAYERS_INDEX(layers, x, y - 1)] < IMPASSABLE_COST;
+				open += y < layers->h && costs[LAYERS_INDEX(layers, x, y + 1)] < IMPASSABLE_COST;
+				scent->keep[i] = open ? decay * (1 - rate) : decay;
+				scent->spread[i] = open ? decay * rate / open : 0;
+				scent->open[i] = 1;
+			}
+			else
+			{
+				scent->keep[i] = 0;
+				scent->spread[i] = 0;
+				scent->open[i] = 0;
+			}
+		}
+	}
+}
+
+/* Advances the scent one turn: all of it fades by 'decay', and each tile
+   hands a fraction 'rate' of its scent out equally to its open neighbours.
+   Tiles which are impassable for the cost profile are barriers with no
+   scent, so none is lost except by fading */
+void MapLayers_update_scent(MapLayers *layers, int profile, float decay, float rate)
+{
+	ScentLayer *scent = MapLayers_scent(layers);
+	scent_factors(layers, scent, MapLayers_costs(layers, profile), decay, rate);
+
+	/* One row at a time, four tiles at a time: first what each tile gives
+	   to each neighbour, then what each open tile ends up with. Barriers
+	   and the border give nothing, so neighbours can be summed blindly */
+	int stride = layers->w + 2, x, y;
+	const float *cur = scent->cur, *share = scent->share;
+	for (y = 1; y <= layers->h; y++)
+	{
+		int row = y * stride;
+		for (x = 1; x + 3 <= layers->w; x += 4)
+		{
+			int i = row + x;
+			store4(scent->share + i, load4(scent->spread + i) * load4(cur + i));
+		}
+		for (; x <= layers->w; x++)
+		{
+			int i = row + x;
+			scent->share[i] = scent->spread[i] * cur[i];
+		}
+	}
+	for (y = 1; y <= layers->h; y++)
+	{
+		int row = y * stride;
+		for (x = 1; x + 3 <= layers->w; x += 4)
+		{
+			int i = row + x;
+			v4f sum = load4(share + i - 1) + load4(share + i + 1)
+				+ load4(share + i - stride) + load4(share + i + stride);
+			store4(scent->next + i, load4(scent->keep + i) * load4(cur + i)
+			       + load4(scent->open + i) * sum);
+		}
+		for (; x <= layers->w; x++)
+		{
+			int i = row + x;
+			float sum = share[i - 1] + share[i + 1] + share[i - stride] + share[i + stride];
+			scent->next[i] = scent->keep[i] * cur[i] + scent->open[i] * sum;
+		}
+	}
+
+	float *tmp = scent->cur;
+	scent->cur = scent->next;
+	scent->next = tmp;
+}
@@ -0,0 +1,46 @@
+/* -*- c-basic-offset: 8 -*- */
+/* This file contains field of view (sight map) calculation, by raycasting
+   like Actor:updateSight() used to. */
+
+#include <stdlib.h>
+#include <math.h>
+#include "nush.h"
+
+
+/* Cast one ray from the centre of the origin tile */
+static void trace_ray(SightRequest *req, double xoffset, double yoffset)
+{
+	/* the center of a tile is at (+0.5, +0.5) */
+	double curx = req->x + 0.5, cury = req->y + 0.5;
+	int x = floor(curx), y = floor(cury);
+	int length = 0;
+
+	do
+	{
+		int idx = (x - 1) + (y - 1) * req->w;
+		req->visible[idx] = 1;
+
+		/* the point of origin and opaque obstacles are always visible */
+		if (length > 0 && req->opacity[idx])
+			break;
+
+		curx += xoffset;
+		cury += yoffset;
+		x = floor(curx);
+		y = floor(cury);
+		length++;
+	} while (length <= req->range && x >= 1 && x <= req->w && y >= 1 && y <= req->h);
+}
+
+/* Compute the sight map for a SightRequest; may be run on a worker thread */
+void SightRequest_run(void *arg)
+{
+	SightRequest *req = (SightRequest *)arg;
+
+	req->visible = calloc(req->w * req->h, 1);
+
+	/* one ray per degree; same angles as the old Lua implementation */
+	int i;
+	for (i = 1; i <= 360; i++)
+		trace_ray(req, cos(i * M_PI / 180), sin(i * M_PI / 180));
+}
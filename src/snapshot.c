@@ -0,0 +1,378 @@
+/* -*- c-basic-offset: 8 -*- */
+/* This file contains Snapshot, a copy of a graph of Lua values (e.g. the
+   state of a game) kept in a compact native buffer, from which as many
+   independent copies as wanted can be made again, e.g. to play out what
+   could happen next from the same position over and over. Tables are
+   written out once each, so references between them (and cycles) come back
+   the same; MapLayers and TimingWheels are copied natively, a memcpy of
+   each grid. What can't or shouldn't be copied (functions, other userdata,
+   and the values the caller says are shared, like prototypes) is kept by
+   reference, so a snapshot can only be restored into the lua_State it was
+   taken in. */
+
+#include <stdlib.h>
+#include <string.h>
+#include "nush.h"
+
+#define SNAPSHOT_METATABLE "nush.Snapshot"
+
+/* Tags of the values in the buffer */
+#define TAG_NIL 'n'
+#define TAG_FALSE 'f'
+#define TAG_TRUE 't'
+#define TAG_NUMBER 'd'    /* followed by a lua_Number */
+#define TAG_STRING 's'    /* a uint32 length, then the bytes */
+#define TAG_TABLE 'T'     /* key, value pairs, TAG_END, then the metatable
+                             (TAG_NIL if none) */
+#define TAG_END 'E'
+#define TAG_OBJECT 'R'    /* a uint32 id of a table or copy already written */
+#define TAG_SHARED 'S'    /* a uint32 index in the table of shared values */
+#define TAG_LAYERS 'L'    /* the next of Snapshot.layers */
+#define TAG_WHEEL 'W'     /* the next of Snapshot.wheels */
+
+
+typedef struct {
+	unsigned char *data;
+	size_t len, max;
+	int refs;                      /* registry reference to the list of
+	                                  values kept by reference */
+	MapLayers **layers;            /* copies, in the order written */
+	int num_layers;
+	struct TimingWheel **wheels;
+	int num_wheels;
+} Snapshot;
+
+/* While writing: stack indices of the tables used */
+typedef struct {
+	Snapshot *snap;
+	int seen;       /* maps what has been written to its id, or to minus
+	                   its index in 'refs' if it's kept by reference */
+	int shared;     /* set of the values to keep by reference */
+	int refs;
+	int num_objects, num_refs;
+} Writer;
+
+/* While reading */
+typedef struct {
+	Snapshot *snap;
+	size_t pos;
+	int objects;    /* stack index of the list of objects made, by id */
+	int refs;
+	int num_objects, num_layers, num_wheels;
+} Reader;
+
+static Snapshot *check_snapshot(lua_State *L, int arg)
+{
+	return luaL_checkudata(L, arg, SNAPSHOT_METATABLE);
+}
+
+static void put_bytes(Snapshot *snap, const void *bytes, size_t len)
+{
+	if (snap->len + len > snap->max)
+	{
+		while (snap->len + len > snap->max)
+			snap->max = snap->max ? snap->max * 2 : 4096;
+		snap->data = realloc(snap->data, snap->max);
+	}
+	memcpy(snap->data + snap->len, bytes, len);
+	snap->len += len;
+}
+
+static void put_tag(Snapshot *snap, unsigned char tag)
+{
+	put_bytes(snap, &tag, 1);
+}
+
+static void put_uint(Snapshot *snap, unsigned int value)
+{
+	put_bytes(snap, &value, sizeof(value));
+}
+
+static void get_bytes(Reader *r, void *bytes, size_t len)
+{
+	memcpy(bytes, r->snap->data + r->pos, len);
+	r->pos += len;
+}
+
+static unsigned int get_uint(Reader *r)
+{
+	unsigned int value;
+	get_bytes(r, &value, sizeof(value));
+	return value;
+}
+
+static void write_value(lua_State *L, Writer *w, int index);
+
+/* Writes a table, userdata or function at a stack index */
+static void write_object(lua_State *L, Writer *w, int index)
+{
+	Snapshot *snap = w->snap;
+	struct TimingWheel *wheel;
+	int id;
+
+	lua_pushvalue(L, index);
+	lua_rawget(L, w->seen);
+	id = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	if (id)
+	{
+		put_tag(snap, id > 0 ? TAG_OBJECT : TAG_SHARED);
+		put_uint(snap, id > 0 ? id : -id);
+		return;
+	}
+
+	lua_pushvalue(L, index);
+	lua_rawget(L, w->shared);
+	int shared = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+
+	lua_pushvalue(L, index);
+	if (!shared && lua_istable(L, index))
+	{
+		id = ++w->num_objects;
+		put_tag(snap, TAG_TABLE);
+	}
+	else if (!shared && MapLayers_is(L, index))
+	{
+		id = ++w->num_objects;
+		snap->layers = realloc(snap->layers, sizeof(MapLayers*) * (snap->num_layers + 1));
+		snap->layers[snap->num_layers++] = MapLayers_clone(lua_touserdata(L, index));
+		put_tag(snap, TAG_LAYERS);
+	}
+	else if (!shared && (wheel = TimingWheel_test(L, index)))
+	{
+		id = ++w->num_objects;
+		snap->wheels = realloc(snap->wheels, sizeof(struct TimingWheel*) * (snap->num_wheels + 1));
+		snap->wheels[snap->num_wheels++] = TimingWheel_clone(wheel);
+		put_tag(snap, TAG_WHEEL);
+	}
+	else
+	{
+		/* Kept by reference */
+		id = -(++w->num_refs);
+		lua_pushvalue(L, index);
+		lua_rawseti(L, w->refs, w->num_refs);
+		put_tag(snap, TAG_SHARED);
+		put_uint(snap, w->num_refs);
+	}
+	lua_pushinteger(L, id);
+	lua_rawset(L, w->seen);
+
+	if (id > 0 && lua_istable(L, index))
+	{
+		luaL_checkstack(L, 4, "tables nested too deeply to snapshot");
+		lua_pushnil(L);
+		while (lua_next(L, index))
+		{
+			int top = lua_gettop(L);
+			write_value(L, w, top - 1);
+			write_value(L, w, top);
+			lua_pop(L, 1);
+		}
+		put_tag(snap, TAG_END);
+		if (lua_getmetatable(L, index))
+		{
+			write_value(L, w, lua_gettop(L));
+			lua_pop(L, 1);
+		}
+		else
+			put_tag(snap, TAG_NIL);
+	}
+}
+
+/* Writes the value at a stack index */
+static void write_value(lua_State *L, Writer *w, int index)
+{
+	Snapshot *snap = w->snap;
+	switch (lua_type(L, index))
+	{
+	case LUA_TNIL:
+		put_tag(snap, TAG_NIL);
+		break;
+	case LUA_TBOOLEAN:
+		put_tag(snap, lua_toboolean(L, index) ? TAG_TRUE : TAG_FALSE);
+		break;
+	case LUA_TNUMBER:
+	{
+		lua_Number number = lua_tonumber(L, index);
+		put_tag(snap, TAG_NUMBER);
+		put_bytes(snap, &number, sizeof(number));
+		break;
+	}
+	case LUA_TSTRING:
+	{
+		size_t len;
+		const char *string = lua_tolstring(L, index, &len);
+		put_tag(snap, TAG_STRING);
+		put_uint(snap, len);
+		put_bytes(snap, string, len);
+		break;
+	}
+	default:
+		write_object(L, w, index);
+	}
+}
+
+/* clib.snapshot(value [, shared]) - takes a snapshot of 'value' and
+   everything it refers to. 'shared' is a set (a table whose keys are the
+   values) of the tables and userdata to keep by reference rather than copy,
+   e.g. prototypes and metatables; functions, and userdata other than
+   MapLayers and TimingWheels, are always kept by reference. Returns a
+   Snapshot */
+int clib_snapshot(lua_State *L)
+{
+	lua_settop(L, 2);
+	if (lua_isnil(L, 2))
+	{
+		lua_newtable(L);
+		lua_replace(L, 2);
+	}
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	Snapshot *snap = lua_newuserdata(L, sizeof(Snapshot));
+	memset(snap, 0, sizeof(Snapshot));
+	snap->refs = LUA_NOREF;
+	luaL_getmetatable(L, SNAPSHOT_METATABLE);
+	lua_setmetatable(L, -2);
+
+	Writer w;
+	w.snap = snap;
+	w.shared = 2;
+	lua_newtable(L);
+	w.seen = lua_gettop(L);
+	lua_newtable(L);
+	w.refs = lua_gettop(L);
+	w.num_objects = w.num_refs = 0;
+	write_value(L, &w, 1);
+
+	snap->refs = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_pop(L, 1);
+	return 1;
+}
+
+/* Reads a value, pushing it */
+static void read_value(lua_State *L, Reader *r)
+{
+	unsigned char tag;
+	get_bytes(r, &tag, 1);
+	switch (tag)
+	{
+	case TAG_NIL:
+		lua_pushnil(L);
+		break;
+	case TAG_FALSE:
+	case TAG_TRUE:
+		lua_pushboolean(L, tag == TAG_TRUE);
+		break;
+	case TAG_NUMBER:
+	{
+		lua_Number number;
+		get_bytes(r, &number, sizeof(number));
+		lua_pushnumber(L, number);
+		break;
+	}
+	case TAG_STRING:
+	{
+		unsigned int len = get_uint(r);
+		lua_pushlstring(L, (const char*)r->snap->data + r->pos, len);
+		r->pos += len;
+		break;
+	}
+	case TAG_OBJECT:
+		lua_rawgeti(L, r->objects, get_uint(r));
+		break;
+	case TAG_SHARED:
+		lua_rawgeti(L, r->refs, get_uint(r));
+		break;
+	case TAG_LAYERS:
+		MapLayers_push_clone(L, r->snap->layers[r->num_layers++]);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, r->objects, ++r->num_objects);
+		break;
+	case TAG_WHEEL:
+		TimingWheel_push_clone(L, r->snap->wheels[r->num_wheels++]);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, r->objects, ++r->num_objects);
+		break;
+	case TAG_TABLE:
+		luaL_checkstack(L, 4, "tables nested too deeply to restore");
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, r->objects, ++r->num_objects);
+		while (r->snap->data[r->pos] != TAG_END)
+		{
+			read_value(L, r);
+			read_value(L, r);
+			lua_rawset(L, -3);
+		}
+		r->pos++;
+		read_value(L, r);
+		if (lua_isnil(L, -1))
+			lua_pop(L, 1);
+		else
+			lua_setmetatable(L, -2);
+		break;
+	default:
+		luaL_error(L, "corrupt snapshot");
+	}
+}
+
+/* snap:restore() - returns a new copy of the value the snapshot was taken
+   of, as it was then. The values kept by reference are the same ones,
+   whatever has happened to them since */
+static int snapshot_restore(lua_State *L)
+{
+	Reader r;
+	r.snap = check_snapshot(L, 1);
+	r.pos = 0;
+	r.num_objects = r.num_layers = r.num_wheels = 0;
+	lua_newtable(L);
+	r.objects = lua_gettop(L);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, r.snap->refs);
+	r.refs = lua_gettop(L);
+	read_value(L, &r);
+	return 1;
+}
+
+/* snap:size() - returns the size in bytes of the snapshot's buffer, and the
+   number of MapLayers and TimingWheels copied alongside it */
+static int snapshot_size(lua_State *L)
+{
+	Snapshot *snap = check_snapshot(L, 1);
+	lua_pushinteger(L, snap->len);
+	lua_pushinteger(L, snap->num_layers + snap->num_wheels);
+	return 2;
+}
+
+static int snapshot_gc(lua_State *L)
+{
+	Snapshot *snap = check_snapshot(L, 1);
+	int i;
+	for (i = 0; i < snap->num_layers; i++)
+		MapLayers_free(snap->layers[i]);
+	for (i = 0; i < snap->num_wheels; i++)
+		TimingWheel_free(snap->wheels[i]);
+	free(snap->layers);
+	free(snap->wheels);
+	free(snap->data);
+	luaL_unref(L, LUA_REGISTRYINDEX, snap->refs);
+	return 0;
+}
+
+static luaL_Reg snapshot_methods[] = {
+	{	"restore",		snapshot_restore },
+	{	"size",			snapshot_size },
+	{	NULL,			NULL }
+};
+
+/* Create the metatable used for Snapshot userdata */
+void Snapshot_init_metatable(lua_State *L)
+{
+	luaL_newmetatable(L, SNAPSHOT_METATABLE);
+	lua_pushcfunction(L, snapshot_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_newtable(L);
+	luaL_setfuncs(L, snapshot_methods, 0);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+}
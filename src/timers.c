@@ -0,0 +1,239 @@
+/* -*- c-basic-offset: 8 -*- */
+/* This file contains TimingWheel, a scheduler of timers counted in turns:
+   a ring of slots, one per turn, each holding a list of the timers due on
+   that turn (or on that turn of a later revolution of the ring). Scheduling
+   and cancelling a timer are O(1), and advancing by a turn only looks at
+   one slot, so timers which aren't due cost nothing. A timer carries two
+   integers for the Lua code to tell what it is for. */
+
+#include <stdlib.h>
+#include <string.h>
+#include "nush.h"
+
+#define WHEEL_METATABLE "nush.TimingWheel"
+
+
+typedef struct {
+	long due;        /* turn the timer is due, or -1 if it isn't in use */
+	int prev, next;  /* in the list of its slot (or the free list), or -1 */
+	int a, b;
+} Timer;
+
+typedef struct TimingWheel {
+	long now;
+	int num_slots;
+	int *slots;      /* first timer in each slot, or -1 */
+	Timer *timers;
+	int max_timers;
+	int free_list;
+} TimingWheel;
+
+static TimingWheel *check_wheel(lua_State *L, int arg)
+{
+	return luaL_checkudata(L, arg, WHEEL_METATABLE);
+}
+
+/* Takes a timer off the list of its slot */
+static void unlink_timer(TimingWheel *wheel, int t)
+{
+	Timer *timer = &wheel->timers[t];
+	if (timer->prev >= 0)
+		wheel->timers[timer->prev].next = timer->next;
+	else
+		wheel->slots[timer->due % wheel->num_slots] = timer->next;
+	if (timer->next >= 0)
+		wheel->timers[timer->next].prev = timer->prev;
+	timer->due = -1;
+	timer->next = wheel->free_list;
+	wheel->free_list = t;
+}
+
+/* clib.newTimingWheel([slots]) - create a timing wheel at turn 0, with a
+   ring of 'slots' turns (default 64); timers due further ahead than that
+   work, but are looked at once every revolution of the ring */
+int clib_newtimingwheel(lua_State *L)
+{
+	int num_slots = luaL_optinteger(L, 1, 64), i;
+	if (num_slots < 1)
+		luaL_error(L, "a timing wheel needs at least one slot");
+
+	TimingWheel *wheel = lua_newuserdata(L, sizeof(TimingWheel));
+	wheel->now = 0;
+	wheel->num_slots = num_slots;
+	wheel->slots = malloc(sizeof(int) * num_slots);
+	for (i = 0; i < num_slots; i++)
+		wheel->slots[i] = -1;
+	wheel->max_timers = 0;
+	wheel->timers = NULL;
+	wheel->free_list = -1;
+
+	luaL_getmetatable(L, WHEEL_METATABLE);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+/* Returns the TimingWheel at a stack index, or NULL if it isn't one */
+TimingWheel *TimingWheel_test(lua_State *L, int index)
+{
+	if (lua_type(L, index) != LUA_TUSERDATA || !lua_getmetatable(L, index))
+		return NULL;
+	luaL_getmetatable(L, WHEEL_METATABLE);
+	int is_wheel = lua_rawequal(L, -1, -2);
+	lua_pop(L, 2);
+	return is_wheel ? lua_touserdata(L, index) : NULL;
+}
+
+/* Makes 'to' an independent copy of a timing wheel */
+static void copy_wheel(TimingWheel *to, const TimingWheel *from)
+{
+	*to = *from;
+	to->slots = malloc(sizeof(int) * from->num_slots);
+	memcpy(to->slots, from->slots, sizeof(int) * from->num_slots);
+	to->timers = malloc(sizeof(Timer) * (from->max_timers ? from->max_timers : 1));
+	memcpy(to->timers, from->timers, sizeof(Timer) * from->max_timers);
+}
+
+/* Returns a newly allocated copy of a timing wheel, not owned by Lua; free
+   it with TimingWheel_free() */
+TimingWheel *TimingWheel_clone(const TimingWheel *from)
+{
+	TimingWheel *wheel = malloc(sizeof(TimingWheel));
+	copy_wheel(wheel, from);
+	return wheel;
+}
+
+/* Pushes a copy of a timing wheel as a new userdata */
+void TimingWheel_push_clone(lua_State *L, const TimingWheel *from)
+{
+	TimingWheel *wheel = lua_newuserdata(L, sizeof(TimingWheel));
+	copy_wheel(wheel, from);
+	luaL_getmetatable(L, WHEEL_METATABLE);
+	lua_setmetatable(L, -2);
+}
+
+/* Frees what a timing wheel holds (but not the wheel itself) */
+static void release_wheel(TimingWheel *wheel)
+{
+	free(wheel->slots);
+	free(wheel->timers);
+}
+
+/* Frees a timing wheel made by TimingWheel_clone() */
+void TimingWheel_free(TimingWheel *wheel)
+{
+	release_wheel(wheel);
+	free(wheel);
+}
+
+static int wheel_gc(lua_State *L)
+{
+	release_wheel(check_wheel(L, 1));
+	return 0;
+}
+
+/* wheel:schedule(delay, a, b) - set a timer due 'delay' turns (at least 1)
+   from now, carrying the integers a and b. Returns a handle for the timer,
+   which is only valid until it has been cancelled or has gone off */
+static int wheel_schedule(lua_State *L)
+{
+	TimingWheel *wheel = check_wheel(L, 1);
+	int delay = luaL_checkinteger(L, 2), i;
+	if (delay < 1)
+		luaL_error(L, "timers must be due at least one turn from now");
+
+	if (wheel->free_list < 0)
+	{
+		int old_max = wheel->max_timers;
+		wheel->max_timers = old_max ? old_max * 2 : 64;
+		wheel->timers = realloc(wheel->timers, sizeof(Timer) * wheel->max_timers);
+		for (i = wheel->max_timers - 1; i >= old_max; i--)
+		{
+			wheel->timers[i].due = -1;
+			wheel->timers[i].next = wheel->free_list;
+			wheel->free_list = i;
+		}
+	}
+	int t = wheel->free_list, slot;
+	Timer *timer = &wheel->timers[t];
+	wheel->free_list = timer->next;
+
+	timer->due = wheel->now + delay;
+	timer->a = luaL_checkinteger(L, 3);
+	timer->b = luaL_checkinteger(L, 4);
+	slot = timer->due % wheel->num_slots;
+	timer->prev = -1;
+	timer->next = wheel->slots[slot];
+	if (timer->next >= 0)
+		wheel->timers[timer->next].prev = t;
+	wheel->slots[slot] = t;
+
+	lua_pushinteger(L, t + 1);
+	return 1;
+}
+
+/* wheel:cancel(handle) - stop a timer before it goes off. Returns true if
+   it was still set */
+static int wheel_cancel(lua_State *L)
+{
+	TimingWheel *wheel = check_wheel(L, 1);
+	int t = luaL_checkinteger(L, 2) - 1;
+	int active = t >= 0 && t < wheel->max_timers && wheel->timers[t].due >= 0;
+	if (active)
+		unlink_timer(wheel, t);
+	lua_pushboolean(L, active);
+	return 1;
+}
+
+/* wheel:advance() - move on to the next turn. Returns a flat list
+   {handle, a, b, ...} of the timers which went off, which are no longer
+   set */
+static int wheel_advance(lua_State *L)
+{
+	TimingWheel *wheel = check_wheel(L, 1);
+	int t, next, num = 0;
+	wheel->now++;
+
+	lua_newtable(L);
+	for (t = wheel->slots[wheel->now % wheel->num_slots]; t >= 0; t = next)
+	{
+		Timer *timer = &wheel->timers[t];
+		next = timer->next;
+		if (timer->due != wheel->now)
+			continue;
+		lua_pushinteger(L, t + 1);
+		lua_rawseti(L, -2, ++num);
+		lua_pushinteger(L, timer->a);
+		lua_rawseti(L, -2, ++num);
+		lua_pushinteger(L, timer->b);
+		lua_rawseti(L, -2, ++num);
+		unlink_timer(wheel, t);
+	}
+	return 1;
+}
+
+/* wheel:now() - returns the current turn of the wheel */
+static int wheel_now(lua_State *L)
+{
+	lua_pushinteger(L, check_wheel(L, 1)->now);
+	return 1;
+}
+
+static luaL_Reg wheel_methods[] = {
+	{	"schedule",		wheel_schedule },
+	{	"cancel",		wheel_cancel },
+	{	"advance",		wheel_advance },
+	{	"now",			wheel_now },
+	{	NULL,			NULL }
+};
+
+/* Create the metatable used for TimingWheel userdata */
+void TimingWheel_init_metatable(lua_State *L)
+{
+	luaL_newmetatable(L, WHEEL_METATABLE);
+	lua_pushcfunction(L, wheel_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_newtable(L);
+	luaL_setfuncs(L, wheel_methods, 0);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+}